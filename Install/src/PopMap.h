@@ -24,8 +24,11 @@
 
 #include "locus.h"
 #include <string.h>
+#include <stdlib.h>
 #include <string>
 using std::string;
+#include <iostream>
+using std::cerr;
 #include <vector>
 using std::vector;
 #include <map>
@@ -36,6 +39,227 @@ using std::set;
 #include <utility>
 using std::pair;
 using std::make_pair;
+#include <stdint.h>
+
+//
+// Dictionary of the distinct haplotypes observed at a single catalog locus. Each
+// haplotype string is stored once and samples refer to it by a 16-bit code, found
+// through an open-addressing hash table kept at most half full. The allele table
+// records, for each haplotype, the nucleotide found at each SNP column (0-3 for A,
+// C, G, T; -1 for anything else) so that allele tallies become table lookups rather
+// than character switches.
+//
+class HapDict {
+    vector<char *> haps;
+    vector<int>    slots;  // Hash table of haplotype codes, -1 if empty.
+    vector<int8_t> alleles;
+    uint           width;
+
+    //
+    // Slot of a haplotype in the hash table: the slot holding its code, or the empty
+    // slot where its code belongs.
+    //
+    uint slot(const char *hap) {
+	uint mask = this->slots.size() - 1;
+	uint s    = hash(hap, strlen(hap)) & mask;
+	while (this->slots[s] >= 0 && strcmp(this->haps[this->slots[s]], hap) != 0)
+	    s = (s + 1) & mask;
+	return s;
+    }
+
+    void rehash(uint size) {
+	this->slots.assign(size, -1);
+	for (uint i = 0; i < this->haps.size(); i++)
+	    this->slots[this->slot(this->haps[i])] = i;
+    }
+
+    //
+    // Return the slot of a haplotype, growing the table first if a new code could
+    // overfill it.
+    //
+    uint find(const char *hap) {
+	if (2 * (this->haps.size() + 1) > this->slots.size())
+	    this->rehash(this->slots.size() > 0 ? 2 * this->slots.size() : 16);
+	return this->slot(hap);
+    }
+
+    uint16_t insert(uint s, char *h) {
+	if (this->haps.size() >= max_codes) {
+	    cerr << "Error: more than " << max_codes << " distinct haplotypes at a single locus.\n";
+	    exit(1);
+	}
+	this->slots[s] = this->haps.size();
+	this->haps.push_back(h);
+	return this->haps.size() - 1;
+    }
+
+public:
+    static const uint max_codes = 65536;
+
+    HapDict()  { width = 0; }
+    ~HapDict() {
+	for (uint i = 0; i < this->haps.size(); i++)
+	    delete [] this->haps[i];
+    }
+
+    //
+    // 64-bit FNV-1a hash of len characters.
+    //
+    static uint64_t hash(const char *p, uint len) {
+	uint64_t h = 14695981039346656037ULL;
+	for (uint k = 0; k < len; k++)
+	    h = (h ^ (unsigned char) p[k]) * 1099511628211ULL;
+	return h;
+    }
+
+    uint        size()          { return this->haps.size(); }
+    const char *hap(uint code)  { return this->haps[code]; }
+    int         allele(uint code, uint snp_index) {
+	return snp_index < this->width ? this->alleles[code * this->width + snp_index] : -1;
+    }
+
+    //
+    // Return the code for a haplotype, adding it to the dictionary if it has not been seen.
+    //
+    uint16_t add(const char *hap) {
+	uint s = this->find(hap);
+	if (this->slots[s] >= 0)
+	    return this->slots[s];
+
+	char *h = new char[strlen(hap) + 1];
+	strcpy(h, hap);
+
+	return this->insert(s, h);
+    }
+
+    //
+    // As add(), but if the haplotype is new the dictionary takes ownership of the
+    // caller's buffer instead of copying it; the caller's pointer is then set to NULL.
+    //
+    uint16_t adopt(char *&hap) {
+	uint s = this->find(hap);
+	if (this->slots[s] >= 0)
+	    return this->slots[s];
+
+	uint16_t code = this->insert(s, hap);
+	hap = NULL;
+
+	return code;
+    }
+
+    //
+    // Replace the dictionary contents, taking ownership of the new haplotype strings,
+    // which must be distinct.
+    //
+    void assign(vector<char *> &new_haps) {
+	for (uint i = 0; i < this->haps.size(); i++)
+	    delete [] this->haps[i];
+	this->haps = new_haps;
+	this->slots.clear();
+	if (this->haps.size() > 0) {
+	    uint size = 16;
+	    while (size < 2 * this->haps.size()) size *= 2;
+	    this->rehash(size);
+	}
+	this->tabulate();
+    }
+
+    //
+    // Build the allele table from the current set of haplotypes.
+    //
+    void tabulate() {
+	uint len;
+
+	this->width = 0;
+	for (uint i = 0; i < this->haps.size(); i++) {
+	    len = strlen(this->haps[i]);
+	    if (len > this->width) this->width = len;
+	}
+
+	this->alleles.assign(this->haps.size() * this->width, -1);
+
+	for (uint i = 0; i < this->haps.size(); i++)
+	    for (const char *p = this->haps[i]; *p != '\0'; p++)
+		this->alleles[i * this->width + (p - this->haps[i])] = nuc_index(*p);
+    }
+
+    //
+    // Count the distinct nucleotides present at a SNP among a set of haplotype codes.
+    //
+    int distinct_alleles(vector<uint16_t> &codes, uint snp_index) {
+	uint seen = 0;
+	int  nuc;
+
+	for (uint j = 0; j < codes.size(); j++) {
+	    nuc = this->allele(codes[j], snp_index);
+	    if (nuc >= 0) seen |= 1 << nuc;
+	}
+
+	return __builtin_popcount(seen);
+    }
+
+    static int8_t nuc_index(char nuc) {
+	switch(nuc) {
+	case 'A':
+	case 'a':
+	    return 0;
+	case 'C':
+	case 'c':
+	    return 1;
+	case 'G':
+	case 'g':
+	    return 2;
+	case 'T':
+	case 't':
+	    return 3;
+	}
+	return -1;
+    }
+};
+
+//
+// Model calls for one sample at one locus. Nearly every column is called hOmozygous,
+// so rather than a full copy of the O/E/U string only the columns with any other call
+// are stored, as sorted (column, call) pairs; all remaining columns decode to 'O'.
+//
+class ModelCalls {
+    vector<pair<uint16_t, char> > calls;
+
+public:
+    void assign(const char *model) {
+	this->calls.clear();
+	for (const char *p = model; *p != '\0'; p++)
+	    if (*p != 'O')
+		this->calls.push_back(make_pair((uint16_t) (p - model), *p));
+	vector<pair<uint16_t, char> >(this->calls).swap(this->calls);
+    }
+
+    char operator[](uint pos) const {
+	vector<pair<uint16_t, char> >::const_iterator it = 
+	    lower_bound(this->calls.begin(), this->calls.end(), make_pair((uint16_t) pos, (char) 0));
+	return (it != this->calls.end() && it->first == pos) ? it->second : 'O';
+    }
+
+    void set(uint pos, char call) {
+	vector<pair<uint16_t, char> >::iterator it = 
+	    lower_bound(this->calls.begin(), this->calls.end(), make_pair((uint16_t) pos, (char) 0));
+	if (it != this->calls.end() && it->first == pos) {
+	    if (call == 'O')
+		this->calls.erase(it);
+	    else
+		it->second = call;
+	} else if (call != 'O') {
+	    this->calls.insert(it, make_pair((uint16_t) pos, call));
+	}
+    }
+
+    //
+    // Iterate over the stored, non-'O' calls.
+    //
+    uint     size()         const { return this->calls.size(); }
+    uint16_t col(uint i)    const { return this->calls[i].first; }
+    char     call(uint i)   const { return this->calls[i].second; }
+};
 
 class Datum {
 public:
@@ -45,30 +269,181 @@ public:
     int            tot_depth;     // Stack depth
     vector<int>    depth;         // Stack depth of each matching allele
     bool           corrected;     // Has this genotype call been corrected
-    char          *model;         // String representing SNP model output for each nucleotide at this locus.
+    ModelCalls     model;         // SNP model output for each nucleotide at this locus.
     char          *gtype;         // Genotype
     char          *trans_gtype;   // Translated Genotype
     double         lnl;           // Log likelihood of this locus.
-    vector<char *> obshap;        // Observed Haplotypes
+    vector<uint16_t> obshap;      // Observed Haplotypes, as codes into the locus HapDict
     vector<SNP *>  snps;
-    Datum()  { corrected = false; gtype = NULL; trans_gtype = NULL; model = NULL; tot_depth = 0; len = 0; lnl = 0.0; merge_partner = 0; }
+    Datum()  { corrected = false; gtype = NULL; trans_gtype = NULL; tot_depth = 0; len = 0; lnl = 0.0; merge_partner = 0; }
     ~Datum() {
-    	for (uint i = 0; i < this->obshap.size(); i++)
-    	    delete [] this->obshap[i];
     	for (uint i = 0; i < this->snps.size(); i++)
 	    delete this->snps[i];
     	delete [] this->gtype;
 	delete [] this->trans_gtype;
-	delete [] this->model;
     }
 };
 
-template<class LocusT=Locus>
+//
+// Bit-packed genotype matrix for a single catalog locus. For each SNP column we store
+// a set of sample bitsets (bit planes), so that population-level counts reduce to
+// popcounts over the sample range belonging to a population:
+//
+//   observed:   sample has data and the model call is not 'U'
+//   called:     sample has data and the model call is 'E' or 'O'
+//   nuc_a..t:   an observed sample carries this allele in one of its haplotypes
+//   het:        a called sample carries exactly two distinct alleles
+//   first_a..t: allele in the first haplotype of a called, non-heterozygous sample
+//
+// Fixed positions only need to know which samples are present, so a single locus-wide
+// plane is kept for them, along with the few samples whose sequence is shorter than
+// the catalog locus and the positions where a sample was called heterozygous.
+//
+class GenoMatrix {
+    uint len;
+    uint num_snps;
+    uint num_words;
+    vector<uint64_t> bits;                   // present plane, followed by [snp][plane][word]
+    vector<pair<uint, uint> >     short_smp; // Sample index => sequence length, if shorter than the locus.
+    vector<pair<uint16_t, uint> > fixed_het; // Sorted (column, sample) pairs with an 'E' call at a non-SNP column.
+
+    uint64_t *plane(uint snp_index, uint p) {
+	return &this->bits[this->num_words * (1 + snp_index * plane_cnt + p)];
+    }
+    void set(uint64_t *bs, uint sample) {
+	bs[sample >> 6] |= (uint64_t) 1 << (sample & 63);
+    }
+    uint count(const uint64_t *bs, uint start, uint end) {
+	uint     sw = start >> 6;
+	uint     ew = end   >> 6;
+	uint64_t lo = ~(uint64_t) 0 << (start & 63);
+	uint64_t hi = ~(uint64_t) 0 >> (63 - (end & 63));
+	uint     cnt;
+
+	if (sw == ew)
+	    return __builtin_popcountll(bs[sw] & lo & hi);
+
+	cnt = __builtin_popcountll(bs[sw] & lo) + __builtin_popcountll(bs[ew] & hi);
+	for (uint w = sw + 1; w < ew; w++)
+	    cnt += __builtin_popcountll(bs[w]);
+
+	return cnt;
+    }
+
+public:
+    enum {observed, called, nuc_a, nuc_c, nuc_g, nuc_t, het, first_a, first_c, first_g, first_t, plane_cnt};
+
+    GenoMatrix(uint, uint, uint);
+
+    int  add_sample(uint, Datum *, HapDict *, vector<uint> &);
+    void finalize() { sort(this->fixed_het.begin(), this->fixed_het.end()); }
+
+    //
+    // Number of samples in [start, end] set in plane p of a SNP.
+    //
+    uint count(uint snp_index, uint p, uint start, uint end) {
+	return this->count(this->plane(snp_index, p), start, end);
+    }
+    //
+    // Number of samples in [start, end] with data at this locus.
+    //
+    uint samples(uint start, uint end) {
+	return this->count(&this->bits[0], start, end);
+    }
+    //
+    // Number of samples in [start, end] with sequence covering a fixed column.
+    //
+    uint present(uint pos, uint start, uint end) {
+	uint cnt = this->count(&this->bits[0], start, end);
+	for (uint i = 0; i < this->short_smp.size(); i++)
+	    if (this->short_smp[i].first >= start && this->short_smp[i].first <= end && pos >= this->short_smp[i].second)
+		cnt--;
+	return cnt;
+    }
+    //
+    // Samples in [start, end] that were called heterozygous at a fixed column.
+    //
+    void fixed_hets(uint pos, uint start, uint end, vector<uint> &samples) {
+	vector<pair<uint16_t, uint> >::iterator it;
+
+	samples.clear();
+	it = lower_bound(this->fixed_het.begin(), this->fixed_het.end(), make_pair((uint16_t) pos, start));
+	for (; it != this->fixed_het.end() && it->first == pos && it->second <= end; it++)
+	    samples.push_back(it->second);
+    }
+};
+
+inline
+GenoMatrix::GenoMatrix(uint len, uint num_snps, uint num_samples)
+{
+    this->len       = len;
+    this->num_snps  = num_snps;
+    this->num_words = (num_samples + 63) / 64;
+    this->bits.assign(this->num_words * (1 + num_snps * plane_cnt), 0);
+}
+
+inline int
+GenoMatrix::add_sample(uint sample, Datum *d, HapDict *h, vector<uint> &cols)
+{
+    uint     pos;
+    int      nuc;
+    char     call;
+
+    this->set(&this->bits[0], sample);
+
+    if ((uint) d->len < this->len)
+	this->short_smp.push_back(make_pair(sample, (uint) d->len));
+
+    for (uint k = 0; k < this->num_snps; k++) {
+	pos = cols[k];
+	if (pos >= (uint) d->len) continue;
+
+	call = d->model[pos];
+	if (call == 'U') continue;
+
+	this->set(this->plane(k, observed), sample);
+
+	for (uint j = 0; j < d->obshap.size(); j++) {
+	    nuc = h->allele(d->obshap[j], k);
+	    if (nuc >= 0) this->set(this->plane(k, nuc_a + nuc), sample);
+	}
+
+	if (call != 'E' && call != 'O') continue;
+
+	this->set(this->plane(k, called), sample);
+
+	if (d->obshap.size() > 1 && h->distinct_alleles(d->obshap, k) == 2)
+	    this->set(this->plane(k, het), sample);
+	else if ((nuc = h->allele(d->obshap[0], k)) >= 0)
+	    this->set(this->plane(k, first_a + nuc), sample);
+    }
+
+    //
+    // Record heterozygous model calls at the remaining, fixed columns.
+    //
+    uint k = 0;
+    for (uint i = 0; i < d->model.size(); i++) {
+	pos = d->model.col(i);
+	if (pos >= this->len || pos >= (uint) d->len) break;
+	if (d->model.call(i) != 'E') continue;
+
+	while (k < this->num_snps && cols[k] < pos) k++;
+	if (k < this->num_snps && cols[k] == pos) continue;
+
+	this->fixed_het.push_back(make_pair((uint16_t) pos, sample));
+    }
+
+    return 0;
+}
+
+template<class LocusT=PLocus>
 class PopMap {
     set<pair<int, int> > blacklist;
     int      num_loci;
     int      num_samples;
     Datum ***data;
+    HapDict **haps;             // Observed haplotype dictionary for each locus.
+    GenoMatrix **geno;          // Bit-packed genotypes at each locus, built once model calls are loaded.
     map<int, int> locus_order;  // LocusID => ArrayIndex; map catalog IDs to their first dimension 
                                 // position in the Datum array.
     map<int, int> rev_locus_order;
@@ -83,6 +458,7 @@ public:
     ~PopMap();
 
     int populate(vector<int> &, map<int, LocusT*> &, vector<vector<CatMatch *> > &);
+    int index_genotypes(map<int, LocusT*> &);
     int prune(set<int> &);
 
     int loci_cnt() { return this->num_loci; }
@@ -93,15 +469,21 @@ public:
 
     Datum **locus(int);
     Datum  *datum(int, int);
+    HapDict *haplotypes(int);
+    GenoMatrix *genotypes(int);
     bool    blacklisted(int, int);
 };
 
 template<class LocusT>
 PopMap<LocusT>::PopMap(int num_samples, int num_loci) {
     this->data = new Datum **[num_loci];
+    this->haps = new HapDict *[num_loci];
+    this->geno = new GenoMatrix *[num_loci];
 
     for (int i = 0; i < num_loci; i++) {
 	this->data[i] = new Datum *[num_samples];
+	this->haps[i] = new HapDict;
+	this->geno[i] = NULL;
 
 	for (int j = 0; j < num_samples; j++)
 	    this->data[i][j] = NULL;
@@ -117,10 +499,20 @@ PopMap<LocusT>::~PopMap() {
 	for (int j = 0; j < this->num_samples; j++)
 	    delete this->data[i][j];
 	delete [] this->data[i];
+	delete this->haps[i];
+	delete this->geno[i];
     }
     delete [] this->data;
+    delete [] this->haps;
+    delete [] this->geno;
 }
 
+//
+// Populate the datum array from the catalog matches of each sample. Ownership of the
+// parsed haplotype strings is transferred to the locus haplotype dictionaries and the
+// match records of each sample are freed as soon as they have been consumed, so
+// matches is left holding only empty vectors.
+//
 template<class LocusT>
 int PopMap<LocusT>::populate(vector<int> &sample_ids,
 			     map<int, LocusT*> &catalog,
@@ -151,8 +543,9 @@ int PopMap<LocusT>::populate(vector<int> &sample_ids,
     // Sort the catalog loci on each chromosome according to base pair.
     //
     typename map<string, vector<LocusT*> >::iterator cit;
+    bool (*cmp)(LocusT *, LocusT *) = bp_compare;
     for (cit = this->ordered_loci.begin(); cit != this->ordered_loci.end(); cit++)
-	sort(cit->second.begin(), cit->second.end(), bp_compare);
+	sort(cit->second.begin(), cit->second.end(), cmp);
 
     //
     // Populate the datum array
@@ -178,9 +571,7 @@ int PopMap<LocusT>::populate(vector<int> &sample_ids,
 		    // cerr << "Creating new datum for tag ID: " << matches[i][j]->tag_id << "\n";
 		    d = new Datum;
 		    d->id = matches[i][j]->tag_id;
-		    char *h = new char[strlen(matches[i][j]->haplotype) + 1];
-		    strcpy(h, matches[i][j]->haplotype);
-		    d->obshap.push_back(h);
+		    d->obshap.push_back(this->haps[locus]->adopt(matches[i][j]->haplotype));
 		    d->depth.push_back(matches[i][j]->depth);
 		    d->tot_depth += matches[i][j]->depth;
 		    d->lnl        = matches[i][j]->lnl;
@@ -196,9 +587,7 @@ int PopMap<LocusT>::populate(vector<int> &sample_ids,
 		// match this locus and the locus is invalid, set back to NULL.
 		//
 		if (matches[i][j]->tag_id == this->data[locus][sample]->id) {
-		    char *h = new char[strlen(matches[i][j]->haplotype) + 1];
-		    strcpy(h, matches[i][j]->haplotype);
-		    this->data[locus][sample]->obshap.push_back(h);
+		    this->data[locus][sample]->obshap.push_back(this->haps[locus]->adopt(matches[i][j]->haplotype));
 		    this->data[locus][sample]->depth.push_back(matches[i][j]->depth);
 		    this->data[locus][sample]->tot_depth += matches[i][j]->depth;
 		    this->data[locus][sample]->lnl        = matches[i][j]->lnl;
@@ -213,6 +602,52 @@ int PopMap<LocusT>::populate(vector<int> &sample_ids,
 		}
 	    }
 	}
+
+	//
+	// The haplotypes of this sample now live in the locus dictionaries, release
+	// its match records.
+	//
+	for (uint j = 0; j < matches[i].size(); j++)
+	    delete matches[i][j];
+	vector<CatMatch *>().swap(matches[i]);
+    }
+
+    //
+    // Build the allele lookup tables now that every haplotype has been recorded.
+    //
+    for (int k = 0; k < this->num_loci; k++)
+	this->haps[k]->tabulate();
+
+    return 0;
+}
+
+template<class LocusT>
+int PopMap<LocusT>::index_genotypes(map<int, LocusT*> &catalog) {
+    //
+    // Build the bit-packed genotype matrix for each locus. This is a snapshot of the
+    // model calls and haplotypes as they stand when summary statistics are computed.
+    //
+    typename std::map<int, LocusT*>::iterator it;
+    vector<uint> cols;
+    LocusT *loc;
+    int     l;
+
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	loc = it->second;
+	l   = this->locus_order[loc->id];
+
+	cols.clear();
+	for (uint k = 0; k < loc->snp_cnt; k++)
+	    cols.push_back(loc->snps[k]);
+
+	delete this->geno[l];
+	this->geno[l] = new GenoMatrix(loc->len, cols.size(), this->num_samples);
+
+	for (int j = 0; j < this->num_samples; j++)
+	    if (this->data[l][j] != NULL)
+		this->geno[l]->add_sample(j, this->data[l][j], this->haps[l], cols);
+
+	this->geno[l]->finalize();
     }
 
     return 0;
@@ -225,6 +660,8 @@ int PopMap<LocusT>::prune(set<int> &remove_ids) {
     map<int, int> new_loc_order, new_rev_loc_order;
 
     Datum ***d = new Datum **[new_size];
+    HapDict **h = new HapDict *[new_size];
+    GenoMatrix **g = new GenoMatrix *[new_size];
 
     int j = 0;
     for (int i = 0; i < this->num_loci; i++) {
@@ -236,6 +673,8 @@ int PopMap<LocusT>::prune(set<int> &remove_ids) {
 	//
 	if (remove_ids.count(loc_id) == 0) {
 	    d[j] = this->data[i];
+	    h[j] = this->haps[i];
+	    g[j] = this->geno[i];
 	    new_loc_order[loc_id] = j;
 	    new_rev_loc_order[j] = loc_id;
 	    j++;
@@ -247,12 +686,18 @@ int PopMap<LocusT>::prune(set<int> &remove_ids) {
 	    for (int k = 0; k < this->num_samples; k++)
 		delete this->data[i][k];
 	    delete [] this->data[i];
+	    delete this->haps[i];
+	    delete this->geno[i];
 	}
     }
 
     delete [] this->data;
+    delete [] this->haps;
+    delete [] this->geno;
 
     this->data = d;
+    this->haps = h;
+    this->geno = g;
     this->locus_order.clear();
     this->locus_order = new_loc_order;
     this->rev_locus_order.clear();
@@ -275,8 +720,9 @@ int PopMap<LocusT>::prune(set<int> &remove_ids) {
     this->ordered_loci.clear();
     this->ordered_loci = new_ordered_loci;
 
+    bool (*cmp)(LocusT *, LocusT *) = bp_compare;
     for (cit = this->ordered_loci.begin(); cit != this->ordered_loci.end(); cit++)
-	sort(cit->second.begin(), cit->second.end(), bp_compare);
+	sort(cit->second.begin(), cit->second.end(), cmp);
 
 
     return new_size;
@@ -292,6 +738,16 @@ Datum  *PopMap<LocusT>::datum(int locus, int sample) {
     return this->data[this->locus_order[locus]][this->sample_order[sample]];
 }
 
+template<class LocusT>
+HapDict *PopMap<LocusT>::haplotypes(int locus) {
+    return this->haps[this->locus_order[locus]];
+}
+
+template<class LocusT>
+GenoMatrix *PopMap<LocusT>::genotypes(int locus) {
+    return this->geno[this->locus_order[locus]];
+}
+
 template<class LocusT>
 bool PopMap<LocusT>::blacklisted(int locus, int sample) {
     if (this->blacklist.count(make_pair(sample, locus)) > 0)
@@ -24,6 +24,8 @@
 #include <string.h>
 #include <string>
 using std::string;
+#include <iostream>
+using std::ostream;
 #include <vector>
 using std::vector;
 #include <map>
@@ -39,10 +41,9 @@ using std::make_pair;
 #include <math.h>
 
 //#include "stacks.h"
+#include "utils.h"
 
 extern bool   log_fst_comp;
-extern double minor_allele_freq;
-extern map<int, string> pop_key;
 const  uint   PopStatSize = 5;
 
 class PopStat {
@@ -122,6 +123,15 @@ public:
     double *comp;
 
     PopPair() { 
+	comp      = NULL;
+	this->clear();
+    }
+    ~PopPair() {
+	if (this->comp != NULL)
+	    delete [] comp;
+    }
+    void clear() {
+	alleles   = 0.0;
 	col       = 0;
 	pi        = 0.0;
 	fst       = 0.0;
@@ -132,11 +142,9 @@ public:
 	ci_low    = 0.0;
 	ci_high   = 0.0;
 	amova_fst = 0.0;
-	comp      = NULL;
-    }
-    ~PopPair() {
-	if (this->comp != NULL)
+	if (comp != NULL)
 	    delete [] comp;
+	comp      = NULL;
     }
 };
 
@@ -217,9 +225,11 @@ public:
 class LocTally {
 public:
     NucTally *nucs;
+    double    het_excess; // Excess of observed over expected heterozygosity, pooled over sites and populations.
 
     LocTally(int len)  { 
-	this->nucs = new NucTally[len]; 
+	this->nucs       = new NucTally[len]; 
+	this->het_excess = 0.0;
     }
     ~LocTally() {
 	delete [] this->nucs;
@@ -248,7 +258,7 @@ public:
 //         |  ...
 //         ...
 //
-template<class LocusT=Locus>
+template<class LocusT=PLocus>
 class PopSum {
     int           num_loci;
     int           num_pops;
@@ -267,7 +277,7 @@ public:
     ~PopSum();
 
     int initialize(PopMap<LocusT> *);
-    int add_population(map<int, LocusT *> &, PopMap<LocusT> *, uint, uint, uint, bool, ofstream &);
+    int add_population(map<int, LocusT *> &, PopMap<LocusT> *, uint, string, uint, uint, ostream &);
     int tally(map<int, LocusT *> &);
 
     int loci_cnt() { return this->num_loci; }
@@ -281,15 +291,17 @@ public:
     LocSum   *pop(int, int);
     LocTally *locus_tally(int);
     PopPair  *Fst(int, int, int, int);
+    int       Fst(LocusT *, LocSum **, int, int, PopPair *);
     int       fishers_exact_test(PopPair *, double, double, double, double);
 
 private:
-    int    tally_heterozygous_pos(LocusT *, Datum **, LocSum *, int, int, uint, uint);
-    int    tally_fixed_pos(LocusT *, Datum **, LocSum *, int, uint, uint);
+    int    tally_heterozygous_pos(LocusT *, GenoMatrix *, LocSum *, int, int, uint, uint);
+    int    tally_fixed_pos(LocusT *, Datum **, GenoMatrix *, LocSum *, int, uint, uint);
     int    tally_ref_alleles(LocSum **, int, short unsigned int &, char &, char &, short unsigned int &, short unsigned int &); 
-    int    tally_observed_haplotypes(vector<char *> &, int);
+    bool   fst_site(LocSum *, LocSum *, int, PopPair *);
     double pi(double, double, double);
     double binomial_coeff(double, double);
+    double log_binomial_coeff(double, double);
 };
 
 template<class LocusT>
@@ -336,11 +348,12 @@ int PopSum<LocusT>::initialize(PopMap<LocusT> *pmap) {
 template<class LocusT>
 int PopSum<LocusT>::add_population(map<int, LocusT *> &catalog,
 			       PopMap<LocusT> *pmap, 
-			       uint population_id,
+			       uint population_id, string pop_name,
 			       uint start_index, uint end_index, 
-			       bool verbose, ofstream &log_fh) {
+			       ostream &log_fh) {
     LocusT  *loc;
     Datum  **d;
+    GenoMatrix *g;
     LocSum **s;
     uint locus_id, len;
     int res;
@@ -348,11 +361,6 @@ int PopSum<LocusT>::add_population(map<int, LocusT *> &catalog,
 
     int incompatible_loci = 0;
 
-    if (verbose)
-	log_fh << "\n#\n# Recording sites that have incompatible loci -- loci with too many alleles present.\n"
-	       << "#\n"
-	       << "# Level\tAction\tLocus ID\tChr\tBP\tColumn\tPopID\n#\n";
-
     //
     // Determine the index for this population
     //
@@ -368,22 +376,19 @@ int PopSum<LocusT>::add_population(map<int, LocusT *> &catalog,
     for (int i = 0; i < this->num_loci; i++) {
 	locus_id = pmap->rev_locus_index(i);
 	d   = pmap->locus(locus_id);
+	g   = pmap->genotypes(locus_id);
 	s   = this->locus(locus_id);
 	loc = catalog[locus_id];
 	//
 	// Create an array of SumStat objects
 	//
-	len = strlen(loc->con);
+	len = loc->len;
 	s[pop_index] = new LocSum(len);
 
 	//
 	// Check if this locus has already been filtered and is NULL in all individuals.
 	//
-	bool filtered = true;
-	for (uint k = start_index; k <= end_index; k++) {
-	    if (d[k] != NULL) filtered = false;
-	}
-	if (filtered == true) {
+	if (g->samples(start_index, end_index) == 0) {
 	    for (uint k = 0; k < len; k++) {
 		s[pop_index]->nucs[k].filtered_site = true;
 	    }
@@ -394,14 +399,14 @@ int PopSum<LocusT>::add_population(map<int, LocusT *> &catalog,
 	// The catalog records which nucleotides are heterozygous. For these nucleotides we will
 	// calculate observed genotype frequencies, allele frequencies, and expected genotype frequencies.
 	//
-	for (uint k = 0; k < loc->snps.size(); k++) {
-	    res = this->tally_heterozygous_pos(loc, d, s[pop_index], 
-					       loc->snps[k]->col, k, start_index, end_index);
+	for (uint k = 0; k < loc->snp_cnt; k++) {
+	    res = this->tally_heterozygous_pos(loc, g, s[pop_index], 
+					       loc->snps[k], k, start_index, end_index);
 	    //
 	    // If site is incompatible (too many alleles present), log it.
 	    //
 	    if (res < 0) {
-		s[pop_index]->nucs[loc->snps[k]->col].incompatible_site = true;
+		s[pop_index]->nucs[loc->snps[k]].incompatible_site = true;
 
 		incompatible_loci++;
 		//if (verbose)
@@ -409,29 +414,28 @@ int PopSum<LocusT>::add_population(map<int, LocusT *> &catalog,
 			   << "incompatible_locus\t"
 			   << loc->id << "\t"
 			   << loc->loc.chr << "\t"
-			   << loc->sort_bp(loc->snps[k]->col) << "\t"
-			   << loc->snps[k]->col << "\t" 
-			   << pop_key[population_id] << "\n";
+			   << loc->sort_bp(loc->snps[k]) << "\t"
+			   << loc->snps[k] << "\t" 
+			   << pop_name << "\n";
 	    }
 
-	    snp_cols.insert(loc->snps[k]->col);
+	    snp_cols.insert(loc->snps[k]);
 	}
 	//
 	// For all other fixed sites, we just need to record them.
 	//
 	for (uint k = 0; k < len; k++) {
 	    if (snp_cols.count(k)) continue;
-	    this->tally_fixed_pos(loc, d, s[pop_index], 
+	    this->tally_fixed_pos(loc, d, g, s[pop_index], 
 				  k, start_index, end_index);
 	}
 
 	snp_cols.clear();
     }
 
-    cerr << "Population '" << pop_key[population_id] << "' contained " << incompatible_loci << " incompatible loci -- more than two alleles present.\n";
-    log_fh <<  "Population " << population_id << " contained " << incompatible_loci << " incompatible loci -- more than two alleles present.\n";
+    cerr << "Population '" << pop_name << "' contained " << incompatible_loci << " incompatible loci -- more than two alleles present.\n";
 
-    return 0;
+    return incompatible_loci;
 }
 
 template<class LocusT>
@@ -442,17 +446,20 @@ int PopSum<LocusT>::tally(map<int, LocusT *> &catalog)
     LocTally *ltally;
     int       locus_id, variable_pop;
     uint16_t  p_cnt, q_cnt, len, col;
+    double    het_obs, het_exp;
 
     for (int n = 0; n < this->num_loci; n++) {
 	locus_id = this->rev_locus_index(n);
 	loc      = catalog[locus_id];
 	s        = this->locus(locus_id);
-	len      = strlen(loc->con);
+	len      = loc->len;
 
 	ltally = new LocTally(len);
 	this->loc_tally[n] = ltally;
+	het_obs = 0.0;
+	het_exp = 0.0;
 
-	// for (uint i = 0; i < loc->snps.size(); i++) {
+	// for (uint i = 0; i < loc->snp_cnt; i++) {
 	//     uint col = loc->snps[i]->col;
 	for (col = 0; col < len; col++) {
 
@@ -495,6 +502,14 @@ int PopSum<LocusT>::tally(map<int, LocusT *> &catalog)
 		//
 		ltally->nucs[col].obs_het += 
 		    s[j]->nucs[col].obs_het * (s[j]->nucs[col].num_indv / (double) ltally->nucs[col].num_indv);
+		//
+		// Sum observed and expected heterozygotes at the compatible variable sites of
+		// each population, for the excess of heterozygotes over the locus.
+		//
+		if (s[j]->nucs[col].pi > 0 && s[j]->nucs[col].incompatible_site == false) {
+		    het_obs += s[j]->nucs[col].obs_het * s[j]->nucs[col].num_indv;
+		    het_exp += s[j]->nucs[col].pi      * s[j]->nucs[col].num_indv;
+		}
 	    }
 
 	    //
@@ -531,6 +546,14 @@ int PopSum<LocusT>::tally(map<int, LocusT *> &catalog)
 	    }
 	    ltally->nucs[col].priv_allele = variable_pop;
 	}
+
+	//
+	// Paralogous loci collapsed into one hold heterozygotes that are fixed differences
+	// between the copies, well in excess of Hardy-Weinberg expectations. The excess is
+	// the negative of Fis pooled over the locus: 0 under Hardy-Weinberg equilibrium,
+	// close to 1 when every sample is heterozygous at its variable sites.
+	//
+	ltally->het_excess = het_exp > 0 ? het_obs / het_exp - 1 : 0.0;
     }
 
     return 0;
@@ -660,11 +683,51 @@ PopPair *PopSum<LocusT>::Fst(int locus, int pop_1, int pop_2, int pos)
     LocSum  *s_2  = this->pop(locus, pop_2);
     PopPair *pair = new PopPair();
 
+    if (this->fst_site(s_1, s_2, pos, pair) == false) {
+	delete pair;
+	return NULL;
+    }
+
+    return pair;
+}
+
+//
+// Calculate Fst and Fisher's exact test between two populations, given by their array
+// positions, at every SNP of a locus at once, from the population summaries of the
+// locus, as returned by locus(). The summaries are taken from the caller so that
+// loci can be tested in parallel without looking them up in the locus map. Returns the number of SNPs for which a statistic was
+// computed; the pair of a SNP without one has no alleles recorded, and that of a SNP
+// with more than two alleles across the populations also has a p-value of 1.
+//
+template<class LocusT>
+int PopSum<LocusT>::Fst(LocusT *loc, LocSum **s, int pop_1, int pop_2, PopPair *pairs) 
+{
+    int cnt = 0;
+
+    for (uint i = 0; i < loc->snp_cnt; i++) {
+	pairs[i].clear();
+	pairs[i].col = loc->snps[i];
+
+	if (this->fst_site(s[pop_1], s[pop_2], loc->snps[i], &pairs[i]) == false) {
+	    pairs[i].clear();
+	    pairs[i].col   = loc->snps[i];
+	    pairs[i].fet_p = 1.0;
+	} else if (pairs[i].alleles > 0) {
+	    cnt++;
+	}
+    }
+
+    return cnt;
+}
+
+template<class LocusT>
+bool PopSum<LocusT>::fst_site(LocSum *s_1, LocSum *s_2, int pos, PopPair *pair) 
+{
     //
     // If this locus only appears in one population do not calculate Fst.
     //
     if (s_1->nucs[pos].num_indv == 0 || s_2->nucs[pos].num_indv == 0) 
-	return pair;
+	return true;
 
     //
     // Calculate Fst at a locus, sub-population relative to that found in the entire population
@@ -678,7 +741,7 @@ PopPair *PopSum<LocusT>::Fst(int locus, int pop_1, int pop_2, int pos)
     pi_2 = s_2->nucs[pos].pi;
 
     if (pi_1 == 0 && pi_2 == 0 && s_1->nucs[pos].p_nuc == s_2->nucs[pos].p_nuc)
-	return pair;
+	return true;
 
     //
     // Calculate Pi over the entire pooled population.
@@ -714,7 +777,7 @@ PopPair *PopSum<LocusT>::Fst(int locus, int pop_1, int pop_2, int pos)
 	if (ncnt[i] > 0) allele_cnt++;
 
     if (allele_cnt > 2)
-	return NULL;
+	return false;
 
     double tot_alleles = n_1 + n_2;
     double p_1 = round(n_1 * s_1->nucs[pos].p);
@@ -813,28 +876,28 @@ PopPair *PopSum<LocusT>::Fst(int locus, int pop_1, int pop_2, int pos)
 
     // pair->jakob_fst = (pow(delta_1, 2) + pow(delta_2, 2)) / ( 4 - (pow(sigma_1, 2) + pow(sigma_2, 2)) );
 
-    return pair;
+    return true;
 }
 
 template<class LocusT>
-int PopSum<LocusT>::tally_fixed_pos(LocusT *locus, Datum **d, LocSum *s, int pos, uint start, uint end) 
+int PopSum<LocusT>::tally_fixed_pos(LocusT *locus, Datum **d, GenoMatrix *g, LocSum *s, int pos, uint start, uint end) 
 {
     double num_indv = 0.0;
     char   p_nuc = 0;
+    vector<uint> hets;
 
-    for (uint i = start; i <= end; i++) {
-	if (d[i] == NULL || pos >= d[i]->len) continue;
-	//
-	// Before counting this individual, make sure the model definitively called this 
-	// position as hEterozygous or hOmozygous.
-	//
-	if (d[i]->model[pos] == 'E') {
-	    cerr << "Warning: heterozygous model call at fixed nucleotide position: " 
-		 << "locus " << locus->id << " individual " << d[i]->id << "; position: " << pos << "\n";
-	}
-	num_indv++;
+    //
+    // Before counting these individuals, make sure the model definitively called this 
+    // position as hEterozygous or hOmozygous.
+    //
+    g->fixed_hets(pos, start, end, hets);
+    for (uint i = 0; i < hets.size(); i++)
+	cerr << "Warning: heterozygous model call at fixed nucleotide position: " 
+	     << "locus " << locus->id << " individual " << d[hets[i]]->id << "; position: " << pos << "\n";
+
+    num_indv = g->present(pos, start, end);
+    if (num_indv > 0)
 	p_nuc = locus->con[pos];
-    }
     //
     // Record the results in the PopSum object.
     //
@@ -859,7 +922,7 @@ int PopSum<LocusT>::tally_fixed_pos(LocusT *locus, Datum **d, LocSum *s, int pos
 }
 
 template<class LocusT>
-int PopSum<LocusT>::tally_heterozygous_pos(LocusT *locus, Datum **d, LocSum *s, 
+int PopSum<LocusT>::tally_heterozygous_pos(LocusT *locus, GenoMatrix *g, LocSum *s, 
 					   int pos, int snp_index, uint start, uint end) 
 {
     //
@@ -867,42 +930,14 @@ int PopSum<LocusT>::tally_heterozygous_pos(LocusT *locus, Datum **d, LocSum *s,
     //
     int  nucs[4] = {0};
     uint i;
-    char nuc;
 
     //cerr << "  Calculating summary stats at het locus " << locus->id << " position " << pos << "; snp_index: " << snp_index << "\n";
 
     //
-    // Iterate over each individual in this sub-population.
+    // Count the individuals in this sub-population carrying each allele.
     //
-    for (i = start; i <= end; i++) {
-	if (d[i] == NULL || pos >= d[i]->len || d[i]->model[pos] == 'U') continue;
-
-	//
-	// Pull each allele for this SNP from the observed haplotype.
-	//
-	for (uint j = 0; j < d[i]->obshap.size(); j++) {
-	    nuc = d[i]->obshap[j][snp_index];
-
-	    switch(nuc) {
-	    case 'A':
-	    case 'a':
-		nucs[0]++;
-		break;
-	    case 'C':
-	    case 'c':
-		nucs[1]++;
-		break;
-	    case 'G':
-	    case 'g':
-		nucs[2]++;
-		break;
-	    case 'T':
-	    case 't':
-		nucs[3]++;
-		break;
-	    }
-	}
-    }
+    for (i = 0; i < 4; i++)
+	nucs[i] = g->count(snp_index, GenoMatrix::nuc_a + i, start, end);
 
     //
     // Determine how many alleles are present at this position in this population.
@@ -959,34 +994,18 @@ int PopSum<LocusT>::tally_heterozygous_pos(LocusT *locus, Datum **d, LocSum *s,
 	i++;
     }
     //cerr << "  P Allele: " << p_allele << "; Q Allele: " << q_allele << "\n";
+    int p_index = HapDict::nuc_index(p_allele);
+    int q_index = HapDict::nuc_index(q_allele);
 
     //
-    // Calculate observed genotype frequencies.
+    // Calculate observed genotype frequencies. Only individuals the model definitively 
+    // called as hEterozygous or hOmozygous at this position are counted.
     //
-    double num_indv = 0.0;
-    double obs_het  = 0.0;
-    double obs_p    = 0.0;
-    double obs_q    = 0.0;
+    double num_indv = g->count(snp_index, GenoMatrix::called, start, end);
+    double obs_het  = g->count(snp_index, GenoMatrix::het,    start, end);
+    double obs_p    = p_index < 0 ? 0.0 : g->count(snp_index, GenoMatrix::first_a + p_index, start, end);
+    double obs_q    = q_index < 0 ? 0.0 : g->count(snp_index, GenoMatrix::first_a + q_index, start, end);
 
-    for (i = start; i <= end; i++) {
-	if (d[i] == NULL || pos >= d[i]->len) continue;
-	//
-	// Before counting this individual, make sure the model definitively called this 
-	// position as hEterozygous or hOmozygous.
-	//
-	if (d[i]->model[pos] == 'E' || d[i]->model[pos] == 'O')
-	    num_indv++;
-	else
-	    continue;
-
-	if (d[i]->obshap.size() > 1 &&
-	    this->tally_observed_haplotypes(d[i]->obshap, snp_index) == 2)
-		obs_het++;
-	else if (d[i]->obshap[0][snp_index] == p_allele)
-	    obs_p++;
-	else if (d[i]->obshap[0][snp_index] == q_allele)
-	    obs_q++;
-    }
     //cerr << "  Num Individuals: " << num_indv << "; Obs Hets: " << obs_het << "; Obs P: " << obs_p << "; Obs Q: " << obs_q << "\n";
 
     if (num_indv == 0) return 0;
@@ -1076,45 +1095,6 @@ int PopSum<LocusT>::tally_heterozygous_pos(LocusT *locus, Datum **d, LocSum *s,
     return 0;
 }
 
-template<class LocusT>
-int PopSum<LocusT>::tally_observed_haplotypes(vector<char *> &obshap, int snp_index) 
-{
-    int  nucs[4] = {0};
-    char nuc;
-
-    //
-    // Pull each allele for this SNP from the observed haplotype.
-    //
-    for (uint j = 0; j < obshap.size(); j++) {
-        nuc = obshap[j][snp_index];
-
-	switch(nuc) {
-	case 'A':
-	case 'a':
-	    nucs[0]++;
-	    break;
-	case 'C':
-	case 'c':
-	    nucs[1]++;
-	    break;
-	case 'G':
-	case 'g':
-	    nucs[2]++;
-	    break;
-	case 'T':
-	case 't':
-	    nucs[3]++;
-	    break;
-	}
-    }
-
-    int allele_cnt = 0;
-    for (int i = 0; i < 4; i++)
-	if (nucs[i] > 0) allele_cnt++;
-
-    return allele_cnt;
-}
-
 template<class LocusT>
 int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, double p_2, double q_2)
 {
@@ -1134,6 +1114,9 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
     //
     //   p = (r_1 choose p_1)(r_2 choose p_2) / (n choose c_1)
     //
+    // The coefficients are taken in log space from the shared table of log-factorials,
+    // so each term costs a few lookups rather than a product over the allele counts.
+    //
     // Fisher's Exact test algorithm implemented according to Sokal and Rohlf, _Biometry_, section 17.4.
     //
 
@@ -1165,7 +1148,7 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
     double p2     = p_2;
     double q2     = q_2;
     double tail_1 = 0.0;
-    double den    = this->binomial_coeff(n, c_1);
+    double den    = this->log_binomial_coeff(n, c_1);
 
     //
     // If (p_1*q_2 - p_2*q_1) < 0 decrease cells p_1 and q_2 by one and add one to p_2 and q_1. 
@@ -1173,7 +1156,7 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
     //
     if (d_1 - d_2 < 0) {
 	do {
-	    p = (this->binomial_coeff(r_1, p1) * this->binomial_coeff(r_2, p2)) / den;
+	    p = exp(this->log_binomial_coeff(r_1, p1) + this->log_binomial_coeff(r_2, p2) - den);
 
 	    tail_1 += p;
 	    p1--;
@@ -1188,7 +1171,7 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
 	// Compute p and repeat until one or more cells equal 0.
 	//
 	do {
-	    p = (this->binomial_coeff(r_1, p1) * this->binomial_coeff(r_2, p2)) / den;
+	    p = exp(this->log_binomial_coeff(r_1, p1) + this->log_binomial_coeff(r_2, p2) - den);
 
 	    tail_1 += p;
 
@@ -1235,13 +1218,20 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
 	}
     }
 
+    //
+    // Tables as probable as the observed one give tails equal up to rounding, which differs
+    // between the log-space and direct products; compare the tails with a small tolerance
+    // so that such ties are resolved the same way either way.
+    //
+    double limit = tail_1 * (1.0 - 1e-9);
+
     //
     // If (p_1*q_2 - p_2*q_1) < 0 decrease cells p_1 and q_2 by one and add one to p_2 and q_1. 
     // Compute p and repeat until tail_2 > tail_1.
     //
     if (d_1 - d_2 < 0) {
 	do {
-	    p = (this->binomial_coeff(r_1, p1) * this->binomial_coeff(r_2, p2)) / den;
+	    p = exp(this->log_binomial_coeff(r_1, p1) + this->log_binomial_coeff(r_2, p2) - den);
 
 	    tail_2 += p;
 
@@ -1249,7 +1239,7 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
 	    q2--;
 	    p2++;
 	    q1++;
-	} while (tail_2 < tail_1 && p1 >= 0 && q2 >= 0);
+	} while (tail_2 < limit && p1 >= 0 && q2 >= 0);
 
 	tail_2 -= p;
 
@@ -1259,7 +1249,7 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
 	// Compute p and repeat until one or more cells equal 0.
 	//
 	do {
-	    p = (this->binomial_coeff(r_1, p1) * this->binomial_coeff(r_2, p2)) / den;
+	    p = exp(this->log_binomial_coeff(r_1, p1) + this->log_binomial_coeff(r_2, p2) - den);
 
 	    tail_2 += p;
 
@@ -1267,7 +1257,7 @@ int PopSum<LocusT>::fishers_exact_test(PopPair *pair, double p_1, double q_1, do
 	    q1--;
 	    p1++;
 	    q2++;
-	} while (tail_2 < tail_1 && p2 >= 0 && q1 >= 0);
+	} while (tail_2 < limit && p2 >= 0 && q1 >= 0);
 
 	tail_2 -= p;
     }
@@ -1327,11 +1317,25 @@ double PopSum<LocusT>::pi(double tot_alleles, double p, double q)
     return pi;
 }
 
+template<class LocusT>
+double PopSum<LocusT>::log_binomial_coeff(double n, double k)
+{
+    if (k < 0 || n < k) return -INFINITY;
+
+    return log_factorials.choose((uint) n, (uint) k);
+}
+
 template<class LocusT>
 double PopSum<LocusT>::binomial_coeff(double n, double k)
 {
     if (n < k) return 0.0;
     //
+    // Pairs of alleles, as counted by pi(), are the common case.
+    //
+    if (k == 2) return n * (n - 1) / 2;
+    if (k >= 0 && k == floor(k) && n == floor(n))
+	return exp(log_factorials.choose((uint) n, (uint) k));
+    //
     // Compute the binomial coefficient using the method of:
     // Y. Manolopoulos, "Binomial coefficient computation: recursion or iteration?", 
     // ACM SIGCSE Bulletin, 34(4):65-67, 2002.
@@ -27,75 +27,205 @@
 //
 #include "catalog_utils.h"
 
-int 
-reduce_catalog(map<int, CSLocus *> &catalog, set<int> &whitelist, set<int> &blacklist) 
+//
+// The catalog IDs in catalog order; the index of an ID is the locus' dense index.
+//
+int
+catalog_ids(map<int, PLocus *> &catalog, vector<int> &ids)
 {
-    map<int, CSLocus *> list;
-    map<int, CSLocus *>::iterator it;
-    CSLocus *loc;
+    map<int, PLocus *>::iterator it;
 
-    if (whitelist.size() == 0 && blacklist.size() == 0) 
-	return 0;
- 
-    int i = 0;
-    for (it = catalog.begin(); it != catalog.end(); it++) {
-	loc = it->second;
+    ids.clear();
+    ids.reserve(catalog.size());
+    for (it = catalog.begin(); it != catalog.end(); it++)
+	ids.push_back(it->first);
 
-	if (whitelist.size() > 0 && whitelist.count(loc->id) == 0) continue;
-	if (blacklist.count(loc->id)) continue;
+    return ids.size();
+}
 
-	list[it->first] = it->second;
-	i++;
+void
+LocusFilter::clear(uint n)
+{
+    this->n = n;
+    this->bits.assign((n + 63) / 64 + 1, 0);
+    this->first.assign(n + 1, 0);
+    this->cols.clear();
+}
+
+//
+// List the loci of a set. Returns the number of loci of the set not in the catalog.
+//
+int
+LocusFilter::build(vector<int> &ids, set<int> &list)
+{
+    set<int>::iterator it = list.begin();
+    int missing = 0;
+    uint i = 0;
+
+    this->clear(ids.size());
+
+    while (it != list.end()) {
+	while (i < this->n && ids[i] < *it) i++;
+	if (i < this->n && ids[i] == *it)
+	    this->bits[i >> 6] |= 1ULL << (i & 63);
+	else
+	    missing++;
+	it++;
     }
 
-    catalog = list;
+    return missing;
+}
+
+//
+// List the loci and SNP columns of a whitelist. Returns the number of loci of the
+// whitelist not in the catalog.
+//
+int
+LocusFilter::build(vector<int> &ids, map<int, set<int> > &list)
+{
+    map<int, set<int> >::iterator it = list.begin();
+    int missing = 0;
+    uint i = 0;
+
+    this->clear(ids.size());
+
+    while (it != list.end()) {
+	while (i < this->n && ids[i] < it->first) {
+	    this->first[i + 1] = this->cols.size();
+	    i++;
+	}
+	if (i < this->n && ids[i] == it->first) {
+	    this->bits[i >> 6] |= 1ULL << (i & 63);
+	    this->cols.insert(this->cols.end(), it->second.begin(), it->second.end());
+	} else {
+	    missing++;
+	}
+	it++;
+    }
+    for (; i < this->n; i++)
+	this->first[i + 1] = this->cols.size();
+
+    return missing;
+}
+
+//
+// Remove the loci not on the whitelist, if there is one, and those on the blacklist.
+// Loci are erased from the catalog in place. Returns the number of loci retained.
+//
+static int
+reduce_catalog(map<int, PLocus *> &catalog, LocusFilter *white, LocusFilter &black)
+{
+    map<int, PLocus *>::iterator it;
+    uint words = black.bits.size();
+    vector<uint64_t> keep(words);
+
+    #pragma omp parallel for simd
+    for (uint w = 0; w < words; w++)
+	keep[w] = (white != NULL ? white->bits[w] : ~0ULL) & ~black.bits[w];
+
+    int i = 0;
+    uint k = 0;
+    for (it = catalog.begin(); it != catalog.end(); k++) {
+	if ((keep[k >> 6] >> (k & 63)) & 1) {
+	    it++;
+	    i++;
+	} else {
+	    catalog.erase(it++);
+	}
+    }
 
     return i;
 }
 
+int 
+reduce_catalog(map<int, PLocus *> &catalog, set<int> &whitelist, set<int> &blacklist) 
+{
+    if (whitelist.size() == 0 && blacklist.size() == 0) 
+	return 0;
+
+    vector<int> ids;
+    LocusFilter white, black;
+
+    catalog_ids(catalog, ids);
+    white.build(ids, whitelist);
+    black.build(ids, blacklist);
+
+    return reduce_catalog(catalog, whitelist.size() > 0 ? &white : NULL, black);
+}
+
 
 int
-check_whitelist_integrity(map<int, CSLocus *> &catalog, map<int, set<int> > &whitelist)
+check_whitelist_integrity(map<int, PLocus *> &catalog, map<int, set<int> > &whitelist)
 {
     if (whitelist.size() == 0) return 0;
 
     int rm_snps = 0;
     int rm_loci = 0;
 
-    CSLocus *loc;
     map<int, set<int> >::iterator it;
     set<int>::iterator sit;
-    map<int, set<int> > new_wl;
 
     cerr << "Checking the integrity of the whitelist...\n";
 
-    for (it = whitelist.begin(); it != whitelist.end(); it++) {
-	if (catalog.count(it->first) == 0) {
+    //
+    // Check each whitelisted locus and its columns in parallel, keeping the columns
+    // not found and the messages of each locus so that they are reported in order.
+    //
+    vector<map<int, set<int> >::iterator> entries;
+    for (it = whitelist.begin(); it != whitelist.end(); it++)
+	entries.push_back(it);
+
+    vector<int>          ids;
+    vector<PLocus *>     loci;
+    vector<char>         absent(entries.size(), false);
+    vector<vector<int> > bad(entries.size());
+    vector<string>       msgs(entries.size());
+
+    catalog_ids(catalog, ids);
+    for (map<int, PLocus *>::iterator cit = catalog.begin(); cit != catalog.end(); cit++)
+	loci.push_back(cit->second);
+
+    #pragma omp parallel for schedule(dynamic, 256) reduction(+:rm_loci,rm_snps)
+    for (uint e = 0; e < entries.size(); e++) {
+	int id = entries[e]->first;
+	vector<int>::iterator pos = std::lower_bound(ids.begin(), ids.end(), id);
+
+	if (pos == ids.end() || *pos != id) {
+	    absent[e] = true;
 	    rm_loci++;
-	    cerr << "  Removing locus " << it->first << " from whitelist as it does not exist in the catalog.\n";
-	} else {
-	    loc = catalog[it->first];
-
-	    if (it->second.size() == 0) {
-		new_wl.insert(make_pair(it->first, std::set<int>()));
-		continue;
-	    }
-
-	    set<int> cat_snps;
-	    for (uint i = 0; i < loc->snps.size(); i++)
-		cat_snps.insert(loc->snps[i]->col);
+	    stringstream msg;
+	    msg << "  Removing locus " << id << " from whitelist as it does not exist in the catalog.\n";
+	    msgs[e] = msg.str();
+	    continue;
+	}
 
-	    for (sit = it->second.begin(); sit != it->second.end(); sit++)
-		if (cat_snps.count(*sit)) {
-		    new_wl[it->first].insert(*sit);
-		} else {
-		    rm_snps++;
-		    cerr << "  Removing SNP at column " << *sit << " in locus " << it->first << " from whitelist as it does not exist in the catalog.\n";
-		}
+	PLocus *loc = loci[pos - ids.begin()];
+	set<int>::iterator c;
+	for (c = entries[e]->second.begin(); c != entries[e]->second.end(); c++) {
+	    uint i = 0;
+	    while (i < loc->snp_cnt && loc->snps[i] != *c) i++;
+	    if (i < loc->snp_cnt) continue;
+
+	    rm_snps++;
+	    bad[e].push_back(*c);
+	    stringstream msg;
+	    msg << "  Removing SNP at column " << *c << " in locus " << id << " from whitelist as it does not exist in the catalog.\n";
+	    msgs[e] += msg.str();
 	}
     }
 
-    whitelist = new_wl;
+    //
+    // Loci not in the catalog are dropped, as are loci none of whose columns are in it.
+    //
+    for (uint e = 0; e < entries.size(); e++) {
+	cerr << msgs[e];
+	if (absent[e] == false && bad[e].size() == 0)
+	    continue;
+	for (uint j = 0; j < bad[e].size(); j++)
+	    entries[e]->second.erase(bad[e][j]);
+	if (absent[e] || entries[e]->second.size() == 0)
+	    whitelist.erase(entries[e]);
+    }
 
     cerr << "done.\n"
 	 << "Removed " << rm_loci << " loci and " << rm_snps << " SNPs from the whitelist that were not found in the catalog.\n";
@@ -104,111 +234,205 @@ check_whitelist_integrity(map<int, CSLocus *> &catalog, map<int, set<int> > &whi
 }
 
 int 
-reduce_catalog(map<int, CSLocus *> &catalog, map<int, set<int> > &whitelist, set<int> &blacklist) 
+reduce_catalog(map<int, PLocus *> &catalog, map<int, set<int> > &whitelist, set<int> &blacklist) 
 {
-    map<int, CSLocus *> list;
-    map<int, CSLocus *>::iterator it;
-    CSLocus *loc;
-
     if (whitelist.size() == 0 && blacklist.size() == 0) 
 	return 0;
- 
-    int i = 0;
-    for (it = catalog.begin(); it != catalog.end(); it++) {
-	loc = it->second;
 
-	if (whitelist.size() > 0 && whitelist.count(loc->id) == 0) continue;
-	if (blacklist.count(loc->id)) continue;
+    vector<int> ids;
+    LocusFilter white, black;
+
+    catalog_ids(catalog, ids);
+    white.build(ids, whitelist);
+    black.build(ids, blacklist);
+
+    return reduce_catalog(catalog, whitelist.size() > 0 ? &white : NULL, black);
+}
+
+//
+// Projects the haplotypes of a locus dictionary onto a subset of their columns. The
+// projections are all of the same width and are written side by side into one flat
+// buffer, then deduplicated through a small open-addressing hash table; the distinct
+// projections replace the dictionary in sorted order. There are no more distinct
+// projections than haplotypes, so the new codes fit in 16 bits as the old ones did.
+// The buffers are reused from locus to locus, so projecting a locus allocates only
+// the new dictionary entries.
+//
+class HapProjection {
+    vector<char> buf;
+    vector<int>  slots;  // Hash table of distinct projections, -1 if empty.
+    vector<uint> uniq;   // Code of the first haplotype of each distinct projection.
+    vector<uint> rank;   // Haplotype code -> distinct projection.
+    vector<uint> order;  // Distinct projections in sorted order.
+    vector<uint> code;   // Distinct projection -> new haplotype code.
+    uint         width;
+
+    const char *at(uint j) { return &this->buf[(size_t) j * this->width]; }
+
+    struct Before {
+	HapProjection &p;
+	Before(HapProjection &p) : p(p) {}
+	bool operator()(uint a, uint b) {
+	    return memcmp(p.at(p.uniq[a]), p.at(p.uniq[b]), p.width) < 0;
+	}
+    };
+
+public:
+    vector<uint16_t> remap;  // Old haplotype code -> new haplotype code.
+
+    HapProjection() { this->width = 0; }
+
+    void project(HapDict *, vector<uint> &);
+};
+
+void
+HapProjection::project(HapDict *h, vector<uint> &cols)
+{
+    uint cnt = h->size();
+    uint w   = cols.size();
+
+    this->width = w;
+    this->buf.resize((size_t) cnt * w + 1);
 
-	list[it->first] = it->second;
-	i++;
+    for (uint j = 0; j < cnt; j++) {
+	const char *hap = h->hap(j);
+	uint        len = strlen(hap);
+	char       *out = &this->buf[(size_t) j * w];
+
+	for (uint k = 0; k < w; k++)
+	    out[k] = cols[k] < len ? hap[cols[k]] : 'N';
     }
 
-    catalog = list;
+    uint size = 16;
+    while (size < 2 * cnt) size *= 2;
+    this->slots.assign(size, -1);
+    this->uniq.clear();
+    this->rank.resize(cnt);
+
+    for (uint j = 0; j < cnt; j++) {
+	const char *p = this->at(j);
+	uint        s = HapDict::hash(p, w) & (size - 1);
+	while (this->slots[s] >= 0 && memcmp(this->at(this->uniq[this->slots[s]]), p, w) != 0)
+	    s = (s + 1) & (size - 1);
+	if (this->slots[s] < 0) {
+	    this->slots[s] = this->uniq.size();
+	    this->uniq.push_back(j);
+	}
+	this->rank[j] = this->slots[s];
+    }
 
-    return i;
+    //
+    // Rebuild the dictionary in sorted order so that sorting codes also sorts haplotypes.
+    //
+    this->order.resize(this->uniq.size());
+    this->code.resize(this->uniq.size());
+    for (uint u = 0; u < this->order.size(); u++)
+	this->order[u] = u;
+    sort(this->order.begin(), this->order.end(), Before(*this));
+
+    vector<char *> new_haps(this->order.size());
+    for (uint r = 0; r < this->order.size(); r++) {
+	new_haps[r] = new char[w + 1];
+	memcpy(new_haps[r], this->at(this->uniq[this->order[r]]), w);
+	new_haps[r][w] = '\0';
+	this->code[this->order[r]] = r;
+    }
+
+    this->remap.resize(cnt);
+    for (uint j = 0; j < cnt; j++)
+	this->remap[j] = this->code[this->rank[j]];
+
+    h->assign(new_haps);
 }
 
 int 
-reduce_catalog_snps(map<int, CSLocus *> &catalog, map<int, set<int> > &whitelist, PopMap<CSLocus> *pmap) 
+reduce_catalog_snps(map<int, PLocus *> &catalog, map<int, set<int> > &whitelist, PopMap<PLocus> *pmap) 
 {
-    map<int, CSLocus *>::iterator it;
-    CSLocus *loc;
-    Datum  **d;
+    map<int, PLocus *>::iterator it;
 
     if (whitelist.size() == 0) 
 	return 0;
- 
+
+    vector<int>       ids;
+    vector<PLocus *>  loci;
+    vector<Datum **>  data;
+    vector<HapDict *> dicts;
+    LocusFilter       white;
+
+    catalog_ids(catalog, ids);
+    white.build(ids, whitelist);
+
     //
-    // We want to prune out SNP objects that are not in the whitelist.
+    // The PopMap indexes loci through a map, so the sample data and haplotypes of each
+    // locus are looked up here, before the loci are processed in parallel.
     //
-    int           pos;
-    vector<SNP *> tmp;
-    vector<uint>  cols;
-    set<string>   obshaps;
-    set<string>::iterator sit;
     for (it = catalog.begin(); it != catalog.end(); it++) {
-	loc = it->second;
+	loci.push_back(it->second);
+	data.push_back(pmap->locus(it->first));
+	dicts.push_back(pmap->haplotypes(it->first));
+    }
 
-	if (whitelist[loc->id].size() == 0)
-	    continue;
+    //
+    // We want to prune out SNP objects that are not in the whitelist.
+    //
+    #pragma omp parallel
+    {
+	int           pos;
+	vector<uint>  cols;
+	HapProjection proj;
+	HapDict *h;
+	PLocus  *loc;
+	Datum  **d;
+
+	#pragma omp for schedule(dynamic, 64)
+	for (uint l = 0; l < loci.size(); l++) {
+	    loc = loci[l];
+
+	    if (white.col_cnt(l) == 0)
+		continue;
+
+	    cols.clear();
 
-	tmp.clear();
-	cols.clear();
-
-	d = pmap->locus(loc->id);
-
-	for (uint i = 0; i < loc->snps.size(); i++) {
-	    if (whitelist[loc->id].count(loc->snps[i]->col) > 0) {
-		tmp.push_back(loc->snps[i]);
-		cols.push_back(i);
-	    } else {
-		//
-		// Change the model calls in the samples to no longer contain this SNP.
-		//
-		pos = loc->snps[i]->col;
-		for (int j = 0; j < pmap->sample_cnt(); j++) {
-		    if (d[j] == NULL || pos >= d[j]->len) 
-			continue;
-		    if (d[j]->model != NULL) {
-			d[j]->model[pos] = 'U';
+	    d = data[l];
+	    h = dicts[l];
+
+	    uint n = 0;
+	    for (uint i = 0; i < loc->snp_cnt; i++) {
+		if (white.has_col(l, loc->snps[i])) {
+		    loc->snps[n++] = loc->snps[i];
+		    cols.push_back(i);
+		} else {
+		    //
+		    // Change the model calls in the samples to no longer contain this SNP.
+		    //
+		    pos = loc->snps[i];
+		    for (int j = 0; j < pmap->sample_cnt(); j++) {
+			if (d[j] == NULL || pos >= d[j]->len) 
+			    continue;
+			d[j]->model.set(pos, 'U');
 		    }
 		}
-
-		delete loc->snps[i];
-	    }
-	}
-	loc->snps.clear();
-	for (uint i = 0; i < tmp.size(); i++)
-	    loc->snps.push_back(tmp[i]);
-
-	//
-	// Now we need to adjust the matched haplotypes to sync to 
-	// the SNPs left in the catalog.
-	//
-	// Reducing the lengths of the haplotypes  may create 
-	// redundant (shorter) haplotypes, we need to remove these.
-	//
-	for (int i = 0; i < pmap->sample_cnt(); i++) {
-	    if (d[i] == NULL) continue;
-
-	    for (uint j = 0; j < d[i]->obshap.size(); j++) {
-		for (uint k = 0; k < cols.size(); k++)
-		    d[i]->obshap[j][k] = d[i]->obshap[j][cols[k]];
-		d[i]->obshap[j][cols.size()] = '\0';
-		obshaps.insert(d[i]->obshap[j]);
-	    }
-	    uint j = 0;
-	    for (sit = obshaps.begin(); sit != obshaps.end(); sit++) {
-		strcpy(d[i]->obshap[j], (*sit).c_str());
-		j++;
 	    }
-	    while (j < d[i]->obshap.size()) {
-		delete [] d[i]->obshap[j];
-		j++;
+	    loc->snp_cnt = n;
+
+	    //
+	    // Now we need to adjust the matched haplotypes to sync to 
+	    // the SNPs left in the catalog. Each distinct haplotype is projected
+	    // once in the locus dictionary.
+	    //
+	    // Reducing the lengths of the haplotypes  may create 
+	    // redundant (shorter) haplotypes, we need to remove these.
+	    //
+	    proj.project(h, cols);
+
+	    for (int i = 0; i < pmap->sample_cnt(); i++) {
+		if (d[i] == NULL) continue;
+
+		for (uint j = 0; j < d[i]->obshap.size(); j++)
+		    d[i]->obshap[j] = proj.remap[d[i]->obshap[j]];
+		sort(d[i]->obshap.begin(), d[i]->obshap.end());
+		d[i]->obshap.erase(unique(d[i]->obshap.begin(), d[i]->obshap.end()), d[i]->obshap.end());
 	    }
-	    d[i]->obshap.resize(obshaps.size());
-	    obshaps.clear();
 	}
     }
 
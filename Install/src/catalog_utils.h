@@ -29,9 +29,36 @@ using std::set;
 
 #include "PopMap.h"
 
-int check_whitelist_integrity(map<int, CSLocus *> &, map<int, set<int> > &);
-int reduce_catalog(map<int, CSLocus *> &, set<int> &, set<int> &);
-int reduce_catalog(map<int, CSLocus *> &, map<int, set<int> > &, set<int> &);
-int reduce_catalog_snps(map<int, CSLocus *> &, map<int, set<int> > &, PopMap<CSLocus> *);
+//
+// A white or black list over the loci of a catalog: a bitmap over the dense indexes of
+// the catalog loci, in catalog ID order, and for each listed locus a sorted range of a
+// flat array of SNP columns. A listed locus without columns lists all of its SNPs.
+// Lists are built by merging the sorted list against the sorted catalog IDs, without
+// any lookups in the catalog.
+//
+class LocusFilter {
+public:
+    uint             n;
+    vector<uint64_t> bits;   // Listed loci.
+    vector<uint>     first;  // Dense index -> offset of the locus' columns; n + 1 entries.
+    vector<int>      cols;   // Sorted SNP columns of each listed locus.
+
+    LocusFilter() { this->n = 0; }
+
+    int  build(vector<int> &, set<int> &);
+    int  build(vector<int> &, map<int, set<int> > &);
+    void clear(uint);
+    bool listed(uint i)     { return (this->bits[i >> 6] >> (i & 63)) & 1; }
+    uint col_cnt(uint i)    { return this->first[i + 1] - this->first[i]; }
+    bool has_col(uint i, int col) {
+	return std::binary_search(this->cols.begin() + this->first[i], this->cols.begin() + this->first[i + 1], col);
+    }
+};
+
+int catalog_ids(map<int, PLocus *> &, vector<int> &);
+int check_whitelist_integrity(map<int, PLocus *> &, map<int, set<int> > &);
+int reduce_catalog(map<int, PLocus *> &, set<int> &, set<int> &);
+int reduce_catalog(map<int, PLocus *> &, map<int, set<int> > &, set<int> &);
+int reduce_catalog_snps(map<int, PLocus *> &, map<int, set<int> > &, PopMap<PLocus> *);
 
 #endif // __CATALOG_UTILS_H__
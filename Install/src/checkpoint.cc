@@ -0,0 +1,330 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// checkpoint -- stage checkpoints for resuming interrupted runs
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+using std::cerr;
+
+#include "checkpoint.h"
+
+const uint32_t ckpt_magic   = 0x4b435050;  // "PPCK"
+const uint32_t ckpt_filter  = 1;
+const uint32_t ckpt_pairs   = 2;
+
+//
+// 64-bit FNV-1a, continuing from the given hash.
+//
+uint64_t
+ckpt_hash(const void *data, size_t len, uint64_t h)
+{
+    const unsigned char *p = (const unsigned char *) data;
+
+    for (size_t i = 0; i < len; i++) {
+	h ^= p[i];
+	h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+CkptWriter::CkptWriter(string path, uint32_t kind, uint64_t key)
+{
+    this->path = path;
+    this->tmp  = path + ".tmp";
+    this->sum  = 0xcbf29ce484222325ULL;
+
+    this->fh.open(this->tmp.c_str(), ofstream::out | ofstream::binary);
+    if (this->fh.fail()) {
+	cerr << "Error opening checkpoint file '" << this->tmp << "'\n";
+	exit(1);
+    }
+    this->put(ckpt_magic);
+    this->put(kind);
+    this->put(key);
+}
+
+void
+CkptWriter::put(const void *data, size_t len)
+{
+    this->fh.write((const char *) data, len);
+    this->sum = ckpt_hash(data, len, this->sum);
+}
+
+bool
+CkptWriter::commit()
+{
+    uint64_t sum = this->sum;
+
+    this->fh.write((const char *) &sum, sizeof(sum));
+    this->fh.close();
+
+    if (this->fh.fail() || rename(this->tmp.c_str(), this->path.c_str()) != 0) {
+	cerr << "Warning: unable to write checkpoint file '" << this->path << "'\n";
+	remove(this->tmp.c_str());
+	return false;
+    }
+
+    return true;
+}
+
+CkptReader::CkptReader(string path, uint32_t kind, uint64_t key)
+{
+    uint32_t magic = 0, k = 0;
+    uint64_t stored_key = 0;
+
+    this->sum  = 0xcbf29ce484222325ULL;
+    this->left = 0;
+    this->fh.open(path.c_str(), ifstream::in | ifstream::binary | ifstream::ate);
+    this->ok   = this->fh.good();
+    if (this->ok) {
+	this->left = this->fh.tellg();
+	this->fh.seekg(0);
+    }
+
+    this->ok = this->ok && this->get(magic) && this->get(k) && this->get(stored_key) &&
+	magic == ckpt_magic && k == kind && stored_key == key;
+}
+
+bool
+CkptReader::get(void *data, size_t len)
+{
+    if (!this->ok)
+	return false;
+
+    this->fh.read((char *) data, len);
+    if ((size_t) this->fh.gcount() != len) {
+	this->ok = false;
+	return false;
+    }
+    this->sum   = ckpt_hash(data, len, this->sum);
+    this->left -= len;
+
+    return true;
+}
+
+//
+// Check the trailing checksum, and that nothing follows it.
+//
+bool
+CkptReader::finish()
+{
+    uint64_t sum = 0;
+
+    if (!this->ok)
+	return false;
+
+    this->fh.read((char *) &sum, sizeof(sum));
+    this->ok = (size_t) this->fh.gcount() == sizeof(sum) && sum == this->sum && this->fh.peek() == EOF;
+
+    return this->ok;
+}
+
+FilterCheckpoint::FilterCheckpoint()
+{
+    this->applied            = false;
+    this->below_stack_dep    = 0;
+    this->below_lnl_thresh   = 0;
+    this->constraint_removed = 0;
+    this->log_len            = 0;
+}
+
+void
+FilterCheckpoint::record(bool applied, int below_stack_dep, uint below_lnl_thresh, uint constraint_removed)
+{
+    this->applied            = applied;
+    this->below_stack_dep    = below_stack_dep;
+    this->below_lnl_thresh   = below_lnl_thresh;
+    this->constraint_removed = constraint_removed;
+}
+
+//
+// Layout, after the header:
+//   applied, below_stack_dep, below_lnl_thresh, constraint_removed, log_len, loci
+//   per locus: ID, heterozygote excess, SNP count, SNP columns
+//
+bool
+FilterCheckpoint::save(string path, uint64_t key, map<int, PLocus *> &catalog)
+{
+    map<int, PLocus *>::iterator it;
+    CkptWriter w(path, ckpt_filter, key);
+
+    w.put((uint8_t) this->applied);
+    w.put((int32_t) this->below_stack_dep);
+    w.put((uint32_t) this->below_lnl_thresh);
+    w.put((uint32_t) this->constraint_removed);
+    w.put((uint64_t) this->log_len);
+    w.put((uint32_t) catalog.size());
+
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	PLocus *loc = it->second;
+	w.put((int32_t) loc->id);
+	w.put((float) loc->het_excess);
+	w.put((uint16_t) loc->snp_cnt);
+	if (loc->snp_cnt > 0)
+	    w.put(loc->snps, loc->snp_cnt * sizeof(uint16_t));
+    }
+
+    return w.commit();
+}
+
+bool
+FilterCheckpoint::load(string path, uint64_t key)
+{
+    CkptReader r(path, ckpt_filter, key);
+    uint8_t    applied;
+    int32_t    below_stack_dep;
+    uint32_t   below_lnl_thresh, constraint_removed, n;
+    uint64_t   log_len;
+
+    if (!(r.get(applied) && r.get(below_stack_dep) && r.get(below_lnl_thresh) &&
+	  r.get(constraint_removed) && r.get(log_len) && r.get(n)))
+	return false;
+
+    //
+    // Check the locus count against the size of the file before sizing anything by it,
+    // so that a corrupt count is rejected rather than allocated.
+    //
+    if (!r.holds(n, sizeof(int32_t) + sizeof(float) + sizeof(uint16_t)))
+	return false;
+
+    vector<int>      ids(n);
+    vector<float>    het_excess(n);
+    vector<uint32_t> snp_start(n + 1, 0);
+    vector<uint16_t> snps;
+
+    for (uint i = 0; i < n; i++) {
+	int32_t  id;
+	uint16_t cnt;
+	if (!(r.get(id) && r.get(het_excess[i]) && r.get(cnt)))
+	    return false;
+	ids[i] = id;
+	snps.resize(snp_start[i] + cnt);
+	if (cnt > 0 && !r.get(&snps[snp_start[i]], cnt * sizeof(uint16_t)))
+	    return false;
+	snp_start[i + 1] = snp_start[i] + cnt;
+    }
+
+    if (!r.finish())
+	return false;
+
+    this->record(applied, below_stack_dep, below_lnl_thresh, constraint_removed);
+    this->log_len = log_len;
+    this->ids.swap(ids);
+    this->het_excess.swap(het_excess);
+    this->snp_start.swap(snp_start);
+    this->snps.swap(snps);
+
+    return true;
+}
+
+//
+// Reduce the catalog to the loci retained by the filtering stage, as they were left
+// by it. Returns the number of loci restored, -1 if the checkpoint lists loci the
+// catalog doesn't hold or with more SNPs than it holds.
+//
+int
+FilterCheckpoint::restore(map<int, PLocus *> &catalog)
+{
+    map<int, PLocus *> kept;
+    map<int, PLocus *>::iterator it;
+
+    for (uint i = 0; i < this->ids.size(); i++) {
+	it = catalog.find(this->ids[i]);
+	if (it == catalog.end() || this->snp_start[i + 1] - this->snp_start[i] > it->second->snp_cnt)
+	    return -1;
+    }
+
+    for (uint i = 0; i < this->ids.size(); i++) {
+	it = catalog.find(this->ids[i]);
+	uint cnt = this->snp_start[i + 1] - this->snp_start[i];
+
+	PLocus *loc = it->second;
+	loc->het_excess = this->het_excess[i];
+	loc->snp_cnt    = cnt;
+	for (uint k = 0; k < cnt; k++)
+	    loc->snps[k] = this->snps[this->snp_start[i] + k];
+	kept.insert(*it);
+    }
+    catalog.swap(kept);
+
+    return catalog.size();
+}
+
+PairsCheckpoint::PairsCheckpoint(string path, uint64_t key, double interval)
+{
+    this->path     = path;
+    this->key      = key;
+    this->interval = interval;
+    this->last     = time(NULL);
+}
+
+//
+// Layout, after the header:
+//   tile pairs in the work list, tile pairs completed, pairs found, then the pairs
+// Returns the number of tile pairs completed, appending the pairs found in them.
+//
+uint
+PairsCheckpoint::load(uint total, vector<Edge> &edges)
+{
+    CkptReader r(this->path, ckpt_pairs, this->key);
+    uint32_t   t, done;
+    uint64_t   n;
+
+    if (!(r.get(t) && r.get(done) && r.get(n)) || t != total || done > total || 
+	!r.holds(n, 2 * sizeof(uint32_t)))
+	return 0;
+
+    vector<uint32_t> pairs(2 * n);
+    if ((n > 0 && !r.get(&pairs[0], pairs.size() * sizeof(uint32_t))) || !r.finish())
+	return 0;
+
+    for (uint64_t e = 0; e < n; e++)
+	edges.push_back(make_pair(pairs[2 * e], pairs[2 * e + 1]));
+
+    return done;
+}
+
+bool
+PairsCheckpoint::due()
+{
+    return difftime(time(NULL), this->last) >= this->interval;
+}
+
+bool
+PairsCheckpoint::save(uint total, uint done, vector<Edge> &edges)
+{
+    CkptWriter w(this->path, ckpt_pairs, this->key);
+
+    w.put((uint32_t) total);
+    w.put((uint32_t) done);
+    w.put((uint64_t) edges.size());
+    for (uint64_t e = 0; e < edges.size(); e++) {
+	w.put((uint32_t) edges[e].first);
+	w.put((uint32_t) edges[e].second);
+    }
+    this->last = time(NULL);
+
+    return w.commit();
+}
@@ -0,0 +1,122 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <map>
+using std::map;
+#include <fstream>
+using std::ifstream;
+using std::ofstream;
+
+#include "locus.h"
+#include "cluster.h"
+
+uint64_t ckpt_hash(const void *, size_t, uint64_t = 0xcbf29ce484222325ULL);
+
+//
+// Binary checkpoint files. A file opens with a magic number, the kind of checkpoint
+// and a key identifying the catalog and parameters it was written under, and closes
+// with a checksum of everything before it. Files are written under a temporary name
+// and renamed into place, so that a checkpoint is either complete or absent.
+//
+class CkptWriter {
+    string   path;
+    string   tmp;
+    ofstream fh;
+    uint64_t sum;
+
+public:
+    CkptWriter(string, uint32_t, uint64_t);
+
+    void put(const void *, size_t);
+    template<class T> void put(T v) { this->put(&v, sizeof(T)); }
+    bool commit();
+};
+
+class CkptReader {
+    ifstream fh;
+    uint64_t sum;
+    uint64_t left;  // Bytes of the file not yet read.
+    bool     ok;
+
+public:
+    CkptReader(string, uint32_t, uint64_t);
+
+    bool valid() { return this->ok; }
+    bool holds(uint64_t cnt, size_t size) { return this->ok && cnt <= this->left / size; }
+    bool get(void *, size_t);
+    template<class T> bool get(T &v) { return this->get(&v, sizeof(T)); }
+    bool finish();
+};
+
+//
+// Checkpoint of the filtering stage: the tallies it reported, the length of the log
+// once written, and the retained loci with their remaining SNP columns and paralog
+// scores, all that clustering needs of the stage.
+//
+class FilterCheckpoint {
+    vector<int>      ids;
+    vector<float>    het_excess;
+    vector<uint32_t> snp_start;
+    vector<uint16_t> snps;
+
+public:
+    bool     applied;
+    int      below_stack_dep;
+    uint     below_lnl_thresh;
+    uint     constraint_removed;
+    uint64_t log_len;
+
+    FilterCheckpoint();
+
+    void record(bool, int, uint, uint);
+    bool save(string, uint64_t, map<int, PLocus *> &);
+    bool load(string, uint64_t);
+    int  restore(map<int, PLocus *> &);
+};
+
+//
+// Periodic checkpoint of an all-pairs comparison: the number of tile pairs of the
+// work list completed, in order, and the pairs of sequences found in them. A save
+// is due once the interval, in seconds, has passed since the last one.
+//
+class PairsCheckpoint {
+    string   path;
+    uint64_t key;
+    double   interval;
+    time_t   last;
+
+public:
+    PairsCheckpoint(string, uint64_t, double);
+
+    uint load(uint, vector<Edge> &);
+    bool due();
+    bool save(uint, uint, vector<Edge> &);
+};
+
+#endif // __CHECKPOINT_H__
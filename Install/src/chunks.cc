@@ -0,0 +1,325 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// chunks -- spill files for out-of-core processing of catalog loci
+//
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sstream>
+using std::stringstream;
+
+#include "chunks.h"
+
+//
+// Spilled records are buffered in memory and appended to the chunk files once
+// this many bytes have accumulated, keeping a single file handle open at a time.
+//
+const size_t spill_buf_lim = 64 * 1024 * 1024;
+
+ChunkSpill::ChunkSpill(string dir, uint num_chunks)
+{
+    this->dir        = dir;
+    this->num_chunks = num_chunks;
+    this->buffered   = 0;
+    this->match_buf.resize(num_chunks);
+    this->model_buf.resize(num_chunks);
+    this->match_len.assign(num_chunks, 0);
+    this->model_len.assign(num_chunks, 0);
+    this->match_mark.assign(num_chunks, 0);
+    this->model_mark.assign(num_chunks, 0);
+
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+	cerr << "Unable to create temporary directory '" << dir << "'\n";
+	exit(1);
+    }
+
+    //
+    // Truncate any spill files left over from an earlier run.
+    //
+    for (uint i = 0; i < num_chunks; i++) {
+	ofstream mfh(this->match_path(i).c_str(), ofstream::out);
+	ofstream dfh(this->model_path(i).c_str(), ofstream::out);
+	if (mfh.fail() || dfh.fail()) {
+	    cerr << "Error opening spill files in '" << dir << "'\n";
+	    exit(1);
+	}
+    }
+}
+
+ChunkSpill::~ChunkSpill()
+{
+    for (uint i = 0; i < this->num_chunks; i++) {
+	remove(this->match_path(i).c_str());
+	remove(this->model_path(i).c_str());
+    }
+    rmdir(this->dir.c_str());
+}
+
+string
+ChunkSpill::match_path(uint chunk)
+{
+    stringstream path;
+    path << this->dir << "/chunk_" << chunk << ".matches.tsv";
+    return path.str();
+}
+
+string
+ChunkSpill::model_path(uint chunk)
+{
+    stringstream path;
+    path << this->dir << "/chunk_" << chunk << ".models.tsv";
+    return path.str();
+}
+
+int
+ChunkSpill::chunk(int cat_id)
+{
+    map<int, uint>::iterator it = this->chunk_of.find(cat_id);
+
+    return it == this->chunk_of.end() ? -1 : (int) it->second;
+}
+
+void
+ChunkSpill::set_model_cnt(uint sample, uint cnt)
+{
+    if (this->model_cnt.size() <= sample)
+	this->model_cnt.resize(sample + 1, 0);
+    this->model_cnt[sample] = cnt;
+}
+
+//
+// Spill one record of a sample's matches file, we keep:
+//   <sample index><tab><catalog ID><tab><sample ID><tab><tag ID><tab><haplotype><tab><depth><tab><lnl>
+//
+void
+ChunkSpill::add_match(uint chunk, uint sample, vector<string> &parts)
+{
+    string &buf = this->match_buf[chunk];
+    size_t  len = buf.length();
+    char    idx[id_len];
+
+    sprintf(idx, "%u\t", sample);
+    buf += idx;
+    for (uint i = 2; i <= 7; i++) {
+	buf += parts[i];
+	buf += i < 7 ? '\t' : '\n';
+    }
+
+    this->buffered += buf.length() - len;
+    if (this->buffered > spill_buf_lim)
+	this->flush();
+}
+
+//
+// Spill one model record of a sample:
+//   <sample index><tab><tag ID><tab><model calls>
+//
+void
+ChunkSpill::add_model(uint chunk, uint sample, int tag_id, const char *model)
+{
+    string &buf = this->model_buf[chunk];
+    size_t  len = buf.length();
+    char    idx[id_len];
+
+    sprintf(idx, "%u\t%d\t", sample, tag_id);
+    buf += idx;
+    buf += model;
+    buf += '\n';
+
+    this->buffered += buf.length() - len;
+    if (this->buffered > spill_buf_lim)
+	this->flush();
+}
+
+void
+ChunkSpill::flush()
+{
+    for (uint i = 0; i < this->num_chunks; i++) {
+	if (this->match_buf[i].length() > 0) {
+	    ofstream fh(this->match_path(i).c_str(), ofstream::out | ofstream::app);
+	    fh << this->match_buf[i];
+	    this->match_len[i] += this->match_buf[i].length();
+	    this->match_buf[i].clear();
+	}
+	if (this->model_buf[i].length() > 0) {
+	    ofstream fh(this->model_path(i).c_str(), ofstream::out | ofstream::app);
+	    fh << this->model_buf[i];
+	    this->model_len[i] += this->model_buf[i].length();
+	    this->model_buf[i].clear();
+	}
+    }
+    this->buffered = 0;
+}
+
+//
+// Mark the end of the records spilled so far, before the records of a sample are
+// spilled, so that they can be dropped again if the sample turns out to be unusable.
+//
+void
+ChunkSpill::mark()
+{
+    for (uint i = 0; i < this->num_chunks; i++) {
+	this->match_mark[i] = this->match_len[i] + this->match_buf[i].length();
+	this->model_mark[i] = this->model_len[i] + this->model_buf[i].length();
+    }
+}
+
+//
+// Drop the records of one kind spilled since the mark, whether they are still
+// buffered or have already been appended to the chunk files.
+//
+void
+ChunkSpill::rollback(vector<string> &buf, vector<size_t> &len, vector<size_t> &mark, string (ChunkSpill::*path)(uint))
+{
+    for (uint i = 0; i < this->num_chunks; i++) {
+	size_t end = len[i] + buf[i].length();
+	if (end == mark[i])
+	    continue;
+
+	this->buffered -= buf[i].length();
+	if (mark[i] >= len[i]) {
+	    buf[i].resize(mark[i] - len[i]);
+	    this->buffered += buf[i].length();
+	    continue;
+	}
+
+	buf[i].clear();
+	string f = (this->*path)(i);
+	if (truncate(f.c_str(), mark[i]) != 0) {
+	    cerr << "Error truncating spill file '" << f << "'\n";
+	    exit(1);
+	}
+	len[i] = mark[i];
+    }
+}
+
+int
+ChunkSpill::load_matches(uint chunk, uint num_samples, vector<vector<CatMatch *> > &matches)
+{
+    vector<string> parts;
+    CatMatch      *m;
+    uint           sample;
+
+    char *line      = (char *) malloc(sizeof(char) * max_len);
+    int   size      = max_len;
+    int   fh_status = 1;
+
+    matches.clear();
+    matches.resize(num_samples);
+
+    string   f = this->match_path(chunk);
+    ifstream fh(f.c_str(), ifstream::in);
+    if (fh.fail()) {
+	cerr << "Error opening spill file '" << f << "'\n";
+	exit(1);
+    }
+
+    while (fh_status) {
+	fh_status = read_line(fh, &line, &size);
+
+	if (strlen(line) == 0)
+	    continue;
+
+	parse_tsv(line, parts);
+
+	sample       = atoi(parts[0].c_str());
+	m            = new CatMatch;
+	m->cat_id    = atoi(parts[1].c_str());
+	m->sample_id = atoi(parts[2].c_str());
+	m->tag_id    = atoi(parts[3].c_str());
+	m->haplotype = new char[parts[4].length() + 1];
+	strcpy(m->haplotype, parts[4].c_str());
+	m->depth     = atoi(parts[5].c_str());
+	m->lnl       = is_double(parts[6].c_str());
+	matches[sample].push_back(m);
+    }
+
+    fh.close();
+    free(line);
+
+    return 0;
+}
+
+ModelSource *
+ChunkSpill::models(uint chunk)
+{
+    return new SpillModels(this->model_path(chunk), this->model_cnt);
+}
+
+SpillModels::SpillModels(string path, vector<uint> &model_cnt) : model_cnt(model_cnt)
+{
+    this->line    = (char *) malloc(sizeof(char) * max_len);
+    this->size    = max_len;
+    this->pending = false;
+
+    this->fh.open(path.c_str(), ifstream::in);
+    if (this->fh.fail()) {
+	cerr << "Error opening spill file '" << path << "'\n";
+	exit(1);
+    }
+}
+
+SpillModels::~SpillModels()
+{
+    this->fh.close();
+    free(this->line);
+}
+
+int
+SpillModels::load(uint sample, map<int, ModRes *> &modres)
+{
+    map<int, ModRes *>::iterator it;
+    char *p, *q;
+    uint  idx;
+    int   tag_id;
+
+    //
+    // Records are grouped by sample index; stop at the first record of a later sample
+    // and keep it for the next call.
+    //
+    while (this->pending || read_line(this->fh, &this->line, &this->size) || strlen(this->line) > 0) {
+	this->pending = false;
+
+	if (strlen(this->line) == 0)
+	    continue;
+
+	idx = strtoul(this->line, &p, 10);
+	if (idx > sample) {
+	    this->pending = true;
+	    break;
+	}
+	tag_id = strtol(p + 1, &q, 10);
+
+	if (idx < sample) continue;
+
+	it = modres.find(tag_id);
+	if (it != modres.end())
+	    delete it->second;
+	modres[tag_id] = new ModRes(0, tag_id, q + 1);
+
+	this->line[0] = '\0';
+    }
+
+    return sample < this->model_cnt.size() ? this->model_cnt[sample] : 0;
+}
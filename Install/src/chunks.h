@@ -0,0 +1,117 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __CHUNKS_H__
+#define __CHUNKS_H__
+
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <map>
+using std::map;
+#include <fstream>
+using std::ifstream;
+using std::ofstream;
+
+#include "input.h"
+#include "stacks.h"
+
+//
+// Supplies the SNP model calls of each sample, one sample at a time.
+//
+class ModelSource {
+public:
+    virtual ~ModelSource() {}
+
+    //
+    // Load the model calls of the sample at index i. Returns the number of model
+    // records the sample holds in total, 0 if it has no model results at all.
+    //
+    virtual int  load(uint, map<int, ModRes *> &) = 0;
+    //
+    // Report a sample found to have no model results when loaded.
+    //
+    virtual void report_missing(uint) {}
+};
+
+//
+// Out-of-core processing of the catalog. Catalog loci are assigned to chunks, and
+// the matches and model calls of each sample are streamed once and spilled to one
+// pair of files per chunk, so that each chunk can later be loaded and filtered
+// holding only its slice of the data in memory.
+//
+class ChunkSpill {
+    string          dir;
+    uint            num_chunks;
+    map<int, uint>  chunk_of;   // Catalog locus ID -> chunk.
+    vector<uint>    model_cnt;  // Sample index -> number of model records in the sample.
+    vector<string>  match_buf;
+    vector<string>  model_buf;
+    vector<size_t>  match_len;  // Chunk -> bytes spilled to the matches file.
+    vector<size_t>  model_len;  // Chunk -> bytes spilled to the models file.
+    vector<size_t>  match_mark;
+    vector<size_t>  model_mark;
+    size_t          buffered;
+
+    void rollback(vector<string> &, vector<size_t> &, vector<size_t> &, string (ChunkSpill::*)(uint));
+
+public:
+    ChunkSpill(string, uint);
+    ~ChunkSpill();
+
+    uint chunks()                 { return this->num_chunks; }
+    void assign(int cat_id, uint chunk) { this->chunk_of[cat_id] = chunk; }
+    int  chunk(int);
+    void set_model_cnt(uint, uint);
+
+    void add_match(uint, uint, vector<string> &);
+    void add_model(uint, uint, int, const char *);
+    void flush();
+    void mark();
+    void drop_matches() { this->rollback(this->match_buf, this->match_len, this->match_mark, &ChunkSpill::match_path); }
+    void drop_models()  { this->rollback(this->model_buf, this->model_len, this->model_mark, &ChunkSpill::model_path); }
+
+    int  load_matches(uint, uint, vector<vector<CatMatch *> > &);
+    ModelSource *models(uint);
+
+    string match_path(uint);
+    string model_path(uint);
+};
+
+//
+// Replays the model calls spilled for one chunk. Samples must be requested in
+// increasing order of sample index.
+//
+class SpillModels : public ModelSource {
+    ifstream      fh;
+    vector<uint> &model_cnt;
+    char         *line;
+    int           size;
+    bool          pending;
+
+public:
+    SpillModels(string, vector<uint> &);
+    ~SpillModels();
+
+    int  load(uint, map<int, ModRes *> &);
+};
+
+#endif // __CHUNKS_H__
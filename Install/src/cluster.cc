@@ -0,0 +1,1606 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// cluster -- candidate generation and distances for paralog clustering
+//
+
+#ifdef _OPENMP
+#include <omp.h>    // OpenMP library
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fstream>
+using std::ofstream;
+#include <iostream>
+using std::cerr;
+#include <algorithm>
+using std::lower_bound;
+using std::binary_search;
+
+#include "cluster.h"
+#include "checkpoint.h"
+
+const uint64_t lane_lo = 0x5555555555555555ULL;
+
+static inline uint64_t
+mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+PackedSeqs::PackedSeqs()
+{
+    this->n       = 0;
+    this->stride  = 0;
+    this->min_len = 0;
+    this->comp_segs = 0;
+    this->ids     = NULL;
+    this->lens    = NULL;
+    this->exotic  = NULL;
+    this->codes   = NULL;
+    this->nmask   = NULL;
+    this->owned   = false;
+}
+
+void
+PackedSeqs::clear()
+{
+    if (this->owned) {
+	delete [] this->ids;
+	delete [] this->lens;
+	delete [] this->exotic;
+	delete [] this->codes;
+	delete [] this->nmask;
+    }
+    this->ids    = NULL;
+    this->lens   = NULL;
+    this->exotic = NULL;
+    this->codes  = NULL;
+    this->nmask  = NULL;
+    this->owned  = false;
+    this->n      = 0;
+    this->cons.clear();
+    this->comp.clear();
+    this->comp_segs = 0;
+}
+
+//
+// Exchange the sequences of two sets, along with the ownership of their arrays.
+//
+void
+PackedSeqs::swap(PackedSeqs &other)
+{
+    std::swap(this->n,         other.n);
+    std::swap(this->stride,    other.stride);
+    std::swap(this->min_len,   other.min_len);
+    std::swap(this->ids,       other.ids);
+    std::swap(this->lens,      other.lens);
+    std::swap(this->exotic,    other.exotic);
+    std::swap(this->codes,     other.codes);
+    std::swap(this->nmask,     other.nmask);
+    std::swap(this->comp_segs, other.comp_segs);
+    std::swap(this->owned,     other.owned);
+    this->cons.swap(other.cons);
+    this->comp.swap(other.comp);
+}
+
+int
+PackedSeqs::build(map<int, PLocus *> &catalog)
+{
+    map<int, PLocus *>::iterator it;
+    uint max_len = 0;
+    uint i;
+
+    this->clear();
+    this->owned   = true;
+    this->n       = catalog.size();
+    this->min_len = 0;
+    this->ids     = new int[this->n];
+    this->lens    = new uint16_t[this->n];
+    this->cons.resize(this->n);
+
+    for (it = catalog.begin(), i = 0; it != catalog.end(); it++, i++) {
+	uint len = strlen(it->second->con);
+
+	this->ids[i]  = it->first;
+	this->cons[i] = it->second->con;
+	this->lens[i] = len;
+
+	if (i == 0 || len < this->min_len) this->min_len = len;
+	if (len > max_len) max_len = len;
+    }
+
+    size_t words  = (size_t) this->n * ((max_len + 31) / 32);
+    this->stride  = (max_len + 31) / 32;
+    this->exotic  = new uint8_t[this->n];
+    this->codes   = new uint64_t[words];
+    this->nmask   = new uint64_t[words];
+    memset(this->exotic, 0, this->n);
+    memset(this->codes,  0, words * sizeof(uint64_t));
+    memset(this->nmask,  0, words * sizeof(uint64_t));
+
+    #pragma omp parallel for schedule(static)
+    for (uint i = 0; i < this->n; i++) {
+	uint64_t   *c = &this->codes[(size_t) i * this->stride];
+	uint64_t   *m = &this->nmask[(size_t) i * this->stride];
+	const char *p = this->cons[i];
+
+	for (uint k = 0; k < this->lens[i]; k++) {
+	    uint64_t code = 0;
+	    switch (p[k]) {
+	    case 'A': code = 0; break;
+	    case 'C': code = 1; break;
+	    case 'G': code = 2; break;
+	    case 'T': code = 3; break;
+	    default:
+		m[k / 32] |= 1ULL << (2 * (k % 32));
+		if (p[k] != 'N') this->exotic[i] = 1;
+		break;
+	    }
+	    c[k / 32] |= code << (2 * (k % 32));
+	}
+    }
+
+    this->composition();
+
+    return this->n;
+}
+
+//
+// Copy the sequences of src listed in order, in that order, so that the distance
+// phase can run over a reordered array. The IDs are then no longer sorted, and
+// index() cannot be used on the copy.
+//
+int
+PackedSeqs::permute(PackedSeqs &src, vector<uint> &order)
+{
+    this->clear();
+    this->owned   = true;
+    this->n       = order.size();
+    this->stride  = src.stride;
+    this->min_len = src.min_len;
+    this->ids     = new int[this->n];
+    this->lens    = new uint16_t[this->n];
+    this->exotic  = new uint8_t[this->n];
+    this->codes   = new uint64_t[(size_t) this->n * this->stride];
+    this->nmask   = new uint64_t[(size_t) this->n * this->stride];
+    this->cons.resize(this->n);
+
+    #pragma omp parallel for schedule(static)
+    for (uint k = 0; k < this->n; k++) {
+	uint i = order[k];
+	this->ids[k]    = src.ids[i];
+	this->lens[k]   = src.lens[i];
+	this->exotic[k] = src.exotic[i];
+	this->cons[k]   = src.cons[i];
+	memcpy(&this->codes[(size_t) k * this->stride], &src.codes[(size_t) i * src.stride], this->stride * sizeof(uint64_t));
+	memcpy(&this->nmask[(size_t) k * this->stride], &src.nmask[(size_t) i * src.stride], this->stride * sizeof(uint64_t));
+    }
+
+    this->composition();
+
+    return this->n;
+}
+
+int
+PackedSeqs::index(int id)
+{
+    int *it = lower_bound(this->ids, this->ids + this->n, id);
+
+    return (it == this->ids + this->n || *it != id) ? -1 : (int) (it - this->ids);
+}
+
+//
+// Is sequence i identical to sequence j of another set of packed sequences.
+// Sequences holding exotic characters are never considered identical, as only
+// their packed form is compared.
+//
+bool
+PackedSeqs::same(uint i, PackedSeqs &other, uint j)
+{
+    if (this->lens[i] != other.lens[j] || this->exotic[i] || other.exotic[j])
+	return false;
+
+    const uint64_t *ca = &this->codes[(size_t) i * this->stride];
+    const uint64_t *cb = &other.codes[(size_t) j * other.stride];
+    const uint64_t *na = &this->nmask[(size_t) i * this->stride];
+    const uint64_t *nb = &other.nmask[(size_t) j * other.stride];
+
+    for (uint w = 0; w < (this->lens[i] + 31u) / 32; w++)
+	if (ca[w] != cb[w] || na[w] != nb[w])
+	    return false;
+
+    return true;
+}
+
+//
+// Composition signatures for the lower bound on distances used by the all-pairs
+// search: the number of A, C, G, T and N in each segment of comp_seg nucleotides.
+// Over a segment, at most min(count_a, count_b) positions of each symbol can match,
+// so seg_len minus the sum of those minimums bounds the mismatches in the segment.
+// Segments extending past the end of a sequence count comp_seg of every symbol,
+// which makes their bound zero.
+//
+const uint comp_seg = 16;
+
+void
+PackedSeqs::composition()
+{
+    this->comp_segs = this->stride * 32 / comp_seg;
+    this->comp.assign((size_t) this->n * this->comp_segs * 5, comp_seg);
+
+    #pragma omp parallel for schedule(static)
+    for (uint i = 0; i < this->n; i++) {
+	for (uint s = 0; (s + 1) * comp_seg <= this->lens[i]; s++) {
+	    uint64_t nm, x = this->lanes(i, s * comp_seg, comp_seg, nm);
+	    uint64_t lo = x & lane_lo;
+	    uint64_t hi = (x >> 1) & lane_lo;
+	    uint64_t ok = ~nm & lane_lo & ((1ULL << (2 * comp_seg)) - 1);
+	    uint8_t *c  = &this->comp[((size_t) i * this->comp_segs + s) * 5];
+
+	    c[0] = __builtin_popcountll(~hi & ~lo & ok);
+	    c[1] = __builtin_popcountll(~hi &  lo & ok);
+	    c[2] = __builtin_popcountll( hi & ~lo & ok);
+	    c[3] = __builtin_popcountll( hi &  lo & ok);
+	    c[4] = comp_seg - c[0] - c[1] - c[2] - c[3];
+	}
+    }
+}
+
+//
+// Extract n <= 32 nucleotides of sequence i starting at column start; the codes are
+// returned and the matching N mask is stored in nm.
+//
+uint64_t
+PackedSeqs::lanes(uint i, uint start, uint n, uint64_t &nm)
+{
+    const uint64_t *c = &this->codes[(size_t) i * this->stride];
+    const uint64_t *m = &this->nmask[(size_t) i * this->stride];
+    uint w   = start / 32;
+    uint off = 2 * (start % 32);
+
+    uint64_t x = c[w] >> off;
+    nm         = m[w] >> off;
+    if (off > 0 && w + 1 < this->stride) {
+	x  |= c[w + 1] << (64 - off);
+	nm |= m[w + 1] << (64 - off);
+    }
+    if (n < 32) {
+	uint64_t mask = (1ULL << (2 * n)) - 1;
+	x  &= mask;
+	nm &= mask;
+    }
+    return x;
+}
+
+//
+// Distance between two consensus sequences, sequence i of this set and sequence j
+// of other: the difference in length plus the number of mismatches over the shorter
+// sequence. Returns -1 once the distance exceeds limit.
+//
+int
+PackedSeqs::dist(uint i, PackedSeqs &other, uint j, int limit)
+{
+    int li = this->lens[i];
+    int lj = other.lens[j];
+    int d  = li > lj ? li - lj : lj - li;
+    int m  = li < lj ? li : lj;
+
+    if (m == 0) return d > limit ? -1 : d;
+
+    if (this->exotic[i] || other.exotic[j]) {
+	const char *p = this->cons[i];
+	const char *q = other.cons[j];
+	for (int k = 0; k < m; k++) {
+	    d += (p[k] == q[k]) ? 0 : 1;
+	    if (d > limit)
+		return -1;
+	}
+	return d;
+    }
+
+    if (d > limit) return -1;
+
+    const uint64_t *ca = &this->codes[(size_t) i * this->stride];
+    const uint64_t *cb = &other.codes[(size_t) j * other.stride];
+    const uint64_t *na = &this->nmask[(size_t) i * this->stride];
+    const uint64_t *nb = &other.nmask[(size_t) j * other.stride];
+    uint words = (m + 31) / 32;
+
+    for (uint w = 0; w < words; w++) {
+	uint64_t x    = ca[w] ^ cb[w];
+	uint64_t diff = (((x | (x >> 1)) & lane_lo) & ~(na[w] | nb[w])) | (na[w] ^ nb[w]);
+
+	if (w == words - 1 && m % 32 != 0)
+	    diff &= (1ULL << (2 * (m % 32))) - 1;
+
+	d += __builtin_popcountll(diff);
+	if (d > limit)
+	    return -1;
+    }
+
+    return d;
+}
+
+SeedIndex::SeedIndex()
+{
+    this->max_dist = 0;
+    this->n        = 0;
+    this->segs     = 0;
+    this->bounds   = NULL;
+    this->hashes   = NULL;
+    this->owned    = false;
+}
+
+void
+SeedIndex::clear()
+{
+    if (this->owned) {
+	delete [] this->bounds;
+	delete [] this->hashes;
+    }
+    this->bounds = NULL;
+    this->hashes = NULL;
+    this->owned  = false;
+    this->segs   = 0;
+    this->n      = 0;
+}
+
+int
+SeedIndex::build(PackedSeqs &seqs, int max_dist)
+{
+    this->clear();
+    this->max_dist = max_dist;
+
+    if (max_dist < 0 || seqs.min_len < (uint) max_dist + 1)
+	return 0;
+
+    this->owned  = true;
+    this->n      = seqs.size();
+    this->segs   = max_dist + 1;
+    this->bounds = new uint[this->segs + 1];
+    this->hashes = new uint64_t[(size_t) this->n * this->segs];
+
+    for (uint s = 0; s <= this->segs; s++)
+	this->bounds[s] = (uint) ((uint64_t) s * seqs.min_len / this->segs);
+
+    #pragma omp parallel for schedule(static)
+    for (uint i = 0; i < this->n; i++) {
+	uint64_t nm, x;
+
+	for (uint s = 0; s < this->segs; s++) {
+	    uint64_t h = mix64(s + 1);
+
+	    for (uint k = this->bounds[s]; k < this->bounds[s + 1]; k += 32) {
+		uint len = this->bounds[s + 1] - k < 32 ? this->bounds[s + 1] - k : 32;
+		x = seqs.lanes(i, k, len, nm);
+		h = mix64(h ^ x);
+		h = mix64(h ^ nm);
+	    }
+	    this->hashes[(size_t) i * this->segs + s] = h;
+	}
+    }
+
+    return this->segs;
+}
+
+//
+// Order the member sequences so that similar sequences sit together: by the minimizer
+// of their k-mers, the k-mer with the smallest hash, and then by their leading
+// nucleotides. Sequences sharing a minimizer form a bucket. Returns the number of
+// buckets.
+//
+const uint order_k = 16;
+
+int
+similarity_order(PackedSeqs &seqs, vector<uint> &members, vector<uint> &order)
+{
+    uint n = members.size();
+    vector<pair<pair<uint64_t, uint64_t>, uint> > keys(n);
+
+    #pragma omp parallel for schedule(static)
+    for (uint k = 0; k < n; k++) {
+	uint     i   = members[k];
+	uint     len = seqs.lens[i];
+	uint64_t nm, x = 0, min = ~0ULL;
+	uint     run = 0;
+
+	const uint64_t *c = &seqs.codes[(size_t) i * seqs.stride];
+	const uint64_t *m = &seqs.nmask[(size_t) i * seqs.stride];
+
+	for (uint p = 0; p < len; p++) {
+	    uint sh = 2 * (p % 32);
+	    if ((m[p / 32] >> sh) & 1) {
+		run = 0;
+		continue;
+	    }
+	    x = ((x << 2) | ((c[p / 32] >> sh) & 3)) & ((1ULL << (2 * order_k)) - 1);
+	    if (++run < order_k) continue;
+
+	    uint64_t h = mix64(x);
+	    if (h < min) min = h;
+	}
+	x = len > 0 ? seqs.lanes(i, 0, len < 32 ? len : 32, nm) : 0;
+
+	keys[k] = make_pair(make_pair(min, x), i);
+    }
+
+    sort(keys.begin(), keys.end());
+
+    uint buckets = 0;
+    order.resize(n);
+    for (uint k = 0; k < n; k++) {
+	order[k] = keys[k].second;
+	if (k == 0 || keys[k].first.first != keys[k - 1].first.first)
+	    buckets++;
+    }
+
+    return buckets;
+}
+
+//
+// Find all pairs of member sequences within max_dist of one another, using the seed
+// index to generate candidates. A pair is examined in the first segment the two
+// sequences share, and only if the hash of that segment falls in the requested shard,
+// so that shards partition the candidate pairs. Edges are returned as sorted pairs of
+// sequence indexes. If fresh is given, only pairs involving a fresh sequence are
+// examined.
+//
+int
+find_edges(PackedSeqs &seqs, SeedIndex &idx, vector<uint> &members, int max_dist, 
+	   uint shard, uint num_shards, vector<Edge> &edges, vector<bool> *fresh)
+{
+    uint n = members.size();
+
+    #pragma omp parallel
+    {
+	vector<pair<uint64_t, uint> > bucket;
+	vector<Edge> local;
+
+	#pragma omp for schedule(dynamic)
+	for (uint s = 0; s < idx.segs; s++) {
+	    bucket.clear();
+	    for (uint i = 0; i < n; i++)
+		bucket.push_back(make_pair(idx.hash(members[i], s), members[i]));
+	    sort(bucket.begin(), bucket.end());
+
+	    uint start = 0;
+	    while (start < n) {
+		uint end = start + 1;
+		while (end < n && bucket[end].first == bucket[start].first) end++;
+
+		bool examine = end - start > 1 && bucket[start].first % num_shards == shard;
+		if (examine && fresh != NULL) {
+		    examine = false;
+		    for (uint a = start; a < end && !examine; a++)
+			examine = (*fresh)[bucket[a].second];
+		}
+
+		if (examine) {
+		    for (uint a = start; a < end; a++) {
+			uint i = bucket[a].second;
+			for (uint b = a + 1; b < end; b++) {
+			    uint j = bucket[b].second;
+			    if (fresh != NULL && !(*fresh)[i] && !(*fresh)[j])
+				continue;
+			    uint t = 0;
+			    while (t < s && idx.hash(i, t) != idx.hash(j, t)) t++;
+			    if (t < s) continue;
+
+			    if (seqs.dist(i, j, max_dist) >= 0)
+				local.push_back(make_pair(i, j));
+			}
+		    }
+		}
+		start = end;
+	    }
+	}
+
+	#pragma omp critical
+	edges.insert(edges.end(), local.begin(), local.end());
+    }
+
+    sort(edges.begin(), edges.end());
+
+    return edges.size();
+}
+
+//
+// Members are compared in square tiles, sized so that the packed sequences of a
+// pair of tiles stay in cache while the tiles are compared.
+//
+const size_t tile_bytes = 128 * 1024;
+const uint   tile_min   = 64;
+const uint   tile_max   = 4096;
+
+//
+// A thread's share of the tile pairs. Threads take pairs from their own queue and
+// steal from the queues of other threads once it runs dry; the padding keeps the
+// counters of different threads on separate cache lines.
+//
+struct TileQueue {
+    uint next;
+    uint end;
+    char pad[56];
+};
+
+//
+// The composition signatures of a column tile, transposed so that each symbol count
+// of each segment is contiguous across the tile. The lower bounds of a row against
+// every sequence of the tile are then accumulated with SIMD, and only the sequences
+// whose bound is within the distance limit are compared.
+//
+class CompTile {
+public:
+    uint             cnt;
+    uint             segs;
+    vector<uint8_t>  counts; // [segment][symbol][sequence]
+    vector<uint16_t> lens;
+    vector<uint16_t> bound;
+
+    void load(PackedSeqs &seqs, vector<uint> &members, uint start, uint end) {
+	this->cnt  = end - start;
+	this->segs = seqs.comp_segs;
+	this->counts.resize((size_t) this->segs * 5 * this->cnt);
+	this->lens.resize(this->cnt);
+	this->bound.resize(this->cnt);
+
+	for (uint k = 0; k < this->cnt; k++) {
+	    uint j = members[start + k];
+	    const uint8_t *c = &seqs.comp[(size_t) j * this->segs * 5];
+	    for (uint v = 0; v < this->segs * 5; v++)
+		this->counts[(size_t) v * this->cnt + k] = c[v];
+	    this->lens[k] = seqs.lens[j];
+	}
+    }
+
+    void bounds(PackedSeqs &seqs, uint i) {
+	const uint8_t *a   = &seqs.comp[(size_t) i * this->segs * 5];
+	uint16_t      *b   = &this->bound[0];
+	const uint16_t *ln = &this->lens[0];
+	int            li  = seqs.lens[i];
+	uint           n   = this->cnt;
+
+	#pragma omp simd
+	for (uint k = 0; k < n; k++)
+	    b[k] = li > ln[k] ? li - ln[k] : ln[k] - li;
+
+	for (uint s = 0; (s + 1) * comp_seg <= (uint) li && s < this->segs; s++) {
+	    const uint8_t *c0 = &this->counts[(size_t) (s * 5) * n];
+	    const uint8_t *c1 = c0 + n;
+	    const uint8_t *c2 = c1 + n;
+	    const uint8_t *c3 = c2 + n;
+	    const uint8_t *c4 = c3 + n;
+	    uint8_t a0 = a[s * 5], a1 = a[s * 5 + 1], a2 = a[s * 5 + 2], a3 = a[s * 5 + 3], a4 = a[s * 5 + 4];
+
+	    #pragma omp simd
+	    for (uint k = 0; k < n; k++) {
+		uint8_t m = (c0[k] < a0 ? c0[k] : a0) + (c1[k] < a1 ? c1[k] : a1) + (c2[k] < a2 ? c2[k] : a2) + 
+		    (c3[k] < a3 ? c3[k] : a3) + (c4[k] < a4 ? c4[k] : a4);
+		b[k] += comp_seg - m;
+	    }
+	}
+    }
+};
+
+static void
+compare_tiles(PackedSeqs &seqs, vector<uint> &members, int max_dist, uint tile, 
+	      uint row, uint col, CompTile &ctile, vector<Edge> &edges)
+{
+    uint n  = members.size();
+    uint i1 = (row + 1) * tile < n ? (row + 1) * tile : n;
+    uint j0 = col * tile;
+    uint j1 = (col + 1) * tile < n ? (col + 1) * tile : n;
+
+    ctile.load(seqs, members, j0, j1);
+
+    for (uint i = row * tile; i < i1; i++) {
+	uint a = members[i];
+
+	ctile.bounds(seqs, a);
+
+	for (uint j = (row == col ? i + 1 : j0); j < j1; j++)
+	    if (ctile.bound[j - j0] <= max_dist && seqs.dist(a, members[j], max_dist) >= 0)
+		edges.push_back(make_pair(a, members[j]));
+    }
+}
+
+//
+// Smallest number of tile pairs compared in a round between checkpoints.
+//
+const uint tile_round_min = 256;
+
+//
+// Compare the tile pairs [start, end) of the work list in parallel, counting completed
+// tile pairs in done for the progress shown.
+//
+static void
+compare_work(PackedSeqs &seqs, vector<uint> &members, int max_dist, uint tile, vector<pair<uint, uint> > &work,
+	     uint start, uint end, uint &done, uint total, vector<Edge> &edges)
+{
+    vector<TileQueue> queues;
+    uint cnt_work = end - start;
+
+    #pragma omp parallel
+    {
+	CompTile     ctile;
+	vector<Edge> local;
+	int num_threads = 1;
+	int t           = 0;
+	#ifdef _OPENMP
+	num_threads = omp_get_num_threads();
+	t           = omp_get_thread_num();
+	#endif
+
+	#pragma omp single
+	{
+	    queues.resize(num_threads);
+	    for (int q = 0; q < num_threads; q++) {
+		queues[q].next = start + (uint) ((uint64_t) cnt_work * q / num_threads);
+		queues[q].end  = start + (uint) ((uint64_t) cnt_work * (q + 1) / num_threads);
+	    }
+	}
+
+	uint shown = (uint64_t) done * 100 / total;
+
+	for (int v = 0; v < num_threads; v++) {
+	    TileQueue &q = queues[(t + v) % num_threads];
+
+	    while (true) {
+		uint w, cnt;
+
+		#pragma omp atomic capture
+		w = q.next++;
+		if (w >= q.end) break;
+
+		compare_tiles(seqs, members, max_dist, tile, work[w].first, work[w].second, ctile, local);
+
+		#pragma omp atomic capture
+		cnt = ++done;
+
+		if (t == 0 && cnt * 100ULL / total > shown) {
+		    shown = cnt * 100ULL / total;
+		    cerr << "  Compared " << shown << "% of tile pairs...\r";
+		}
+	    }
+	}
+
+	#pragma omp critical
+	edges.insert(edges.end(), local.begin(), local.end());
+    }
+}
+
+//
+// Compare every pair of member sequences; used when the sequences are too short to
+// split into max_dist + 1 seed segments. Pairs are compared a tile pair at a time,
+// and shards take every num_shards-th tile pair. If fresh is given, only the rows of
+// fresh sequences are compared, against every sequence that is not a fresh sequence
+// already compared; shards then take every num_shards-th row. If a checkpoint is
+// given, progress through the tile pairs is saved to it periodically.
+//
+int
+find_edges_allpairs(PackedSeqs &seqs, vector<uint> &members, int max_dist, 
+		    uint shard, uint num_shards, vector<Edge> &edges, vector<bool> *fresh,
+		    PairsCheckpoint *ckpt)
+{
+    uint n = members.size();
+
+    if (fresh != NULL) {
+	#pragma omp parallel
+	{
+	    vector<Edge> local;
+
+	    #pragma omp for schedule(dynamic)
+	    for (uint i = shard; i < n; i += num_shards) {
+		uint a = members[i];
+		if (!(*fresh)[a]) continue;
+
+		for (uint j = 0; j < n; j++) {
+		    uint b = members[j];
+		    if (j == i || (j < i && (*fresh)[b]))
+			continue;
+		    if (seqs.dist(a, b, max_dist) >= 0)
+			local.push_back(a < b ? make_pair(a, b) : make_pair(b, a));
+		}
+	    }
+
+	    #pragma omp critical
+	    edges.insert(edges.end(), local.begin(), local.end());
+	}
+
+	sort(edges.begin(), edges.end());
+	return edges.size();
+    }
+
+    uint tile = tile_bytes / (2 * sizeof(uint64_t) * (seqs.stride > 0 ? seqs.stride : 1));
+    if (tile < tile_min) tile = tile_min;
+    if (tile > tile_max) tile = tile_max;
+
+    uint tiles = (n + tile - 1) / tile;
+    uint p     = 0;
+    vector<pair<uint, uint> > work;
+
+    for (uint row = 0; row < tiles; row++)
+	for (uint col = row; col < tiles; col++, p++)
+	    if (p % num_shards == shard)
+		work.push_back(make_pair(row, col));
+
+    uint total = work.size();
+    uint done  = 0;
+
+    //
+    // With a checkpoint, the work list is compared in rounds, after each of which the
+    // pairs found so far may be saved; a resumed comparison skips the tile pairs that
+    // were completed.
+    //
+    uint round = total;
+    if (ckpt != NULL) {
+	done  = ckpt->load(total, edges);
+	round = total / 100 > tile_round_min ? total / 100 : tile_round_min;
+	if (done > 0)
+	    cerr << "  Resuming from " << done << " of " << total << " pairs of tiles compared.\n";
+    }
+
+    for (uint start = done; start < total; start += round) {
+	uint end = start + round < total ? start + round : total;
+
+	compare_work(seqs, members, max_dist, tile, work, start, end, done, total, edges);
+
+	if (ckpt != NULL && end < total && ckpt->due())
+	    ckpt->save(total, end, edges);
+    }
+
+    if (total > 0)
+	cerr << "  Compared " << total << " pairs of tiles of " << tile << " loci.\n";
+
+    sort(edges.begin(), edges.end());
+
+    return edges.size();
+}
+
+//
+// Leaves are split once they hold more than twice this many sequences.
+//
+const uint vp_leaf = 32;
+
+//
+// Build the subtree over cnt sequences, reordering them. Subtrees over many
+// sequences are built as separate tasks.
+//
+VpNode *
+VpTree::build(uint *items, uint cnt)
+{
+    VpNode *node = new VpNode;
+
+    if (cnt <= vp_leaf) {
+	node->items.assign(items, items + cnt);
+	return node;
+    }
+
+    //
+    // Take the middle sequence as the vantage point, and split the others at their
+    // median distance to it.
+    //
+    uint t = items[0]; items[0] = items[cnt / 2]; items[cnt / 2] = t;
+    node->vp = items[0];
+
+    vector<pair<int, uint> > d(cnt - 1);
+    for (uint k = 1; k < cnt; k++)
+	d[k - 1] = make_pair(this->seqs.dist(node->vp, items[k], INT_MAX), items[k]);
+
+    uint m = (cnt - 1) / 2;
+    nth_element(d.begin(), d.begin() + m, d.end());
+    node->mu = d[m].first;
+
+    for (uint k = 0; k < cnt - 1; k++)
+	items[k + 1] = d[k].second;
+
+    uint *in  = items + 1;
+    uint  nin = m + 1;
+    uint *out = items + 1 + nin;
+    uint  nout = cnt - 1 - nin;
+
+    #pragma omp task shared(node) if (nin > 4096)
+    node->inner = this->build(in, nin);
+    #pragma omp task shared(node) if (nout > 4096)
+    node->outer = this->build(out, nout);
+    #pragma omp taskwait
+
+    return node;
+}
+
+void
+VpTree::build(vector<uint> &members)
+{
+    vector<uint> items(members);
+
+    delete this->root;
+    this->n = items.size();
+
+    #pragma omp parallel
+    {
+	#pragma omp single
+	this->root = this->build(items.size() > 0 ? &items[0] : NULL, items.size());
+    }
+}
+
+//
+// Add sequence i to the tree. Not safe to call concurrently with other insertions
+// or with queries.
+//
+void
+VpTree::insert(uint i)
+{
+    if (this->root == NULL)
+	this->root = new VpNode;
+
+    VpNode *node = this->root;
+    while (!node->leaf()) {
+	int d = this->seqs.dist(i, node->vp, node->mu);
+	node  = (d >= 0) ? node->inner : node->outer;
+    }
+
+    node->items.push_back(i);
+    this->n++;
+
+    if (node->items.size() > 2 * vp_leaf) {
+	VpNode *sub = this->build(&node->items[0], node->items.size());
+	node->items.clear();
+	node->vp    = sub->vp;
+	node->mu    = sub->mu;
+	node->inner = sub->inner;
+	node->outer = sub->outer;
+	sub->inner  = NULL;
+	sub->outer  = NULL;
+	delete sub;
+    }
+}
+
+//
+// Find the sequences of the tree within r of sequence q of the query set, which may
+// be the set the tree was built over. The distance to a vantage point is only needed
+// exactly up to mu + r; beyond that, only the outer subtree can hold matches.
+//
+int
+VpTree::range(PackedSeqs &qs, uint q, int r, vector<uint> &hits)
+{
+    vector<VpNode *> stack;
+
+    hits.clear();
+    if (this->root != NULL)
+	stack.push_back(this->root);
+
+    while (stack.size() > 0) {
+	VpNode *node = stack.back();
+	stack.pop_back();
+
+	if (node->leaf()) {
+	    for (uint k = 0; k < node->items.size(); k++)
+		if (qs.dist(q, this->seqs, node->items[k], r) >= 0)
+		    hits.push_back(node->items[k]);
+	    continue;
+	}
+
+	int d = qs.dist(q, this->seqs, node->vp, node->mu + r);
+
+	if (d >= 0 && d <= r)
+	    hits.push_back(node->vp);
+	if (d >= 0 && d - r <= node->mu)
+	    stack.push_back(node->inner);
+	if (d < 0 || d + r >= node->mu)
+	    stack.push_back(node->outer);
+    }
+
+    return hits.size();
+}
+
+//
+// Find all pairs of member sequences within max_dist of one another with range
+// queries on a vantage-point tree. Shards take every num_shards-th member as the
+// query. If fresh is given, the tree is built over the other members, and each
+// fresh sequence is queried and then inserted, so that every pair involving a fresh
+// sequence is found once.
+//
+int
+find_edges_vptree(PackedSeqs &seqs, vector<uint> &members, int max_dist, 
+		  uint shard, uint num_shards, vector<Edge> &edges, vector<bool> *fresh)
+{
+    VpTree tree(seqs);
+    uint   n = members.size();
+
+    if (fresh != NULL) {
+	vector<uint> stale, hits;
+
+	for (uint i = 0; i < n; i++)
+	    if (!(*fresh)[members[i]])
+		stale.push_back(members[i]);
+	tree.build(stale);
+
+	for (uint i = shard; i < n; i += num_shards) {
+	    uint a = members[i];
+	    if (!(*fresh)[a]) continue;
+
+	    tree.range(seqs, a, max_dist, hits);
+	    for (uint k = 0; k < hits.size(); k++)
+		edges.push_back(a < hits[k] ? make_pair(a, hits[k]) : make_pair(hits[k], a));
+	    tree.insert(a);
+	}
+
+	sort(edges.begin(), edges.end());
+	return edges.size();
+    }
+
+    tree.build(members);
+
+    #pragma omp parallel
+    {
+	vector<uint> hits;
+	vector<Edge> local;
+
+	#pragma omp for schedule(dynamic, 64)
+	for (uint i = shard; i < n; i += num_shards) {
+	    uint a = members[i];
+	    tree.range(seqs, a, max_dist, hits);
+	    for (uint k = 0; k < hits.size(); k++)
+		if (hits[k] != a)
+		    local.push_back(a < hits[k] ? make_pair(a, hits[k]) : make_pair(hits[k], a));
+	}
+
+	#pragma omp critical
+	edges.insert(edges.end(), local.begin(), local.end());
+    }
+
+    //
+    // Each pair is found from both ends.
+    //
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    return edges.size();
+}
+
+//
+// Choose the k-mer length, rows and bands of the MinHash search for sequences of
+// length len and a target recall of pairs max_dist apart. Mismatches are taken to
+// fall at random, so a k-mer survives in the other sequence with probability
+// (1 - max_dist / len)^k. Among the row counts reaching the target within the
+// budget of hash functions, the one with the lowest estimated cost of hashing and
+// of comparing chance candidates among n sequences is used. A k of 0 picks a k-mer
+// length that keeps about a quarter of the k-mers intact. The band signatures of all
+// n sequences are held at once, so the bands are also limited to what fits in
+// lsh_sig_budget bytes; the expected recall reports any shortfall from the target.
+//
+const uint   lsh_max_hashes = 1024;
+const size_t lsh_sig_budget = 512UL << 20;
+
+int
+LshParams::choose(uint len, int max_dist, uint n, double target, uint k)
+{
+    double p = len > 0 ? (double) max_dist / len : 1.0;
+    if (p > 1.0) p = 1.0;
+
+    if (k == 0) {
+	k = p <= 0.0 ? 16 : (p >= 1.0 ? 8 : (uint) lround(log(0.25) / log(1.0 - p)));
+	if (k < 8)  k = 8;
+	if (k > 16) k = 16;
+    }
+    this->k = k;
+
+    double kmers  = len >= k ? len - k + 1 : 1;
+    double s      = pow(1.0 - p, (double) k);
+    double j_pair = s / (2.0 - s);
+    double j_rand = kmers / (2.0 * pow(4.0, (double) k));
+    double best   = -1.0;
+
+    if (j_rand > 1.0) j_rand = 1.0;
+
+    size_t max_bands = lsh_sig_budget / (sizeof(uint64_t) * (n > 0 ? n : 1));
+    if (max_bands > lsh_max_hashes) max_bands = lsh_max_hashes;
+    if (max_bands < 1) max_bands = 1;
+
+    this->rows  = 1;
+    this->bands = max_bands;
+
+    for (uint r = 1; r <= 4; r++) {
+	double q = pow(j_pair, (double) r);
+	if (q <= 0.0) break;
+
+	double b = q >= 1.0 ? 1.0 : ceil(log(1.0 - target) / log(1.0 - q));
+	if (b * r > lsh_max_hashes || b > max_bands) continue;
+
+	double cost = (double) n * kmers * b * r + 10.0 * b * pow(j_rand, (double) r) * n * n / 2.0;
+	if (best < 0.0 || cost < best) {
+	    best        = cost;
+	    this->rows  = r;
+	    this->bands = (uint) b;
+	}
+    }
+
+    this->recall = 1.0 - pow(1.0 - pow(j_pair, (double) this->rows), (double) this->bands);
+
+    return this->bands;
+}
+
+//
+// Find pairs of member sequences within max_dist of one another among the sequences
+// sharing a MinHash band. Candidates are verified with the exact distance, so every
+// pair returned is a true edge, but some edges may be missed. As with the seed index,
+// a pair is examined in the first band the two sequences share and only if the band
+// hash falls in the requested shard.
+//
+int
+find_edges_lsh(PackedSeqs &seqs, vector<uint> &members, int max_dist, LshParams &lsh, 
+	       uint shard, uint num_shards, vector<Edge> &edges)
+{
+    uint n      = members.size();
+    uint bands  = lsh.bands;
+    uint hashes = lsh.bands * lsh.rows;
+    uint64_t kmask = lsh.k >= 32 ? ~0ULL : (1ULL << (2 * lsh.k)) - 1;
+
+    vector<uint64_t> sig((size_t) n * bands);
+    vector<char>     hashed(n, 0);
+    vector<uint64_t> seeds(hashes);
+
+    for (uint h = 0; h < hashes; h++)
+	seeds[h] = mix64(h + 1);
+
+    #pragma omp parallel
+    {
+	vector<uint64_t> mins(hashes);
+
+	#pragma omp for schedule(dynamic, 64)
+	for (uint i = 0; i < n; i++) {
+	    const char *p = seqs.cons[members[i]];
+	    uint64_t    x = 0;
+	    uint        run = 0;
+
+	    mins.assign(hashes, ~0ULL);
+
+	    for (uint c = 0; p[c] != '\0'; c++) {
+		uint64_t code;
+		switch (p[c]) {
+		case 'A': code = 0; break;
+		case 'C': code = 1; break;
+		case 'G': code = 2; break;
+		case 'T': code = 3; break;
+		default:
+		    run = 0;
+		    continue;
+		}
+		x = ((x << 2) | code) & kmask;
+		if (++run < lsh.k) continue;
+
+		hashed[i] = 1;
+		for (uint h = 0; h < hashes; h++) {
+		    uint64_t v = mix64(x ^ seeds[h]);
+		    if (v < mins[h]) mins[h] = v;
+		}
+	    }
+
+	    for (uint b = 0; b < bands; b++) {
+		uint64_t v = mix64(b + 1);
+		for (uint r = 0; r < lsh.rows; r++)
+		    v = mix64(v ^ mins[b * lsh.rows + r]);
+		sig[(size_t) i * bands + b] = v;
+	    }
+	}
+    }
+
+    #pragma omp parallel
+    {
+	vector<pair<uint64_t, uint> > bucket;
+	vector<Edge> local;
+
+	#pragma omp for schedule(dynamic)
+	for (uint b = 0; b < bands; b++) {
+	    bucket.clear();
+	    for (uint i = 0; i < n; i++)
+		if (hashed[i])
+		    bucket.push_back(make_pair(sig[(size_t) i * bands + b], i));
+	    sort(bucket.begin(), bucket.end());
+
+	    uint start = 0;
+	    while (start < bucket.size()) {
+		uint end = start + 1;
+		while (end < bucket.size() && bucket[end].first == bucket[start].first) end++;
+
+		if (end - start > 1 && bucket[start].first % num_shards == shard) {
+		    for (uint a = start; a < end; a++) {
+			uint i = bucket[a].second;
+			for (uint c = a + 1; c < end; c++) {
+			    uint j = bucket[c].second;
+			    uint t = 0;
+			    while (t < b && sig[(size_t) i * bands + t] != sig[(size_t) j * bands + t]) t++;
+			    if (t < b) continue;
+
+			    uint si = members[i], sj = members[j];
+			    if (seqs.dist(si, sj, max_dist) >= 0)
+				local.push_back(si < sj ? make_pair(si, sj) : make_pair(sj, si));
+			}
+		    }
+		}
+		start = end;
+	    }
+	}
+
+	#pragma omp critical
+	edges.insert(edges.end(), local.begin(), local.end());
+    }
+
+    sort(edges.begin(), edges.end());
+
+    return edges.size();
+}
+
+//
+// Draw cnt distinct members at random. The generator is seeded with a constant so
+// that repeated estimates of a catalog draw the same sample.
+//
+void
+sample_members(vector<uint> &members, uint cnt, vector<uint> &sample)
+{
+    vector<uint> pool(members);
+    uint64_t     h = 0x9e3779b97f4a7c15ULL;
+
+    if (cnt > pool.size()) cnt = pool.size();
+
+    for (uint k = 0; k < cnt; k++) {
+	h = mix64(h + k);
+	uint r = k + h % (pool.size() - k);
+	uint t = pool[k];
+	pool[k] = pool[r];
+	pool[r] = t;
+    }
+
+    sample.assign(pool.begin(), pool.begin() + cnt);
+    sort(sample.begin(), sample.end());
+}
+
+void
+SampleSearch::bucket()
+{
+    uint segs = this->idx.segs;
+
+    this->buckets.assign(segs, vector<pair<uint64_t, uint> >());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (uint s = 0; s < segs; s++) {
+	vector<uint64_t> keys(this->sample.size());
+	vector<pair<uint64_t, uint> > &bucket = this->buckets[s];
+
+	for (uint k = 0; k < this->sample.size(); k++)
+	    keys[k] = this->idx.hash(this->sample[k], s);
+	sort(keys.begin(), keys.end());
+
+	for (uint a = 0; a < this->members.size(); a++) {
+	    uint64_t h = this->idx.hash(this->members[a], s);
+	    if (binary_search(keys.begin(), keys.end(), h))
+		bucket.push_back(make_pair(h, this->members[a]));
+	}
+	sort(bucket.begin(), bucket.end());
+    }
+}
+
+void
+SampleSearch::search(int max_dist)
+{
+    uint segs = this->idx.segs;
+    uint n    = this->members.size();
+
+    this->nearest.assign(this->sample.size(), -1);
+    this->pairs.assign(max_dist + 1, 0);
+    this->candidates = 0;
+
+    #pragma omp parallel
+    {
+	vector<uint64_t> local(max_dist + 1, 0);
+	uint64_t compared = 0;
+
+	#pragma omp for schedule(dynamic)
+	for (uint k = 0; k < this->sample.size(); k++) {
+	    uint i    = this->sample[k];
+	    int  best = -1;
+	    int  d;
+
+	    if (segs == 0) {
+		for (uint b = 0; b < n; b++) {
+		    uint j = this->members[b];
+		    if (j == i) continue;
+		    compared++;
+		    if ((d = this->seqs.dist(i, j, max_dist)) < 0) continue;
+		    local[d]++;
+		    if (best < 0 || d < best) best = d;
+		}
+	    }
+
+	    for (uint s = 0; s < segs; s++) {
+		vector<pair<uint64_t, uint> > &bucket = this->buckets[s];
+		uint64_t h = this->idx.hash(i, s);
+
+		//
+		// A pair sharing several segments is only compared at the first of them.
+		//
+		for (uint a = lower_bound(bucket.begin(), bucket.end(), make_pair(h, 0U)) - bucket.begin();
+		     a < bucket.size() && bucket[a].first == h; a++) {
+		    uint j = bucket[a].second;
+		    if (j == i) continue;
+		    uint t = 0;
+		    while (t < s && this->idx.hash(i, t) != this->idx.hash(j, t)) t++;
+		    if (t < s) continue;
+
+		    compared++;
+		    if ((d = this->seqs.dist(i, j, max_dist)) < 0) continue;
+		    local[d]++;
+		    if (best < 0 || d < best) best = d;
+		}
+	    }
+
+	    this->nearest[k] = best;
+	}
+
+	#pragma omp critical
+	{
+	    for (int d = 0; d <= max_dist; d++)
+		this->pairs[d] += local[d];
+	    this->candidates += compared;
+	}
+    }
+}
+
+//
+// Estimate the recall of an approximate search by comparing an evenly spaced sample
+// of member sequences against all others, and measuring the fraction of their edges
+// that were found. Returns -1 if the sample holds no edges.
+//
+double
+sample_recall(PackedSeqs &seqs, vector<uint> &members, int max_dist, vector<Edge> &edges, uint sample)
+{
+    uint n    = members.size();
+    uint step = n > sample ? n / sample : 1;
+    uint found = 0, total = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:found,total)
+    for (uint a = 0; a < n; a += step) {
+	uint i = members[a];
+	for (uint b = 0; b < n; b++) {
+	    uint j = members[b];
+	    if (b == a || seqs.dist(i, j, max_dist) < 0)
+		continue;
+	    total++;
+	    if (binary_search(edges.begin(), edges.end(), i < j ? make_pair(i, j) : make_pair(j, i)))
+		found++;
+	}
+    }
+
+    return total > 0 ? (double) found / total : -1.0;
+}
+
+//
+// Bring the edges of a previously indexed catalog up to date with the current
+// catalog. Edges between sequences that are unchanged are carried over from the
+// previous state; only sequences that are new or whose consensus changed are
+// compared, against the whole catalog. Returns the number of such sequences.
+//
+int
+update_edges(PackedSeqs &prev, ClusterState &prev_state, PackedSeqs &seqs, SeedIndex &idx, 
+	     int max_dist, bool vptree, vector<Edge> &edges)
+{
+    vector<int>  moved(prev.size(), -1);
+    vector<bool> fresh(seqs.size(), true);
+    vector<uint> members;
+    uint n_fresh = 0;
+
+    for (uint i = 0; i < seqs.size(); i++) {
+	int j = prev.index(seqs.ids[i]);
+
+	if (j >= 0 && seqs.same(i, prev, j)) {
+	    moved[j] = i;
+	    fresh[i] = false;
+	} else {
+	    n_fresh++;
+	}
+    }
+
+    for (uint e = 0; e < prev_state.n_edges; e++) {
+	int a = moved[prev_state.edges[2 * e]];
+	int b = moved[prev_state.edges[2 * e + 1]];
+	if (a >= 0 && b >= 0)
+	    edges.push_back(make_pair((uint) a, (uint) b));
+    }
+
+    if (n_fresh > 0) {
+	for (uint i = 0; i < seqs.size(); i++)
+	    members.push_back(i);
+
+	vector<Edge> found;
+	if (vptree)
+	    find_edges_vptree(seqs, members, max_dist, 0, 1, found, &fresh);
+	else if (idx.segs > 0)
+	    find_edges(seqs, idx, members, max_dist, 0, 1, found, &fresh);
+	else
+	    find_edges_allpairs(seqs, members, max_dist, 0, 1, found, &fresh);
+	edges.insert(edges.end(), found.begin(), found.end());
+    }
+
+    sort(edges.begin(), edges.end());
+
+    return n_fresh;
+}
+
+ClusterState::ClusterState()
+{
+    this->n       = 0;
+    this->n_edges = 0;
+    this->edges   = NULL;
+    this->comp    = NULL;
+    this->built   = false;
+    this->owned   = false;
+}
+
+void
+ClusterState::clear()
+{
+    if (this->owned) {
+	delete [] this->edges;
+	delete [] this->comp;
+    }
+    this->n       = 0;
+    this->n_edges = 0;
+    this->edges   = NULL;
+    this->comp    = NULL;
+    this->built   = false;
+    this->owned   = false;
+}
+
+//
+// Exchange two clustering states, along with the ownership of their arrays.
+//
+void
+ClusterState::swap(ClusterState &other)
+{
+    std::swap(this->n,       other.n);
+    std::swap(this->n_edges, other.n_edges);
+    std::swap(this->edges,   other.edges);
+    std::swap(this->comp,    other.comp);
+    std::swap(this->built,   other.built);
+    std::swap(this->owned,   other.owned);
+}
+
+//
+// Record the edges among n sequences and join them into clusters.
+//
+int
+ClusterState::build(uint n, vector<Edge> &edges)
+{
+    UnionFind sets(n);
+
+    this->clear();
+    this->n       = n;
+    this->n_edges = edges.size();
+    this->edges   = new uint32_t[2 * this->n_edges];
+    this->comp    = new uint32_t[n];
+    this->built   = true;
+    this->owned   = true;
+
+    for (uint e = 0; e < this->n_edges; e++) {
+	this->edges[2 * e]     = edges[e].first;
+	this->edges[2 * e + 1] = edges[e].second;
+	sets.unite(edges[e].first, edges[e].second);
+    }
+    for (uint i = 0; i < n; i++)
+	this->comp[i] = sets.find(i);
+
+    return this->n_edges;
+}
+
+//
+// Number of clusters holding more than one sequence.
+//
+uint
+ClusterState::clusters()
+{
+    vector<uint> size(this->n, 0);
+    uint cnt = 0;
+
+    for (uint i = 0; i < this->n; i++)
+	if (++size[this->comp[i]] == 2)
+	    cnt++;
+
+    return cnt;
+}
+
+//
+// Layout of a seed index file; every section starts on an eight byte boundary:
+//   header, ids[n], lens[n], exotic[n], codes[n * stride], nmask[n * stride],
+//   bounds[segs + 1], hashes[n * segs], edges[2 * n_edges], comp[n]
+//
+const char seed_index_magic[8] = {'P', 'M', 'S', 'I', 'D', 'X', '0', '2'};
+
+struct SeedIndexHeader {
+    char     magic[8];
+    uint64_t stamp;
+    uint32_t n;
+    uint32_t stride;
+    uint32_t min_len;
+    uint32_t segs;
+    int32_t  max_dist;
+    uint32_t n_edges;
+};
+
+static inline size_t
+aligned(size_t bytes)
+{
+    return (bytes + 7) & ~((size_t) 7);
+}
+
+int
+SeedIndexFile::write(string path, uint64_t stamp, PackedSeqs &seqs, SeedIndex &idx, ClusterState &state)
+{
+    SeedIndexHeader h;
+    char   zeros[8] = {0};
+    size_t words    = (size_t) seqs.n * seqs.stride;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, seed_index_magic, 8);
+    h.stamp    = stamp;
+    h.n        = seqs.n;
+    h.stride   = seqs.stride;
+    h.min_len  = seqs.min_len;
+    h.segs     = idx.segs;
+    h.max_dist = idx.max_dist;
+    h.n_edges  = state.n_edges;
+
+    //
+    // Write to a temporary file and rename it, so that concurrent runs never map a
+    // partially written index.
+    //
+    char pid[32];
+    sprintf(pid, ".%d.tmp", (int) getpid());
+    string tmp = path + pid;
+    ofstream fh(tmp.c_str(), ofstream::out | ofstream::binary);
+    if (fh.fail()) {
+	cerr << "Error opening seed index '" << tmp << "'\n";
+	return 0;
+    }
+
+    fh.write((const char *) &h, sizeof(h));
+    fh.write((const char *) seqs.ids, seqs.n * sizeof(int));
+    fh.write(zeros, aligned(seqs.n * sizeof(int)) - seqs.n * sizeof(int));
+    fh.write((const char *) seqs.lens, seqs.n * sizeof(uint16_t));
+    fh.write(zeros, aligned(seqs.n * sizeof(uint16_t)) - seqs.n * sizeof(uint16_t));
+    fh.write((const char *) seqs.exotic, seqs.n);
+    fh.write(zeros, aligned(seqs.n) - seqs.n);
+    fh.write((const char *) seqs.codes, words * sizeof(uint64_t));
+    fh.write((const char *) seqs.nmask, words * sizeof(uint64_t));
+    if (idx.segs > 0) {
+	fh.write((const char *) idx.bounds, (idx.segs + 1) * sizeof(uint));
+	fh.write(zeros, aligned((idx.segs + 1) * sizeof(uint)) - (idx.segs + 1) * sizeof(uint));
+	fh.write((const char *) idx.hashes, (size_t) seqs.n * idx.segs * sizeof(uint64_t));
+    }
+    fh.write((const char *) state.edges, (size_t) 2 * state.n_edges * sizeof(uint32_t));
+    fh.write(zeros, aligned((size_t) 2 * state.n_edges * sizeof(uint32_t)) - (size_t) 2 * state.n_edges * sizeof(uint32_t));
+    fh.write((const char *) state.comp, (size_t) seqs.n * sizeof(uint32_t));
+    fh.close();
+
+    if (fh.fail() || rename(tmp.c_str(), path.c_str()) != 0) {
+	cerr << "Error writing seed index '" << path << "'\n";
+	remove(tmp.c_str());
+	return 0;
+    }
+
+    return 1;
+}
+
+//
+// Map a seed index file and point the packed sequences, seed index and cluster state
+// into it. Returns 0 if the file does not exist or is not a valid index; the stamp of
+// the catalog it was built from is left in stamp.
+//
+int
+SeedIndexFile::open(string path, PackedSeqs &seqs, SeedIndex &idx, ClusterState &state)
+{
+    struct stat sb;
+    int fd;
+
+    this->close();
+
+    if ((fd = ::open(path.c_str(), O_RDONLY)) < 0)
+	return 0;
+    if (fstat(fd, &sb) != 0 || (size_t) sb.st_size < sizeof(SeedIndexHeader)) {
+	::close(fd);
+	return 0;
+    }
+
+    this->len  = sb.st_size;
+    this->addr = mmap(NULL, this->len, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (this->addr == MAP_FAILED) {
+	this->addr = NULL;
+	return 0;
+    }
+
+    SeedIndexHeader *h = (SeedIndexHeader *) this->addr;
+    size_t words = (size_t) h->n * h->stride;
+    size_t size  = sizeof(SeedIndexHeader) + aligned(h->n * sizeof(int)) + aligned(h->n * sizeof(uint16_t)) + 
+	aligned(h->n) + 2 * words * sizeof(uint64_t);
+    if (h->segs > 0)
+	size += aligned((h->segs + 1) * sizeof(uint)) + (size_t) h->n * h->segs * sizeof(uint64_t);
+    size += aligned((size_t) 2 * h->n_edges * sizeof(uint32_t)) + (size_t) h->n * sizeof(uint32_t);
+
+    if (memcmp(h->magic, seed_index_magic, 8) != 0 || size != this->len) {
+	this->close();
+	return 0;
+    }
+
+    char *p = (char *) this->addr + sizeof(SeedIndexHeader);
+
+    seqs.clear();
+    seqs.n       = h->n;
+    seqs.stride  = h->stride;
+    seqs.min_len = h->min_len;
+    seqs.ids     = (int *) p;      p += aligned(h->n * sizeof(int));
+    seqs.lens    = (uint16_t *) p; p += aligned(h->n * sizeof(uint16_t));
+    seqs.exotic  = (uint8_t *) p;  p += aligned(h->n);
+    seqs.codes   = (uint64_t *) p; p += words * sizeof(uint64_t);
+    seqs.nmask   = (uint64_t *) p; p += words * sizeof(uint64_t);
+    seqs.cons.assign(h->n, (const char *) NULL);
+    seqs.composition();
+
+    idx.clear();
+    idx.n        = h->n;
+    idx.segs     = h->segs;
+    idx.max_dist = h->max_dist;
+    if (h->segs > 0) {
+	idx.bounds = (uint *) p;   p += aligned((h->segs + 1) * sizeof(uint));
+	idx.hashes = (uint64_t *) p; p += (size_t) h->n * h->segs * sizeof(uint64_t);
+    }
+
+    state.clear();
+    state.n       = h->n;
+    state.n_edges = h->n_edges;
+    state.edges   = (uint32_t *) p; p += aligned((size_t) 2 * h->n_edges * sizeof(uint32_t));
+    state.comp    = (uint32_t *) p;
+    state.built   = true;
+
+    this->stamp = h->stamp;
+
+    return 1;
+}
+
+void
+SeedIndexFile::close()
+{
+    if (this->addr != NULL)
+	munmap(this->addr, this->len);
+    this->addr = NULL;
+    this->len  = 0;
+}
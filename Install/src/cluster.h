@@ -0,0 +1,277 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <stdint.h>
+#include <string>
+using std::string;
+#include <vector>
+using std::vector;
+#include <map>
+using std::map;
+#include <utility>
+using std::pair;
+using std::make_pair;
+
+#include "locus.h"
+
+typedef pair<uint, uint> Edge;
+
+class PairsCheckpoint;
+
+//
+// Consensus sequences of the loci being clustered, packed two bits per nucleotide.
+// Anything other than A, C, G or T is packed as A and flagged in a parallel mask
+// holding one bit in the low position of each two-bit lane, so that comparing a
+// pair of words yields the mismatching lanes of 32 nucleotides at once. The arrays
+// are either allocated here or mapped from a seed index file.
+//
+class PackedSeqs {
+public:
+    uint                 n;
+    uint                 stride;  // Words per sequence.
+    uint                 min_len;
+    int                 *ids;     // Catalog locus IDs, in catalog order.
+    uint16_t            *lens;
+    uint8_t             *exotic;  // Sequence holds characters other than A, C, G, T or N.
+    uint64_t            *codes;
+    uint64_t            *nmask;
+    vector<const char *> cons;    // Consensus sequences, owned by the catalog.
+    uint                 comp_segs;
+    vector<uint8_t>      comp;    // Counts of A, C, G, T and N in each segment of each sequence.
+    bool                 owned;
+
+    PackedSeqs();
+    ~PackedSeqs() { this->clear(); }
+
+    int  build(map<int, PLocus *> &);
+    int  permute(PackedSeqs &, vector<uint> &);
+    void clear();
+    uint size()  { return this->n; }
+    int  index(int);
+    bool same(uint, PackedSeqs &, uint);
+    void composition();
+    int  dist(uint, PackedSeqs &, uint, int);
+    int  dist(uint i, uint j, int limit) { return this->dist(i, *this, j, limit); }
+    uint64_t lanes(uint, uint, uint, uint64_t &);
+    void swap(PackedSeqs &);
+
+private:
+    PackedSeqs(const PackedSeqs &);
+    PackedSeqs &operator=(const PackedSeqs &);
+};
+
+//
+// Pigeonhole seed index. The common prefix [0, min_len) of all sequences is split
+// into max_dist + 1 segments; two sequences within max_dist mismatches must agree
+// exactly on at least one segment, so only sequences sharing a segment hash need
+// to be compared. No segments are built if the sequences are too short.
+//
+class SeedIndex {
+public:
+    int       max_dist;
+    uint      n;
+    uint      segs;
+    uint     *bounds;  // segs + 1 segment boundaries.
+    uint64_t *hashes;  // segs hashes per sequence.
+    bool      owned;
+
+    SeedIndex();
+    ~SeedIndex() { this->clear(); }
+
+    int      build(PackedSeqs &, int);
+    void     clear();
+    uint64_t hash(uint seq, uint seg) { return this->hashes[(size_t) seq * this->segs + seg]; }
+
+private:
+    SeedIndex(const SeedIndex &);
+    SeedIndex &operator=(const SeedIndex &);
+};
+
+//
+// Disjoint sets of sequence indexes. The root of each set is its smallest member.
+//
+class UnionFind {
+    vector<uint> parent;
+
+public:
+    UnionFind(uint n) : parent(n) {
+	for (uint i = 0; i < n; i++) this->parent[i] = i;
+    }
+    uint find(uint i) {
+	while (this->parent[i] != i) {
+	    this->parent[i] = this->parent[this->parent[i]];
+	    i = this->parent[i];
+	}
+	return i;
+    }
+    bool unite(uint a, uint b) {
+	a = this->find(a);
+	b = this->find(b);
+	if (a == b) return false;
+	if (a < b)
+	    this->parent[b] = a;
+	else
+	    this->parent[a] = b;
+	return true;
+    }
+};
+
+//
+// Clustering state of an indexed catalog: every pair of sequences within max_dist of
+// one another, and the single-linkage cluster of each sequence, identified by the
+// smallest sequence index in the cluster.
+//
+class ClusterState {
+public:
+    uint      n;
+    uint      n_edges;
+    uint32_t *edges;  // n_edges sorted pairs of sequence indexes.
+    uint32_t *comp;
+    bool      built;
+    bool      owned;
+
+    ClusterState();
+    ~ClusterState() { this->clear(); }
+
+    int  build(uint, vector<Edge> &);
+    void clear();
+    uint clusters();
+    void swap(ClusterState &);
+
+private:
+    ClusterState(const ClusterState &);
+    ClusterState &operator=(const ClusterState &);
+};
+
+//
+// Seed index file: the packed sequences, seed hashes and cluster state of a catalog,
+// laid out in aligned sections so that the file can be memory mapped and used in
+// place. The stamp identifies the catalog the index was built from.
+//
+class SeedIndexFile {
+    void  *addr;
+    size_t len;
+
+public:
+    uint64_t stamp;
+
+    SeedIndexFile() { this->addr = NULL; this->len = 0; this->stamp = 0; }
+    ~SeedIndexFile() { this->close(); }
+
+    int  open(string, PackedSeqs &, SeedIndex &, ClusterState &);
+    void close();
+    static int write(string, uint64_t, PackedSeqs &, SeedIndex &, ClusterState &);
+};
+
+//
+// Vantage-point tree over packed sequences. The distance between two consensus
+// sequences is the Hamming distance between them padded to equal length, and so
+// a metric. Each node splits its sequences about a vantage sequence: the inner
+// subtree holds those within mu of it, the outer subtree those at mu or beyond,
+// and range queries skip any subtree the triangle inequality rules out. Leaves
+// hold up to vp_leaf sequences, and are split as sequences are inserted.
+//
+class VpNode {
+public:
+    uint          vp;
+    int           mu;
+    VpNode       *inner;
+    VpNode       *outer;
+    vector<uint>  items;  // Sequences held by a leaf.
+
+    VpNode() { this->vp = 0; this->mu = 0; this->inner = NULL; this->outer = NULL; }
+    ~VpNode() { delete this->inner; delete this->outer; }
+
+    bool leaf() { return this->inner == NULL; }
+};
+
+class VpTree {
+    PackedSeqs &seqs;
+    VpNode     *root;
+    uint        n;
+
+    VpNode *build(uint *, uint);
+
+public:
+    VpTree(PackedSeqs &seqs) : seqs(seqs) { this->root = NULL; this->n = 0; }
+    ~VpTree() { delete this->root; }
+
+    uint size() { return this->n; }
+    void build(vector<uint> &);
+    void insert(uint);
+    int  range(PackedSeqs &, uint, int, vector<uint> &);
+};
+
+//
+// Parameters of the approximate candidate search. The consensus k-mers of each
+// sequence are MinHashed rows * bands times, and sequences agreeing on every row of
+// a band become candidates. The number of bands is chosen for a target recall of
+// pairs at the cluster distance; recall is the recall expected under the model.
+//
+class LshParams {
+public:
+    uint   k;
+    uint   rows;
+    uint   bands;
+    double recall;
+
+    LshParams() { this->k = 0; this->rows = 0; this->bands = 0; this->recall = 0.0; }
+
+    int choose(uint, int, uint, double, uint);
+};
+
+//
+// Seeded search for the neighbours of a sample of the member sequences. Only members
+// sharing a seed hash with a sampled sequence are bucketed, so the search costs one
+// pass over the seed hashes plus the comparisons of the sample itself. Without seed
+// segments each sampled sequence is compared with every member.
+//
+class SampleSearch {
+    PackedSeqs   &seqs;
+    SeedIndex    &idx;
+    vector<uint> &members;
+    vector<uint> &sample;
+    vector<vector<pair<uint64_t, uint> > > buckets;  // Sorted (hash, sequence) pairs of each segment.
+
+public:
+    vector<int>      nearest;     // Distance of each sampled sequence to its nearest neighbour, -1 if none.
+    vector<uint64_t> pairs;       // Pairs of a sampled sequence and a member, by distance.
+    uint64_t         candidates;  // Members compared with a sampled sequence.
+
+    SampleSearch(PackedSeqs &seqs, SeedIndex &idx, vector<uint> &members, vector<uint> &sample) 
+	: seqs(seqs), idx(idx), members(members), sample(sample) { this->candidates = 0; }
+
+    void bucket();
+    void search(int);
+};
+
+void sample_members(vector<uint> &, uint, vector<uint> &);
+int similarity_order(PackedSeqs &, vector<uint> &, vector<uint> &);
+int find_edges(PackedSeqs &, SeedIndex &, vector<uint> &, int, uint, uint, vector<Edge> &, vector<bool> * = NULL);
+int find_edges_vptree(PackedSeqs &, vector<uint> &, int, uint, uint, vector<Edge> &, vector<bool> * = NULL);
+int find_edges_lsh(PackedSeqs &, vector<uint> &, int, LshParams &, uint, uint, vector<Edge> &);
+double sample_recall(PackedSeqs &, vector<uint> &, int, vector<Edge> &, uint);
+int find_edges_allpairs(PackedSeqs &, vector<uint> &, int, uint, uint, vector<Edge> &, vector<bool> * = NULL, PairsCheckpoint * = NULL);
+int update_edges(PackedSeqs &, ClusterState &, PackedSeqs &, SeedIndex &, int, bool, vector<Edge> &);
+
+#endif // __CLUSTER_H__
@@ -0,0 +1,1228 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+//
+// libpmerge -- the filtering and clustering stages of pmerge, run from the command
+// line or on catalog, match and population data held in memory
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sstream>
+using std::stringstream;
+#include <algorithm>
+using std::sort;
+
+#include "libpmerge.h"
+#include "catalog_utils.h"
+#include "utils.h"
+
+//
+// Record the components of Fst computed by PopSum; never set by pmerge.
+//
+bool log_fst_comp = false;
+
+void
+PopLayout::build(map<int, pair<int, int> > &pop_indexes)
+{
+    map<int, pair<int, int> >::iterator pit;
+    int samples = 0;
+
+    this->pop_ids.clear();
+    this->start.clear();
+    this->end.clear();
+
+    for (pit = pop_indexes.begin(); pit != pop_indexes.end(); pit++) {
+	this->pop_ids.push_back(pit->first);
+	this->start.push_back(pit->second.first);
+	this->end.push_back(pit->second.second);
+	if (pit->second.second + 1 > samples)
+	    samples = pit->second.second + 1;
+    }
+
+    this->words = (samples + 63) / 64;
+    this->members.assign(this->pop_ids.size(), vector<uint64_t>(this->words > 0 ? this->words : 1, 0));
+
+    for (uint p = 0; p < this->pop_ids.size(); p++)
+	for (int i = this->start[p]; i <= this->end[p]; i++)
+	    this->members[p][i >> 6] |= 1ULL << (i & 63);
+}
+
+static bool
+compare_pop_map(pair<int, string> a, pair<int, string> b)
+{
+    if (a.first == b.first)
+	return (a.second < b.second);
+    return (a.first < b.first);
+}
+
+//
+// Sort the samples, paired with their population IDs, by population and record the
+// range of sample indexes each population occupies. Returns the number of populations.
+//
+int
+index_populations(vector<pair<int, string> > &files, map<int, pair<int, int> > &pop_indexes)
+{
+    if (files.size() == 0)
+	return 0;
+
+    sort(files.begin(), files.end(), compare_pop_map);
+
+    int start  = 0;
+    int end    = 0;
+    int pop_id = files[0].first;
+
+    do {
+	end++;
+	if (end == (int) files.size() || pop_id != files[end].first) {
+	    pop_indexes[pop_id] = make_pair(start, end - 1);
+	    start  = end;
+	    if (end < (int) files.size())
+		pop_id = files[end].first;
+	}
+    } while (end < (int) files.size());
+
+    return pop_indexes.size();
+}
+
+//
+// This case is generated by an existing, but empty file. Remove this sample from
+// the population index which was built from existing files, but we couldn't yet
+// check for empty files. The index i counts only the samples not already excluded,
+// as the population ranges have shifted down past each of them.
+//
+int
+exclude_sample(int i, map<int, pair<int, int> > &pop_indexes, PopLayout &layout)
+{
+    map<int, pair<int, int> >::iterator pit;
+
+    for (pit = pop_indexes.begin(); pit != pop_indexes.end(); pit++)
+	if (i >= pit->second.first && i <= pit->second.second) {
+	    pit->second.second--;
+	    pit++;
+	    while (pit != pop_indexes.end()) {
+		pit->second.first--;
+		pit->second.second--;
+		pit++;
+	    }
+	    break;
+	}
+
+    layout.build(pop_indexes);
+
+    return 0;
+}
+
+bool 
+order_unordered_loci(map<int, PLocus *> &catalog) 
+{
+    map<int, PLocus *>::iterator it;
+    PLocus *loc;
+    set<string> chrs;
+
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	loc = it->second;
+	if (strlen(loc->loc.chr) > 0) 
+	    chrs.insert(loc->loc.chr);
+    }
+
+    //
+    // This data is already reference aligned.
+    //
+    if (chrs.size() > 0)
+	return true;
+
+    cerr << "Catalog is not reference aligned, arbitrarily ordering catalog loci.\n";
+
+    uint bp = 1;
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	loc = it->second;
+	loc->loc.chr = "un";
+	loc->loc.bp  = bp;
+
+	bp += loc->len;
+    }
+
+    return false;
+}
+
+FilterLog::FilterLog(map<int, pair<int, int> > &pop_indexes, string dir)
+{
+    map<int, pair<int, int> >::iterator pit;
+    stringstream path;
+
+    this->dir  = dir;
+    this->keep = false;
+
+    for (pit = pop_indexes.begin(); pit != pop_indexes.end(); pit++) {
+	this->incompatible[pit->first] = 0;
+
+	if (dir.length() == 0) {
+	    this->pop_log[pit->first] = new stringstream;
+	    continue;
+	}
+	path.str("");
+	path << dir << "/incompatible_" << pit->first << ".log";
+	this->pop_paths[pit->first] = path.str();
+	this->pop_log[pit->first]   = new ofstream(path.str().c_str(), ofstream::out);
+	if (this->pop_log[pit->first]->fail()) {
+	    cerr << "Error opening spill file '" << path.str() << "'\n";
+	    exit(1);
+	}
+    }
+
+    if (dir.length() == 0) {
+	this->prune_log  = new stringstream;
+    } else {
+	this->prune_path = dir + "/pruned.log";
+	this->prune_log  = new ofstream(this->prune_path.c_str(), ofstream::out);
+	if (this->prune_log->fail()) {
+	    cerr << "Error opening spill file '" << this->prune_path << "'\n";
+	    exit(1);
+	}
+    }
+}
+
+FilterLog::~FilterLog()
+{
+    map<int, ostream *>::iterator it;
+
+    for (it = this->pop_log.begin(); it != this->pop_log.end(); it++) {
+	delete it->second;
+	if (this->dir.length() > 0 && this->keep == false)
+	    remove(this->pop_paths[it->first].c_str());
+    }
+    delete this->prune_log;
+    if (this->dir.length() > 0 && this->keep == false)
+	remove(this->prune_path.c_str());
+}
+
+//
+// Save the tallies of a shard next to its log sections, to be absorbed by a merge run:
+//   <tally><tab><value>, or incompatible<tab><pop ID><tab><value>
+//
+int
+FilterLog::save()
+{
+    map<int, ostream *>::iterator it;
+    string path = this->dir + "/filter.tsv";
+
+    ofstream fh(path.c_str(), ofstream::out);
+    if (fh.fail()) {
+	cerr << "Error opening shard tallies '" << path << "'\n";
+	exit(1);
+    }
+    fh << "applied\t"             << this->applied             << "\n"
+       << "below_stack_dep\t"     << this->below_stack_dep     << "\n"
+       << "below_lnl_thresh\t"    << this->below_lnl_thresh    << "\n"
+       << "constraint_removed\t"  << this->constraint_removed  << "\n"
+       << "constraint_retained\t" << this->constraint_retained << "\n"
+       << "pruned_snps\t"         << this->pruned_snps         << "\n"
+       << "pruned_loci\t"         << this->pruned_loci         << "\n"
+       << "het_excess\t"          << this->het_excess          << "\n"
+       << "fst_screened\t"        << this->fst_screened        << "\n"
+       << "retained\t"            << this->retained            << "\n";
+    for (it = this->pop_log.begin(); it != this->pop_log.end(); it++)
+	fh << "incompatible\t" << it->first << "\t" << this->incompatible[it->first] << "\n";
+    fh.close();
+
+    for (it = this->pop_log.begin(); it != this->pop_log.end(); it++)
+	((ofstream *) it->second)->close();
+    ((ofstream *) this->prune_log)->close();
+    this->keep = true;
+
+    return 0;
+}
+
+//
+// Add the tallies and log sections saved by a shard.
+//
+int
+FilterLog::absorb(string shard_dir)
+{
+    map<int, ostream *>::iterator it;
+    vector<string> parts;
+    char   line[max_len];
+    string path = shard_dir + "/filter.tsv";
+
+    ifstream fh(path.c_str(), ifstream::in);
+    if (fh.fail()) {
+	cerr << "Error opening shard tallies '" << path << "'\n";
+	exit(1);
+    }
+    while (fh.getline(line, max_len)) {
+	parse_tsv(line, parts);
+
+	if (parts[0] == "applied")
+	    this->applied = this->applied || atoi(parts[1].c_str());
+	else if (parts[0] == "below_stack_dep")
+	    this->below_stack_dep += atoi(parts[1].c_str());
+	else if (parts[0] == "below_lnl_thresh")
+	    this->below_lnl_thresh += atoi(parts[1].c_str());
+	else if (parts[0] == "constraint_removed")
+	    this->constraint_removed += atoi(parts[1].c_str());
+	else if (parts[0] == "constraint_retained")
+	    this->constraint_retained += atoi(parts[1].c_str());
+	else if (parts[0] == "pruned_snps")
+	    this->pruned_snps += atoi(parts[1].c_str());
+	else if (parts[0] == "pruned_loci")
+	    this->pruned_loci += atoi(parts[1].c_str());
+	else if (parts[0] == "het_excess")
+	    this->het_excess += atoi(parts[1].c_str());
+	else if (parts[0] == "fst_screened")
+	    this->fst_screened += atoi(parts[1].c_str());
+	else if (parts[0] == "retained")
+	    this->retained += atoi(parts[1].c_str());
+	else if (parts[0] == "incompatible" && parts.size() == 3)
+	    this->incompatible[atoi(parts[1].c_str())] += atoi(parts[2].c_str());
+    }
+    fh.close();
+
+    stringstream sec;
+    for (it = this->pop_log.begin(); it != this->pop_log.end(); it++) {
+	sec.str("");
+	sec << shard_dir << "/incompatible_" << it->first << ".log";
+	ifstream sfh(sec.str().c_str(), ifstream::in);
+	if (sfh.good() && sfh.peek() != EOF)
+	    *it->second << sfh.rdbuf();
+    }
+    ifstream pfh((shard_dir + "/pruned.log").c_str(), ifstream::in);
+    if (pfh.good() && pfh.peek() != EOF)
+	*this->prune_log << pfh.rdbuf();
+
+    return 0;
+}
+
+//
+// Remove the files of a filtering shard once they have been merged.
+//
+int
+FilterLog::remove_shard(string shard_dir)
+{
+    map<int, ostream *>::iterator it;
+    stringstream sec;
+
+    for (it = this->pop_log.begin(); it != this->pop_log.end(); it++) {
+	sec.str("");
+	sec << shard_dir << "/incompatible_" << it->first << ".log";
+	remove(sec.str().c_str());
+    }
+    remove((shard_dir + "/pruned.log").c_str());
+    remove((shard_dir + "/filter.tsv").c_str());
+    remove((shard_dir + "/WL").c_str());
+    remove((shard_dir + "/retained").c_str());
+    remove((shard_dir + "/pmerge.log").c_str());
+    rmdir(shard_dir.c_str());
+
+    return 0;
+}
+
+//
+// Copy a collected section of the log into the log file.
+//
+static void
+copy_section(ostream *section, string path, ostream &log_fh)
+{
+    if (path.length() == 0) {
+	log_fh << ((stringstream *) section)->str();
+	return;
+    }
+
+    ((ofstream *) section)->close();
+    ifstream fh(path.c_str(), ifstream::in);
+    if (fh.peek() != EOF)
+	log_fh << fh.rdbuf();
+    fh.close();
+}
+
+int
+FilterLog::write(ostream &log_fh, PmergeConfig &config)
+{
+    map<int, ostream *>::iterator it;
+
+    log_fh << "# Distribution of population loci after applying locus constraints.\n";
+
+    for (it = this->pop_log.begin(); it != this->pop_log.end(); it++) {
+	if (config.verbose)
+	    log_fh << "\n#\n# Recording sites that have incompatible loci -- loci with too many alleles present.\n"
+		   << "#\n"
+		   << "# Level\tAction\tLocus ID\tChr\tBP\tColumn\tPopID\n#\n";
+	copy_section(it->second, this->dir.length() > 0 ? this->pop_paths[it->first] : "", log_fh);
+	log_fh <<  "Population " << it->first << " contained " << this->incompatible[it->first] << " incompatible loci -- more than two alleles present.\n";
+    }
+
+    log_fh << "\n#\n# List of pruned nucleotide sites\n#\n"
+	   << "# Action\tLocus ID\tChr\tBP\tColumn\tReason\n";
+    copy_section(this->prune_log, this->prune_path, log_fh);
+
+    if (config.het_excess_limit > 0.0)
+	log_fh << "Removed " << this->het_excess << " loci with an excess of heterozygotes above " << config.het_excess_limit << ".\n";
+    if (config.fst_screen_p > 0.0)
+	log_fh << "Removed " << this->fst_screened << " loci with significant differentiation between populations (Fst screen, p < " 
+	       << config.fst_screen_p << ").\n";
+
+    return 0;
+}
+
+//
+// Filter a set of catalog loci: apply the sample/population constraints, summarize
+// each population and prune variant sites. The loci that did not survive are removed
+// from the catalog; returns the number of loci retained.
+//
+int
+FilterStage::run(map<int, PLocus *> &catalog, vector<int> &sample_ids,
+		 vector<vector<CatMatch *> > &catalog_matches, ModelSource &models,
+		 FilterLog &flog, ostream &wl_fh)
+{
+    map<int, PLocus *>::iterator it;
+    PLocus *loc;
+
+    //
+    // Create the population map
+    // 
+    cerr << "Populating observed haplotypes for " << sample_ids.size() << " samples, " << catalog.size() << " loci.\n";
+    PopMap<PLocus> *pmap = new PopMap<PLocus>(sample_ids.size(), catalog.size());
+    pmap->populate(sample_ids, catalog, catalog_matches);
+
+    if (this->apply_locus_constraints(catalog, pmap, flog) == 0) {
+	delete pmap;
+	return 0;
+    }
+
+    cerr << "Loading model outputs for " << sample_ids.size() << " samples, " << catalog.size() << " loci.\n";
+    map<int, ModRes *>::iterator mit;
+    Datum   *d;
+
+    //
+    // Load the output from the SNP calling model for each individual at each locus. This
+    // model output string looks like this:
+    //   OOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOEOOOOOOEOOOOOOOOOOOOOOOOOOOOOOOOOOOOOUOOOOUOOOOOO
+    // and records model calls for each nucleotide: O (hOmozygous), E (hEterozygous), U (Unknown)
+    //
+    for (uint i = 0; i < sample_ids.size(); i++) {
+    	map<int, ModRes *> modres;
+
+    	if (models.load(i, modres) == 0) {
+	    models.report_missing(i);
+	    for (mit = modres.begin(); mit != modres.end(); mit++)
+		delete mit->second;
+    	    continue;
+    	}
+
+    	for (it = catalog.begin(); it != catalog.end(); it++) {
+    	    loc = it->second;
+    	    d = pmap->datum(loc->id, sample_ids[i]);
+
+    	    if (d != NULL) {
+		if (modres.count(d->id) == 0) {
+		    cerr << "Fatal error: Unable to find model data for catalog locus " << loc->id 
+			 << ", sample ID " << sample_ids[i] << ", sample locus " << d->id 
+			 << "; likely IDs were mismatched when running pipeline.\n";
+		    exit(0);
+		}
+		d->len = strlen(modres[d->id]->model);
+		d->model.assign(modres[d->id]->model);
+    	    }
+    	}
+
+    	for (mit = modres.begin(); mit != modres.end(); mit++)
+    	    delete mit->second;
+    	modres.clear();
+    }
+
+    //
+    // Pack the haplotypes and model calls of each locus into a genotype matrix.
+    //
+    pmap->index_genotypes(catalog);
+
+    PopSum<PLocus> *psum = new PopSum<PLocus>(pmap->loci_cnt(), this->layout.pop_cnt());
+    psum->initialize(pmap);
+    
+    for (uint p = 0; p < this->layout.pop_cnt(); p++) {
+    	int pop_id = this->layout.pop_ids[p];
+    	cerr << "Generating nucleotide-level summary statistics for population '" << this->pop_names[pop_id] << "'\n";
+    	flog.incompatible[pop_id] += psum->add_population(catalog, pmap, pop_id, this->pop_names[pop_id], 
+							  this->layout.start[p], this->layout.end[p], *flog.pop_log[pop_id]);
+    }
+
+    cerr << "Tallying loci across populations...";
+    psum->tally(catalog);
+    cerr << "done.\n";
+
+    //
+    // We have removed loci that were below the -r and -p thresholds. Now we need to
+    // identify individual SNPs that are below the -r threshold or the minor allele
+    // frequency threshold (-a). In these cases we will remove the SNP, but keep the locus.
+    //
+    set<int> blacklist;
+    int      het_removed = this->het_excess_filter(catalog, psum, blacklist, *flog.prune_log);
+    int      screened    = 0;
+
+    if (this->config.het_excess_limit > 0.0)
+	cerr << "Removing " << het_removed << " loci with an excess of heterozygotes.\n";
+
+    if (this->config.fst_screen_p > 0.0) {
+	screened = this->fst_screen(catalog, psum, blacklist, *flog.prune_log);
+	cerr << "Screened out " << screened << " loci with significant differentiation between populations.\n";
+    }
+
+    int pruned_snps = this->prune_polymorphic_sites(catalog, pmap, psum, blacklist, *flog.prune_log, wl_fh);
+    cerr << "Pruned " << pruned_snps << " variant sites due to filter constraints.\n";
+
+    cerr << "Removing " << blacklist.size() - het_removed - screened << " additional loci for which all variant sites were filtered...";
+    set<int> empty_list;
+    reduce_catalog(catalog, empty_list, blacklist);
+    reduce_catalog_snps(catalog, this->columns, pmap);
+    int retained = pmap->prune(blacklist);
+    cerr << " retained " << retained << " loci.\n";
+
+    flog.pruned_snps += pruned_snps;
+    flog.pruned_loci  += blacklist.size() - het_removed - screened;
+    flog.het_excess   += het_removed;
+    flog.fst_screened += screened;
+    flog.retained    += retained;
+
+    delete psum;
+    delete pmap;
+
+    return retained;
+}
+
+int
+FilterStage::apply_locus_constraints(map<int, PLocus *> &catalog, PopMap<PLocus> *pmap, FilterLog &flog)
+{
+    PmergeConfig &config = this->config;
+    PopLayout    &layout = this->layout;
+
+    if (config.sample_limit == 0 && config.population_limit == 0 && config.min_stack_depth == 0) return catalog.size();
+
+    map<int, PLocus *>::iterator it;
+
+    uint pop_cnt    = layout.pop_cnt();
+    int  sample_cnt = pmap->sample_cnt();
+
+    //
+    // The PopMap indexes loci through a map, so the sample data of each locus is looked
+    // up here, before the loci are processed in parallel.
+    //
+    vector<PLocus *> loci;
+    vector<Datum **> data;
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	loci.push_back(it->second);
+	data.push_back(pmap->locus(it->first));
+    }
+
+    vector<char> removed(loci.size(), false);
+    int  below_stack_dep  = 0;
+    uint below_lnl_thresh = 0;
+
+    //
+    // The depth, log likelihood and presence of the samples at each locus are gathered
+    // into contiguous arrays, so that the sample thresholds are a vectorized compare
+    // pass. The samples passing them are packed into a bitset, and the samples of each
+    // population counted or removed with the population's bitset.
+    //
+    #pragma omp parallel reduction(+:below_stack_dep,below_lnl_thresh)
+    {
+	vector<int>      depth(sample_cnt);
+	vector<double>   lnl(sample_cnt);
+	vector<uint8_t>  present(sample_cnt), keep(sample_cnt);
+	vector<uint64_t> bits(layout.words > 0 ? layout.words : 1);
+	int      *dp = &depth[0];
+	double   *lp = &lnl[0];
+	uint8_t  *pp = &present[0];
+	uint8_t  *kp = &keep[0];
+	uint64_t *bp = &bits[0];
+	int       msd     = config.min_stack_depth;
+	bool      use_lnl = config.filter_lnl;
+	double    lim     = config.lnl_limit;
+
+	#pragma omp for schedule(dynamic, 64)
+	for (uint l = 0; l < loci.size(); l++) {
+	    PLocus *loc = loci[l];
+	    Datum **d   = data[l];
+	    int below_dep = 0, below_lnl = 0;
+
+	    for (int i = 0; i < sample_cnt; i++) {
+		pp[i] = d[i] != NULL;
+		dp[i] = d[i] != NULL ? d[i]->tot_depth : 0;
+		lp[i] = d[i] != NULL ? d[i]->lnl : 0.0;
+	    }
+
+	    //
+	    // Check that each sample is over the minimum stack depth and the log
+	    // likelihood threshold for this locus.
+	    //
+	    #pragma omp simd reduction(+:below_dep,below_lnl)
+	    for (int i = 0; i < sample_cnt; i++) {
+		uint8_t shallow = pp[i] & (msd > 0 && dp[i] < msd);
+		uint8_t unlikely = pp[i] & !shallow & (use_lnl && lp[i] < lim);
+		below_dep += shallow;
+		below_lnl += unlikely;
+		kp[i] = pp[i] & !shallow & !unlikely;
+	    }
+
+	    for (uint w = 0; w < bits.size(); w++)
+		bp[w] = 0;
+	    for (int i = 0; i < sample_cnt; i++)
+		bp[i >> 6] |= (uint64_t) kp[i] << (i & 63);
+
+	    //
+	    // Check that the counts for each population are over sample_limit. If not, zero out 
+	    // the members of that population, and check that this locus is present in enough
+	    // populations.
+	    //
+	    int pops = 0;
+	    for (uint p = 0; p < pop_cnt; p++) {
+		uint cnt = layout.count(p, bp);
+
+		if (cnt > 0 && (double) cnt / (double) layout.size(p) < config.sample_limit)
+		    layout.clear(p, bp);
+		else if (cnt > 0)
+		    pops++;
+	    }
+
+	    for (int i = 0; i < sample_cnt; i++) {
+		if (pp[i] && (bp[i >> 6] >> (i & 63) & 1) == 0) {
+		    delete d[i];
+		    d[i] = NULL;
+		    loc->hcnt--;
+		}
+	    }
+
+	    if (pops < config.population_limit)
+		removed[l] = true;
+
+	    below_stack_dep  += below_dep;
+	    below_lnl_thresh += below_lnl;
+	}
+    }
+
+    set<int> blacklist;
+    for (uint l = 0; l < loci.size(); l++)
+	if (removed[l])
+	    blacklist.insert(loci[l]->id);
+
+    //
+    // Remove loci
+    //
+    if (config.min_stack_depth > 0) 
+        {
+	cerr << "Removed " << below_stack_dep << " samples from loci that are below the minimum stack depth of " << config.min_stack_depth << "x\n";
+        
+        }
+    if (config.filter_lnl)
+        {
+	cerr << "Removed " << below_lnl_thresh << " samples from loci that are below the log likelihood threshold of " << config.lnl_limit << "\n";
+        
+        }
+    cerr << "Removing " << blacklist.size() << " loci that did not pass sample/population constraints...";
+    set<int> whitelist;
+    reduce_catalog(catalog, whitelist, blacklist);
+    int retained = pmap->prune(blacklist);
+    cerr << " retained " << retained << " loci.\n";
+
+    flog.applied              = true;
+    flog.below_stack_dep     += below_stack_dep;
+    flog.below_lnl_thresh    += below_lnl_thresh;
+    flog.constraint_removed  += blacklist.size();
+    flog.constraint_retained += retained;
+
+    return retained;
+}
+
+//
+// Record the excess of heterozygotes tallied at each locus, the paralog score that
+// clustering can be limited by, and blacklist the loci whose excess is above the
+// limit given, if any. Returns the number of loci blacklisted.
+//
+int
+FilterStage::het_excess_filter(map<int, PLocus *> &catalog, PopSum<PLocus> *psum, set<int> &blacklist, ostream &log_fh)
+{
+    map<int, PLocus *>::iterator it;
+    int cnt = 0;
+
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	PLocus *loc = it->second;
+
+	loc->het_excess = psum->locus_tally(loc->id)->het_excess;
+
+	if (this->config.het_excess_limit > 0.0 && loc->het_excess > this->config.het_excess_limit) {
+	    blacklist.insert(loc->id);
+	    cnt++;
+	    log_fh << "removed_locus\t"
+		   << loc->id << "\t"
+		   << loc->loc.chr << "\t"
+		   << loc->sort_bp() << "\t"
+		   << 0 << "\theterozygote_excess\n";
+	}
+    }
+
+    return cnt;
+}
+
+//
+// Loci are pruned in blocks of consecutive catalog loci, each block writing its log
+// and whitelist records to its own buffers, so that the output written once all blocks
+// are done is identical to that of a serial pass over the catalog.
+//
+const uint prune_block = 256;
+
+//
+// Screen the loci for differentiation between populations, as evidence of paralogy:
+// paralogous loci collapsed into one, with copy numbers that differ between
+// populations, show allele frequencies far more different than single-copy loci do.
+// Every pair of populations is tested at all SNPs of a locus at once, and a locus is
+// blacklisted if Fisher's exact test is significant at any SNP, Bonferroni corrected
+// for the number of tests made at the locus: the population pairs times its SNPs, so
+// that loci with many SNPs are not screened out more often. Loci are screened in the same blocks as they
+// are pruned, keeping the records in catalog order. Returns the number of loci
+// blacklisted.
+//
+int
+FilterStage::fst_screen(map<int, PLocus *> &catalog, PopSum<PLocus> *psum, set<int> &blacklist, ostream &log_fh)
+{
+    PopLayout &layout = this->layout;
+    uint pop_cnt = layout.pop_cnt();
+
+    if (pop_cnt < 2)
+	return 0;
+
+    vector<PLocus *>  loci;
+    vector<LocSum **> sums;
+    uint   max_snps = 1;
+    double limit    = this->config.fst_screen_p / (pop_cnt * (pop_cnt - 1) / 2);
+
+    //
+    // The PopSum indexes loci through a map, so the summaries of each locus are looked
+    // up here, before the loci are screened in parallel.
+    //
+    map<int, PLocus *>::iterator it;
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	loci.push_back(it->second);
+	sums.push_back(psum->locus(it->first));
+	if (it->second->snp_cnt > max_snps) max_snps = it->second->snp_cnt;
+    }
+
+    //
+    // Fill the table of log-factorials out to the largest allele count up front.
+    //
+    int samples = 0;
+    for (uint p = 0; p < pop_cnt; p++)
+	samples += layout.size(p);
+    log_factorials(2 * samples);
+
+    uint num_blocks = (loci.size() + prune_block - 1) / prune_block;
+    vector<string> log_buf(num_blocks);
+    vector<char>   screened(loci.size(), false);
+    int            cnt = 0;
+
+    #pragma omp parallel reduction(+:cnt)
+    {
+	PopPair *pairs = new PopPair[max_snps];
+
+	#pragma omp for schedule(dynamic)
+	for (uint b = 0; b < num_blocks; b++) {
+	    stringstream log;
+	    uint end = (b + 1) * prune_block < loci.size() ? (b + 1) * prune_block : loci.size();
+
+	    for (uint l = b * prune_block; l < end; l++) {
+		PLocus *loc = loci[l];
+		double  p   = 1.0;
+		int     col = -1;
+
+		if (loc->snp_cnt == 0 || blacklist.count(loc->id) > 0) continue;
+
+		for (uint j = 0; j < pop_cnt; j++)
+		    for (uint k = j + 1; k < pop_cnt; k++) {
+			psum->Fst(loc, sums[l], j, k, pairs);
+			for (uint i = 0; i < loc->snp_cnt; i++)
+			    if (pairs[i].alleles > 0 && pairs[i].fet_p < p) {
+				p   = pairs[i].fet_p;
+				col = pairs[i].col;
+			    }
+		    }
+
+		if (p < limit / loc->snp_cnt) {
+		    screened[l] = true;
+		    cnt++;
+		    log << "removed_locus\t"
+			<< loc->id << "\t"
+			<< loc->loc.chr << "\t"
+			<< loc->sort_bp(col) << "\t"
+			<< col << "\tpopulation_differentiation\n";
+		}
+	    }
+
+	    log_buf[b] = log.str();
+	}
+
+	delete [] pairs;
+    }
+
+    for (uint b = 0; b < num_blocks; b++)
+	log_fh << log_buf[b];
+
+    for (uint l = 0; l < loci.size(); l++)
+	if (screened[l])
+	    blacklist.insert(loci[l]->id);
+
+    return cnt;
+}
+
+int
+FilterStage::prune_polymorphic_sites(map<int, PLocus *> &catalog, PopMap<PLocus> *pmap, PopSum<PLocus> *psum, 
+				     set<int> &blacklist, ostream &log_fh, ostream &wl_fh)
+{
+    PmergeConfig &config = this->config;
+    PopLayout    &layout = this->layout;
+    vector<PLocus *>   loci;
+    vector<LocTally *> tallies;
+    vector<LocSum **>  sums;
+    vector<Datum **>   data;
+    int pruned = 0;
+
+    //
+    // The PopMap and PopSum index loci through maps, so the data of each locus is
+    // looked up here, before the blocks are processed in parallel.
+    //
+    map<int, PLocus *>::iterator it;
+    for (it = catalog.begin(); it != catalog.end(); it++) {
+	loci.push_back(it->second);
+	tallies.push_back(psum->locus_tally(it->first));
+	sums.push_back(psum->locus(it->first));
+	data.push_back(pmap->locus(it->first));
+    }
+
+    uint num_blocks = (loci.size() + prune_block - 1) / prune_block;
+    vector<string> log_buf(num_blocks), wl_buf(num_blocks);
+    vector<char>   removed(loci.size(), false);
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:pruned)
+    for (uint b = 0; b < num_blocks; b++) {
+	stringstream log, wl;
+	vector<uint> pop_prune_list;
+	PLocus   *loc;
+	LocTally *t;
+	LocSum  **s;
+	Datum   **d;
+	bool      sample_prune, maf_prune, inc_prune, het_prune, retained;
+	uint      end = (b + 1) * prune_block < loci.size() ? (b + 1) * prune_block : loci.size();
+
+	for (uint l = b * prune_block; l < end; l++) {
+	    loc = loci[l];
+
+	    //
+	    // If this locus is fixed, don't try to filter it out. Loci already blacklisted,
+	    // by the Fst screen, have been logged.
+	    //
+	    if (loc->snp_cnt == 0 || blacklist.count(loc->id) > 0)
+		continue;
+
+	    t = tallies[l];
+	    s = sums[l];
+	    d = data[l];
+	    retained = false;
+
+	    for (uint i = 0; i < loc->snp_cnt; i++) {
+
+		//
+		// If the site is fixed, ignore it.
+		//
+		if (t->nucs[loc->snps[i]].fixed == true) {
+		    retained = true;
+		    continue;
+		}
+
+		sample_prune = false;
+		maf_prune    = false;
+		inc_prune    = false;
+		het_prune    = false;
+		pop_prune_list.clear();
+		
+		//
+		// Populations were summarized in layout order, so population index j is
+		// also the index of the population's summary.
+		//
+		for (uint j = 0; j < layout.pop_cnt(); j++) {
+		    if (s[j]->nucs[loc->snps[i]].incompatible_site)
+			inc_prune = true;
+		    else if (s[j]->nucs[loc->snps[i]].num_indv == 0 ||
+			     (double) s[j]->nucs[loc->snps[i]].num_indv / (double) layout.size(j) < config.sample_limit)
+			pop_prune_list.push_back(j);
+		}
+
+		//
+		// Check how many populations have to be pruned out due to sample limit. If less than
+		// population limit, prune them; if more than population limit, mark locus for deletion.
+		//
+		if ((layout.pop_cnt() - pop_prune_list.size()) < (uint) config.population_limit) {
+		    sample_prune = true;
+		} else {
+		    for (uint j = 0; j < pop_prune_list.size(); j++) {
+			uint p = pop_prune_list[j];
+			if (s[p]->nucs[loc->snps[i]].num_indv == 0) continue;
+
+			for (int k = layout.start[p]; k <= layout.end[p]; k++) {
+			    if (d[k] == NULL || loc->snps[i] >= (uint) d[k]->len) 
+				continue;
+			    d[k]->model.set(loc->snps[i], 'U');
+			}
+		    }
+		}
+		
+		if (t->nucs[loc->snps[i]].allele_cnt > 1) {
+		    //
+		    // Test for minor allele frequency.
+		    //
+		    if ((1 - t->nucs[loc->snps[i]].p_freq) < config.minor_allele_freq)
+			maf_prune = true;
+		    //
+		    // Test for observed heterozygosity.
+		    //
+		    if (t->nucs[loc->snps[i]].obs_het > config.max_obs_het)
+			het_prune = true;
+		}
+
+		if (maf_prune == false && het_prune == false && sample_prune == false && inc_prune == false) {
+		    retained = true;
+		} else {
+		    pruned++;
+		    if (config.verbose) {
+			log << "pruned_polymorphic_site\t"
+			    << loc->id << "\t"
+			    << loc->loc.chr << "\t"
+			    << loc->sort_bp(loc->snps[i]) << "\t"
+			    << loc->snps[i] << "\t"; 
+			if (inc_prune)
+			    log << "incompatible_site\n";
+			else if (sample_prune)
+			    log << "sample_limit\n";
+			else if (maf_prune)
+			    log << "maf_limit\n";
+			else if (het_prune)
+			    log << "obshet_limit\n";
+			else
+			    log << "unknown_reason\n";
+		    }
+		}
+	    }
+
+	    //
+	    // If no SNPs were retained for this locus, then mark it to be removed entirely.
+	    //
+	    if (retained == false) {
+		log << "removed_locus\t"
+		    << loc->id << "\t"
+		    << loc->loc.chr << "\t"
+		    << loc->sort_bp() << "\t"
+		    << 0 << "\tno_snps_remaining\n";
+		removed[l] = true;
+	    } else {
+		wl << loc->id << "\n";
+	    }
+	}
+
+	log_buf[b] = log.str();
+	wl_buf[b]  = wl.str();
+    }
+
+    for (uint b = 0; b < num_blocks; b++) {
+	log_fh << log_buf[b];
+	wl_fh  << wl_buf[b];
+    }
+
+    for (uint l = 0; l < loci.size(); l++)
+	if (removed[l])
+	    blacklist.insert(loci[l]->id);
+
+    return pruned;
+}
+
+//
+// Maximum number of mismatches between two loci for them to be clustered, derived
+// from the length of the first catalog locus.
+//
+int
+cluster_distance(map<int, PLocus *> &catalog, double similarity)
+{
+    int seq_len = strlen(catalog.begin()->second->con);
+
+    return similarity_distance(seq_len, similarity);
+}
+
+int
+similarity_distance(int seq_len, double similarity)
+{
+    return seq_len - (similarity * seq_len);
+}
+
+//
+// Cluster the catalog loci, blacklisting the loci with a neighbour within the cluster
+// distance and listing the others in the whitelist. Returns the number of loci clustered.
+//
+int
+ClusterStage::run(map<int, PLocus *> &catalog, set<int> &blacklist, vector<int> &whitelist, ClusterTally &tally)
+{
+    PackedSeqs   seqs;
+    SeedIndex    idx;
+    vector<uint> members;
+    vector<Edge> edges;
+    vector<bool> mask;
+    int mismatches = cluster_distance(catalog, this->config.cluster_similarity);
+
+    cerr << "Clustering loci for paralog filtering" << "\n";
+    seqs.build(catalog);
+    idx.build(seqs, mismatches);
+    for (uint i = 0; i < seqs.size(); i++)
+	members.push_back(i);
+
+    if (this->config.het_priority) {
+	uint cnt = this->priority(catalog, seqs, members, mask);
+	cerr << "  Searching pairs of " << cnt << " of " << members.size() 
+	     << " loci with an excess of heterozygotes of at least " << this->config.het_cluster_limit << ".\n";
+    }
+
+    this->search(seqs, idx, members, mismatches, 0, 1, edges, this->config.het_priority ? &mask : NULL);
+
+    return this->classify(catalog, seqs, members, edges, blacklist, whitelist, tally);
+}
+
+//
+// Clustering may be limited to the loci scored as likely paralogs by their excess of
+// heterozygotes: mark the members whose excess reaches the limit, so that only pairs
+// involving such a locus are searched for. Returns the number of members marked.
+//
+uint
+ClusterStage::priority(map<int, PLocus *> &catalog, PackedSeqs &seqs, vector<uint> &members, vector<bool> &mask)
+{
+    uint cnt = 0;
+
+    mask.assign(seqs.size(), false);
+    for (uint i = 0; i < members.size(); i++)
+	if (catalog[seqs.ids[members[i]]]->het_excess >= this->config.het_cluster_limit) {
+	    mask[members[i]] = true;
+	    cnt++;
+	}
+
+    return cnt;
+}
+
+//
+// Search for the pairs of member loci within the given distance of one another,
+// restricted to the given shard of the candidate pairs: over a vantage-point tree if
+// requested, otherwise on the seed segments, or over all pairs if the loci are too
+// short to seed. If fresh is given, only pairs involving a fresh sequence are searched
+// for. An all-pairs search saves its progress to the checkpoint, if one is given.
+//
+int
+ClusterStage::search(PackedSeqs &seqs, SeedIndex &idx, vector<uint> &members, int mismatches, 
+		     uint shard, uint num_shards, vector<Edge> &edges, vector<bool> *fresh, PairsCheckpoint *ckpt)
+{
+    if (this->config.use_vptree) {
+	cerr << "  Querying a vantage-point tree of " << members.size() << " loci.\n";
+	find_edges_vptree(seqs, members, mismatches, shard, num_shards, edges, fresh);
+    } else if (idx.segs > 0) {
+	cerr << "  Seeding " << members.size() << " loci on " << idx.segs << " segments.\n";
+	find_edges(seqs, idx, members, mismatches, shard, num_shards, edges, fresh);
+    } else {
+	cerr << "  Loci are too short to seed " << mismatches << " mismatches, comparing all pairs of loci.\n";
+	find_edges_allpairs(seqs, members, mismatches, shard, num_shards, edges, fresh, ckpt);
+    }
+
+    return edges.size();
+}
+
+//
+// Blacklist the member loci taking part in a pair, and list the others in the
+// whitelist, in catalog order. Returns the number of loci clustered.
+//
+int
+ClusterStage::classify(map<int, PLocus *> &catalog, PackedSeqs &seqs, vector<uint> &members, vector<Edge> &edges,
+		       set<int> &blacklist, vector<int> &whitelist, ClusterTally &tally)
+{
+    map<int, PLocus *>::iterator it;
+    vector<bool> clustered(seqs.size(), false);
+    uint non_clustered = 0, polymorphic = 0;
+
+    for (uint i = 0; i < edges.size(); i++) {
+	clustered[edges[i].first]  = true;
+	clustered[edges[i].second] = true;
+    }
+
+    uint i = 0;
+    for (it = catalog.begin(); it != catalog.end(); it++, i++) {
+	if (clustered[members[i]] == false) {
+	    whitelist.push_back(it->first);
+	    non_clustered++;
+	} else {
+	    if (it->second->snp_cnt != 0) polymorphic++;
+	    blacklist.insert(it->first);
+	}
+    }
+
+    tally.non_clustered = non_clustered;
+    tally.clustered     = catalog.size() - non_clustered;
+    tally.polymorphic   = polymorphic;
+
+    return tally.clustered;
+}
+
+int
+write_cluster_stats(ostream &log_fh, int non_clustered_count, int clustered_count, int het_count)
+{
+    log_fh << "\n#\n# Cluster filtering stats \n#\n";
+    log_fh << "Number of Non-clustered loci" <<"\t"<< non_clustered_count << "\n";  
+    log_fh << "Number of clustered loci" <<"\t"<< clustered_count<< "\n";  
+    log_fh << "Number of polymorphic loci in the clustered loci" <<"\t"<< het_count << "\n";
+    log_fh << "Number of fixed loci in the clustered loci" <<"\t"<< clustered_count - het_count << "\n";    
+
+    return 0;
+}
+
+MemoryModels::~MemoryModels()
+{
+    map<int, ModRes *>::iterator it;
+
+    for (uint i = 0; i < this->models.size(); i++)
+	for (it = this->models[i].begin(); it != this->models[i].end(); it++)
+	    delete it->second;
+}
+
+//
+// Run the filtering stage on inputs held in memory, and the clustering stage if a
+// cluster similarity is set. Samples are taken in the order the command line takes
+// them from a population map, so that the result matches the files it would write.
+// Returns the number of loci whitelisted, -1 if the inputs can't be run.
+//
+int
+pmerge_run(PmergeConfig &params, PmergeInput &input, PmergeResult &result)
+{
+    PmergeConfig               config = params;
+    map<string, int>           pop_ids;
+    map<int, pair<int, int> >  pop_indexes;
+    vector<pair<int, string> > files;
+    PopLayout                  layout;
+
+    result = PmergeResult();
+
+    for (uint i = 0; i < input.popmap.size(); i++) {
+	string &pop = input.popmap[i].second;
+	if (pop_ids.count(pop) == 0) {
+	    int pop_id = pop_ids.size() + 1;
+	    pop_ids[pop] = pop_id;
+	    result.pop_names[pop_id] = pop;
+	}
+	files.push_back(make_pair(pop_ids[pop], input.popmap[i].first));
+    }
+
+    if (index_populations(files, pop_indexes) == 0) {
+	cerr << "Error: the population map lists no samples.\n";
+	return -1;
+    }
+    layout.build(pop_indexes);
+
+    if (config.population_limit > (int) pop_indexes.size())
+	config.population_limit = pop_indexes.size();
+
+    //
+    // Check the samples before taking any of their records over.
+    //
+    map<string, vector<CatMatch *> >::iterator mit;
+    set<int> seen;
+
+    for (uint i = 0; i < files.size(); i++) {
+	mit = input.matches.find(files[i].second);
+	if (mit == input.matches.end() || mit->second.size() == 0)
+	    continue;
+	if (seen.count(mit->second[0]->sample_id) > 0) {
+	    cerr << "Error: sample ID " << mit->second[0]->sample_id << " occurs twice in the population map.\n";
+	    return -1;
+	}
+	seen.insert(mit->second[0]->sample_id);
+    }
+
+    if (seen.size() == 0) {
+	cerr << "Error: no matches were given for any sample of the population map.\n";
+	return -1;
+    }
+    if (input.catalog.size() == 0)
+	return 0;
+
+    vector<vector<CatMatch *> > catalog_matches;
+    vector<int>                 sample_ids;
+    MemoryModels                models;
+    FilterLog                   flog(pop_indexes, "");
+    uint                        excluded = 0;
+
+    for (uint i = 0; i < files.size(); i++) {
+	mit = input.matches.find(files[i].second);
+
+	if (mit == input.matches.end() || mit->second.size() == 0) {
+	    cerr << "Warning: no matches were given for sample '" << files[i].second << "', excluding this sample from population analysis.\n";
+	    exclude_sample(i - excluded, pop_indexes, layout);
+	    excluded++;
+	    continue;
+	}
+
+	sample_ids.push_back(mit->second[0]->sample_id);
+	catalog_matches.push_back(vector<CatMatch *>());
+	catalog_matches.back().swap(mit->second);
+
+	models.names.push_back(files[i].second);
+	models.models.push_back(map<int, ModRes *>());
+	if (input.models.count(files[i].second) > 0)
+	    models.models.back().swap(input.models[files[i].second]);
+    }
+
+    map<int, PLocus *> catalog = input.catalog;
+    stringstream       wl, log;
+    int                id;
+
+    order_unordered_loci(catalog);
+
+    FilterStage filter(config, layout, result.pop_names, input.columns);
+    filter.run(catalog, sample_ids, catalog_matches, models, flog, wl);
+    result.filters = flog;
+
+    //
+    // No loci passed the sample/population constraints.
+    //
+    if (flog.applied && flog.constraint_retained == 0)
+	return 0;
+
+    flog.write(log, config);
+    result.retained = catalog;
+    while (wl >> id)
+	result.whitelist.push_back(id);
+
+    if (config.cluster_similarity > 0.0 && catalog.size() > 0) {
+	ClusterStage cluster(config);
+	set<int>     blacklist;
+
+	result.whitelist.clear();
+	cluster.run(catalog, blacklist, result.whitelist, result.clusters);
+	write_cluster_stats(log, result.clusters.non_clustered, result.clusters.clustered, result.clusters.polymorphic);
+    }
+    result.log = log.str();
+
+    return result.whitelist.size();
+}
@@ -0,0 +1,291 @@
+// -*-mode:c++; c-style:k&r; c-basic-offset:4;-*-
+//
+// Copyright 2016, Praveen Nadukkalam Ravindran <pravindran@dal.ca>
+//
+// This file is part of Pmerge.
+//
+// Pmerge is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Pmerge is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Stacks.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef __LIBPMERGE_H__
+#define __LIBPMERGE_H__
+
+#include <stdint.h>
+#include <string>
+using std::string;
+#include <iostream>
+using std::cerr;
+#include <fstream>
+using std::ostream;
+using std::ifstream;
+using std::ofstream;
+#include <vector>
+using std::vector;
+#include <map>
+using std::map;
+#include <set>
+using std::set;
+#include <utility>
+using std::pair;
+using std::make_pair;
+
+#include "locus.h"
+#include "stacks.h"
+#include "PopMap.h"
+#include "PopSum.h"
+#include "chunks.h"
+#include "cluster.h"
+
+//
+// Parameters of the filtering and clustering stages, each set by the command-line
+// option named alongside it.
+//
+class PmergeConfig {
+public:
+    double sample_limit;        // -r, fraction of a population's samples a locus must be present in.
+    int    population_limit;    // -p, number of populations a locus must be present in.
+    int    min_stack_depth;     // -m
+    bool   filter_lnl;          // --lnl_lim
+    double lnl_limit;
+    double minor_allele_freq;   // -a
+    double max_obs_het;         // --max_obs_het
+    double het_excess_limit;    // --het_excess
+    double fst_screen_p;        // --fst_screen
+    double cluster_similarity;  // -C, no clustering if 0.
+    bool   het_priority;        // --het_cluster
+    double het_cluster_limit;
+    bool   use_vptree;          // --vptree
+    bool   verbose;
+
+    PmergeConfig() {
+	sample_limit       = 0.0;
+	population_limit   = 1;
+	min_stack_depth    = 0;
+	filter_lnl         = false;
+	lnl_limit          = 0.0;
+	minor_allele_freq  = 0.0;
+	max_obs_het        = 1.0;
+	het_excess_limit   = 0.0;
+	fst_screen_p       = 0.0;
+	cluster_similarity = 0.0;
+	het_priority       = false;
+	het_cluster_limit  = 0.0;
+	use_vptree         = false;
+	verbose            = true;
+    }
+};
+
+//
+// Layout of the samples in populations. Populations are numbered densely in order of
+// population ID, the order in which they are summarized, and the samples of each
+// occupy a contiguous range of sample indexes. Each population also has a bitset of
+// its samples, so that per-locus loops count or clear the samples of a population
+// with word operations instead of looking population IDs up in maps. The layout is
+// built with the file list, and rebuilt only when a sample has to be excluded.
+//
+class PopLayout {
+public:
+    vector<int>               pop_ids;    // Population index -> population ID.
+    vector<int>               start;      // Population index -> first sample index.
+    vector<int>               end;        // Population index -> last sample index.
+    vector<vector<uint64_t> > members;    // Population index -> bitset of its samples.
+    uint                      words;      // Words in a bitset of samples.
+
+    PopLayout() { this->words = 0; }
+
+    void build(map<int, pair<int, int> > &);
+    uint pop_cnt()     { return this->pop_ids.size(); }
+    int  size(uint p)  { return this->end[p] - this->start[p] + 1; }
+    uint count(uint p, const uint64_t *bits) {
+	const uint64_t *m = &this->members[p][0];
+	uint cnt = 0;
+	for (int w = this->start[p] >> 6; w <= this->end[p] >> 6; w++)
+	    cnt += __builtin_popcountll(bits[w] & m[w]);
+	return cnt;
+    }
+    void clear(uint p, uint64_t *bits) {
+	const uint64_t *m = &this->members[p][0];
+	for (int w = this->start[p] >> 6; w <= this->end[p] >> 6; w++)
+	    bits[w] &= ~m[w];
+    }
+};
+
+//
+// Tallies of the per-locus filtering stages.
+//
+class FilterTally {
+public:
+    bool applied;            // Were the sample/population constraints applied.
+    int  below_stack_dep;
+    uint below_lnl_thresh;
+    uint constraint_removed;
+    uint constraint_retained;
+    uint pruned_snps;
+    uint pruned_loci;
+    uint het_excess;         // Loci removed for an excess of heterozygotes.
+    uint fst_screened;       // Loci removed by the Fst screen.
+    uint retained;
+
+    map<int, int> incompatible; // Population ID -> incompatible loci.
+
+    FilterTally() {
+	applied             = false;
+	below_stack_dep     = 0;
+	below_lnl_thresh    = 0;
+	constraint_removed  = 0;
+	constraint_retained = 0;
+	pruned_snps         = 0;
+	pruned_loci         = 0;
+	het_excess          = 0;
+	fst_screened        = 0;
+	retained            = 0;
+    }
+};
+
+//
+// Tallies and log records of the per-locus filtering stages. Each section of the log is
+// collected in its own stream, in memory or in a spill file, so that a chunked run can
+// still write every section contiguously once all chunks have been processed.
+//
+class FilterLog : public FilterTally {
+    string           dir;
+    map<int, string> pop_paths;
+    string           prune_path;
+    bool             keep;
+
+public:
+    map<int, ostream *> pop_log;      // Population ID -> incompatible site records.
+    ostream            *prune_log;    // Pruned site records.
+
+    FilterLog(map<int, pair<int, int> > &, string);
+    ~FilterLog();
+    int write(ostream &, PmergeConfig &);
+    int save();
+    int absorb(string);
+    int remove_shard(string);
+};
+
+//
+// Tallies of the clustering stage.
+//
+class ClusterTally {
+public:
+    uint non_clustered;
+    uint clustered;
+    uint polymorphic;  // Clustered loci holding SNPs.
+
+    ClusterTally() { non_clustered = 0; clustered = 0; polymorphic = 0; }
+};
+
+//
+// Supplies model calls held in memory, handing the calls of each sample over to the
+// caller as they are loaded.
+//
+class MemoryModels : public ModelSource {
+public:
+    vector<string>              names;
+    vector<map<int, ModRes *> > models;  // Sample index -> model calls, by sample locus ID.
+
+    ~MemoryModels();
+
+    int load(uint i, map<int, ModRes *> &modres) {
+	modres.swap(this->models[i]);
+	return modres.size();
+    }
+    void report_missing(uint i) {
+	cerr << "Warning: no model results were given for sample '" << this->names[i] << "', excluding this sample from population analysis.\n";
+    }
+};
+
+//
+// The per-locus filtering stage: applies the sample/population constraints to a set of
+// catalog loci, summarizes each population, screens the loci for paralogs and prunes
+// variant sites. Records go to the filter log, and the IDs of the loci retained with
+// variant sites to the whitelist stream.
+//
+class FilterStage {
+    PmergeConfig        &config;
+    PopLayout           &layout;
+    map<int, string>    &pop_names;  // Population ID -> population name.
+    map<int, set<int> > &columns;    // Catalog locus ID -> SNP columns to keep, all if empty.
+
+public:
+    FilterStage(PmergeConfig &config, PopLayout &layout, map<int, string> &pop_names, map<int, set<int> > &columns)
+	: config(config), layout(layout), pop_names(pop_names), columns(columns) {}
+
+    int run(map<int, PLocus *> &, vector<int> &, vector<vector<CatMatch *> > &, ModelSource &, FilterLog &, ostream &);
+    int apply_locus_constraints(map<int, PLocus *> &, PopMap<PLocus> *, FilterLog &);
+    int het_excess_filter(map<int, PLocus *> &, PopSum<PLocus> *, set<int> &, ostream &);
+    int fst_screen(map<int, PLocus *> &, PopSum<PLocus> *, set<int> &, ostream &);
+    int prune_polymorphic_sites(map<int, PLocus *> &, PopMap<PLocus> *, PopSum<PLocus> *, set<int> &, ostream &, ostream &);
+};
+
+//
+// The clustering stage: finds the pairs of loci within the cluster distance of one
+// another and blacklists every locus that has such a neighbour. The command line adds
+// seed index files, sharding and approximate searches around the same search.
+//
+class ClusterStage {
+    PmergeConfig &config;
+
+public:
+    ClusterStage(PmergeConfig &config) : config(config) {}
+
+    int  run(map<int, PLocus *> &, set<int> &, vector<int> &, ClusterTally &);
+    uint priority(map<int, PLocus *> &, PackedSeqs &, vector<uint> &, vector<bool> &);
+    int  search(PackedSeqs &, SeedIndex &, vector<uint> &, int, uint, uint, vector<Edge> &,
+		vector<bool> * = NULL, PairsCheckpoint * = NULL);
+    int  classify(map<int, PLocus *> &, PackedSeqs &, vector<uint> &, vector<Edge> &, set<int> &,
+		  vector<int> &, ClusterTally &);
+};
+
+//
+// In-memory inputs of a run. The population map lists each sample with its population,
+// and populations are numbered in order of first appearance, as they are from a
+// population map file. A run consumes its inputs: the match records and model calls
+// of the samples in the population map are released as they are loaded, and the
+// catalog loci are filtered in place.
+//
+class PmergeInput {
+public:
+    map<int, PLocus *>               catalog;  // Catalog loci, owned by the caller.
+    vector<pair<string, string> >    popmap;   // Sample name, population name.
+    map<string, vector<CatMatch *> > matches;  // Sample name -> matches of the sample to the catalog.
+    map<string, map<int, ModRes *> > models;   // Sample name -> model calls of the sample, by sample locus ID.
+    map<int, set<int> >              columns;  // Catalog locus ID -> SNP columns to keep, all if empty.
+};
+
+//
+// Outputs of a run: the whitelist and log sections the command line would write to its
+// files, and the tallies behind them.
+//
+class PmergeResult {
+public:
+    vector<int>        whitelist;  // Catalog IDs of the whitelisted loci, in catalog order.
+    map<int, PLocus *> retained;   // Loci retained by the filtering stage.
+    map<int, string>   pop_names;  // Population ID -> population name.
+    FilterTally        filters;
+    ClusterTally       clusters;
+    string             log;
+};
+
+int  pmerge_run(PmergeConfig &, PmergeInput &, PmergeResult &);
+int  index_populations(vector<pair<int, string> > &, map<int, pair<int, int> > &);
+int  exclude_sample(int, map<int, pair<int, int> > &, PopLayout &);
+bool order_unordered_loci(map<int, PLocus *> &);
+int  cluster_distance(map<int, PLocus *> &, double);
+int  similarity_distance(int, double);
+int  write_cluster_stats(ostream &, int, int, int);
+
+#endif // __LIBPMERGE_H__
@@ -89,6 +89,80 @@ bp_compare(Locus *a, Locus *b)
     return (a->sort_bp() < b->sort_bp());
 }
 
+uint PLocus::sort_bp(uint k) {
+    if (this->loc.strand == plus)
+	return this->loc.bp + k;
+    else
+	return k == 0 ? this->loc.bp - this->len + 1 : this->loc.bp - k;
+}
+
+bool 
+bp_compare(PLocus *a, PLocus *b) 
+{
+    return (a->sort_bp() < b->sort_bp());
+}
+
+void *
+LocusArena::alloc(size_t size, size_t align) 
+{
+    const size_t block_size = 1 << 20;
+
+    this->used = (this->used + align - 1) & ~(align - 1);
+
+    if (this->blocks.size() == 0 || this->used + size > this->cap) {
+	this->cap  = size > block_size ? size : block_size;
+	this->used = 0;
+	this->blocks.push_back(new char[this->cap]);
+    }
+
+    void *p = this->blocks.back() + this->used;
+    this->used += size;
+
+    return p;
+}
+
+PLocus *
+LocusArena::new_locus() 
+{
+    return new (this->alloc(sizeof(PLocus), sizeof(void *))) PLocus;
+}
+
+char *
+LocusArena::add_consensus(PLocus *loc, const char *seq) 
+{
+    loc->len = strlen(seq);
+    loc->con = (char *) this->alloc(loc->len + 1, 1);
+    strcpy(loc->con, seq);
+
+    return loc->con;
+}
+
+uint16_t *
+LocusArena::add_snps(PLocus *loc, const vector<uint16_t> &cols) 
+{
+    loc->snp_cnt = cols.size();
+    loc->snps    = (uint16_t *) this->alloc(sizeof(uint16_t) * cols.size(), sizeof(uint16_t));
+    for (uint i = 0; i < cols.size(); i++)
+	loc->snps[i] = cols[i];
+
+    return loc->snps;
+}
+
+const char *
+LocusArena::intern_chr(const char *chr) 
+{
+    map<string, char *>::iterator it = this->chrs.find(chr);
+
+    if (it != this->chrs.end())
+	return it->second;
+
+    char *c = (char *) this->alloc(strlen(chr) + 1, 1);
+    strcpy(c, chr);
+    this->chrs[chr] = c;
+
+    return c;
+}
+
 QLocus::~QLocus() 
 {
     vector<Match *>::iterator it;
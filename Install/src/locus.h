@@ -32,6 +32,8 @@ using std::map;
 #include <utility>
 using std::pair;
 using std::make_pair;
+#include <stdint.h>
+#include <new>
 
 //#include "constants.h"
 #include "stacks.h"
@@ -153,6 +155,77 @@ public:
     double chisq;             // Chi squared p-value testing the null hypothesis of no segregation distortion.
 };
 
+//
+// Physical genome location of a PLocus. Unlike PhyLoc, the chromosome name is not
+// owned by the location; it points into the chromosome table of a LocusArena.
+//
+class PLoc {
+public:
+    const char *chr;
+    uint        bp;
+    strand_type strand;
+
+    PLoc() { chr = ""; bp = 0; strand = plus; }
+};
+
+//
+// Pmerge Catalog Locus Class; a compact catalog locus carrying only what pmerge
+// needs: the consensus sequence, SNP columns, genomic position and sample counters.
+// The consensus and SNP column arrays are allocated from a LocusArena.
+//
+class PLocus {
+public:
+    int       id;             // Locus ID
+    uint16_t  len;            // Consensus sequence length
+    uint16_t  snp_cnt;        // Number of SNP columns
+    char     *con;            // Consensus sequence
+    uint16_t *snps;           // Columns of the Single Nucleotide Polymorphisms in this locus.
+    PLoc      loc;            // Physical genome location of this locus.
+    int       confounded_cnt; // Number of samples containing confounded loci.
+    int       hcnt;           // Number of samples containing a haplotype for this locus.
+    int       cnt;            // Number of samples containing data for this locus.
+    float     het_excess;     // Excess of heterozygotes over Hardy-Weinberg expectations, a paralog score.
+
+    PLocus() { 
+	id             = 0;
+	len            = 0;
+	snp_cnt        = 0;
+	con            = NULL;
+	snps           = NULL;
+	confounded_cnt = 0;
+	hcnt           = 0;
+	cnt            = 0;
+	het_excess     = 0.0;
+    }
+    uint sort_bp(uint k = 0);
+};
+
+//
+// Bump allocator holding a catalog of PLocus objects, their consensus sequences and
+// SNP columns in large contiguous blocks. Everything is released with the arena.
+//
+class LocusArena {
+    vector<char *>    blocks;
+    size_t            used;
+    size_t            cap;
+    map<string, char *> chrs;
+
+    void *alloc(size_t, size_t);
+
+public:
+    LocusArena()  { used = 0; cap = 0; }
+    ~LocusArena() {
+	for (uint i = 0; i < this->blocks.size(); i++)
+	    delete [] this->blocks[i];
+    }
+
+    PLocus     *new_locus();
+    char       *add_consensus(PLocus *, const char *);
+    uint16_t   *add_snps(PLocus *, const vector<uint16_t> &);
+    const char *intern_chr(const char *);
+};
+
 bool bp_compare(Locus *, Locus *);
+bool bp_compare(PLocus *, PLocus *);
 
 #endif // __LOCUS_H__
@@ -25,64 +25,46 @@
 #include "pmerge.h"
 
 
-// Global variables to hold command-line options.
+// Global variables to hold command-line options. The parameters of the filtering and
+// clustering stages are held in the configuration passed to them.
 int       num_threads =  1;
 int       batch_id    = -1;
 string    in_path;
 string    out_path;
 string    pmap_path;
 string    wl_path;
-double    sample_limit        = 0.0;
-int       population_limit    = 1;
 bool      loci_ordered        = false;
-bool      log_fst_comp        = false;
-bool      verbose             = true;
-bool      filter_lnl          = false;
-double    lnl_limit           = 0.0;
-int       min_stack_depth     = 0;
 double    merge_prune_lim     = 1.0;
 double    merge_minor_freq    = 0.0;
-double    minor_allele_freq   = 0.0;
 double    p_value_cutoff      = 0.05;
-double    max_obs_het         = 1.0;
-double    cluster_similarity  = 0.0;
+int       chunk_size          = 0;
+int       shard_num           = 0;
+int       shard_cnt           = 0;
+int       merge_cnt           = 0;
+bool      cluster_stage       = false;
+string    index_path;
+double    lsh_recall          = 0.0;
+uint      lsh_kmer            = 0;
+bool      cluster_bench       = false;
+bool      order_loci          = false;
+double    hierarchy_similarity = 0.0;
+bool      from_hierarchy      = false;
+int       estimate_cnt        = 0;
+bool      chunk_by_chr        = false;
+bool      checkpoints         = false;
+bool      resume              = false;
+double    ckpt_interval       = 600.0;
+string    tmp_path;
+PmergeConfig config;
 
 map<int, string>          pop_key, grp_key;
 map<int, pair<int, int> > pop_indexes;
 map<int, vector<int> >    grp_members;
+PopLayout                 pop_layout;
 map<int, int>   psv_counter;
 set<int> blacklist;
 map<int, set<int> > whitelist;
-
-int dist(Tag *tag_1,Tag *tag_2, int distance) {
-    int   dist  = 0;
-    const char *p     = tag_1->seq.c_str();
-    const char *q     = tag_2->seq.c_str();
-    const char *p_end = p + tag_1->len;
-    const char *q_end = q + tag_1->len;
-
-
-   if (tag_1->len != tag_2->len) {
-        if (tag_1->len < tag_2->len)
-            dist += tag_2->len - tag_1->len;
-        else if (tag_1->len > tag_2->len)
-            dist += tag_1->len - tag_2->len;
-    }
-
-    //
-    // Count the number of characters that are different
-    // between the two sequences.
-    //
-    while (p < p_end && q < q_end) {
-	dist += (*p == *q) ? 0 : 1;
-	p++; 
-	q++;
-	if (dist > distance)
-		return -1;
-    }
-
-    return dist;
-}
+map<int, PLocus *>  index_catalog;
 
 int main (int argc, char* argv[]) {
 
@@ -92,13 +74,13 @@ int main (int argc, char* argv[]) {
     parse_command_line(argc, argv);
 
     cerr
-	<< "Percent samples limit per population: " << sample_limit << "\n"
-	<< "Locus Population limit: " << population_limit << "\n"
-	<< "Minimum stack depth: " << min_stack_depth << "\n"
-	<< "Log liklihood filtering: " << (filter_lnl == true ? "on"  : "off") << "; threshold: " << lnl_limit << "\n"
-	<< "Minor allele frequency cutoff: " << minor_allele_freq << "\n"
-        << "Maximum observed heterozygosity cutoff: " << max_obs_het << "\n"
-        << "Minimum percentage of similarity between loci to cluster: " << cluster_similarity << "\n";
+	<< "Percent samples limit per population: " << config.sample_limit << "\n"
+	<< "Locus Population limit: " << config.population_limit << "\n"
+	<< "Minimum stack depth: " << config.min_stack_depth << "\n"
+	<< "Log liklihood filtering: " << (config.filter_lnl == true ? "on"  : "off") << "; threshold: " << config.lnl_limit << "\n"
+	<< "Minor allele frequency cutoff: " << config.minor_allele_freq << "\n"
+        << "Maximum observed heterozygosity cutoff: " << config.max_obs_het << "\n"
+        << "Minimum percentage of similarity between loci to cluster: " << config.cluster_similarity << "\n";
 
     //
     // Set the number of OpenMP parallel threads to execute.
@@ -113,405 +95,359 @@ int main (int argc, char* argv[]) {
     srandom(time(NULL));
 
     vector<pair<int, string> > files;
-    if (!build_file_list(files, pop_indexes, grp_members))
+    if (!build_file_list(files, pop_indexes, grp_members, pop_layout))
 	exit(1);
 
+    //
+    // Combine the outputs of a set of shards.
+    //
+    if (merge_cnt > 0)
+	return merge_shards(argc, argv);
+
+    //
+    // Extract the clusters at the requested similarity from a stored hierarchy.
+    //
+    if (from_hierarchy)
+	return query_hierarchy(argc, argv);
+
+    //
+    // Estimate the outcome and cost of clustering from a sample of the catalog.
+    //
+    if (estimate_cnt > 0)
+	return estimate_clusters(argc, argv);
+
+    //
+    // A shard writes its outputs into its own directory, to be combined by a merge run.
+    //
+    string shard_dir;
+    if (shard_cnt > 0) {
+	shard_dir = shard_path(shard_num);
+	if (mkdir(shard_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+	    cerr << "Unable to create shard directory '" << shard_dir << "'\n";
+	    exit(1);
+	}
+    }
     
     //
     // Open the log file.
     //
     stringstream log, wl;
     log << "batch_" << batch_id << ".pmerge.log";
-    string log_path = in_path + log.str();
-    ofstream log_fh(log_path.c_str(), ofstream::out);
+    string log_path = shard_cnt > 0 ? shard_dir + "/pmerge.log" : in_path + log.str();
+
+    //
+    // A run resuming from the checkpoint of its filtering stage appends to the log as it
+    // stood when the stage completed, and goes on to cluster the loci retained.
+    //
+    FilterCheckpoint fckpt;
+    bool resumed = false;
+    if (resume && shard_cnt == 0 && config.cluster_similarity > 0.0 && 
+	fckpt.load(checkpoint_path("filter.ckpt"), filter_key(files))) {
+	struct stat sb;
+	resumed = stat(log_path.c_str(), &sb) == 0 && (uint64_t) sb.st_size >= fckpt.log_len && 
+	    truncate(log_path.c_str(), fckpt.log_len) == 0;
+    }
+
+    ofstream log_fh(log_path.c_str(), resumed ? ofstream::out | ofstream::app : ofstream::out);
     if (log_fh.fail()) {
         cerr << "Error opening log file '" << log_path << "'\n";
 	exit(1);
     }
-    init_log(log_fh, argc, argv);
+    if (!resumed)
+	init_log(log_fh, argc, argv);
     
      //
      // open Whitelist file
      //
      wl << "batch_" << batch_id << ".WL";
-    string wl_path = in_path + wl.str();
+    string wl_path = shard_cnt > 0 ? shard_dir + "/WL" : in_path + wl.str();
     
     //
     // Load the catalog
     //
-    stringstream catalog_file;
-    map<int, CSLocus *> catalog;
-    bool compressed = false;
+    map<int, PLocus *> catalog;
+    LocusArena arena;
     int  res;
-    catalog_file << in_path << "batch_" << batch_id << ".catalog";
-    if ((res = load_loci(catalog_file.str(), catalog, false, false, compressed)) == 0) {
-    	cerr << "Unable to load the catalog '" << catalog_file.str() << "'\n";
-     	return 0;
-    }
-
-    //
-    // Check the whitelist.
-    //
-    check_whitelist_integrity(catalog, whitelist);
-
-    //
-    // Implement the black/white list
-    //
-    reduce_catalog(catalog, whitelist, blacklist);
-
-    //
-    // If the catalog is not reference aligned, assign an arbitrary ordering to catalog loci.
-    //
-    loci_ordered = order_unordered_loci(catalog);
+    if (load_batch_catalog(catalog, arena) == 0)
+	return 0;
 
     //
-    // Load matches to the catalog
+    // A clustering shard compares the loci retained by the filtering stage, generating
+    // the candidate pairs of its partition of seed hashes.
     //
-    vector<vector<CatMatch *> > catalog_matches;
-    map<int, string>            samples;
-    vector<int>                 sample_ids;
-     map<int, CSLocus *>::iterator it;
-     CSLocus *loc;
-    for (int i = 0; i < (int) files.size(); i++) {
-	vector<CatMatch *> m;
-	load_catalog_matches(in_path + files[i].second, m);
-
-	if (m.size() == 0) {
-	    cerr << "Warning: unable to find any matches in file '" << files[i].second << "', excluding this sample from population analysis.\n";
-	    //
-	    // This case is generated by an existing, but empty file.
-	    // Remove this sample from the population index which was built from 
-	    // existing files, but we couldn't yet check for empty files.
-	    //
-	    map<int, pair<int, int> >::iterator pit;
-	    for (pit = pop_indexes.begin(); pit != pop_indexes.end(); pit++)
-		if (i >= pit->second.first && i <= pit->second.second) {
-		    pit->second.second--;
-		    pit++;
-		    while (pit != pop_indexes.end()) {
-			pit->second.first--;
-			pit->second.second--;
-			pit++;
-		    }
-		    break;
-		}
-
-	    continue;
+    if (cluster_stage) {
+	stringstream ret;
+	ret << in_path << "batch_" << batch_id << ".pmerge_retained.tsv";
+	select_loci(catalog, ret.str());
+
+	SeedIndexFile idx_file;
+	PackedSeqs    seqs;
+	SeedIndex     idx;
+	ClusterState  state;
+	vector<uint>  members;
+	vector<Edge>  edges;
+	int mismatches = cluster_distance(catalog, config.cluster_similarity);
+
+	cerr << "Clustering loci for paralog filtering, shard " << shard_num << " of " << shard_cnt << "\n";
+	prepare_clustering(catalog, mismatches, seqs, idx, state, idx_file, members);
+	cluster_edges(seqs, idx, state, members, mismatches, shard_num - 1, shard_cnt, edges);
+	if (checkpoints)
+	    remove(checkpoint_path(pairs_checkpoint()).c_str());
+
+	string   edge_path = shard_dir + "/edges.tsv";
+	ofstream edge_fh(edge_path.c_str(), ofstream::out);
+	if (edge_fh.fail()) {
+	    cerr << "Error opening edge file '" << edge_path << "'\n";
+	    exit(1);
 	}
+	for (uint i = 0; i < edges.size(); i++)
+	    edge_fh << seqs.ids[edges[i].first] << "\t" << seqs.ids[edges[i].second] << "\n";
+	edge_fh.close();
 
-	catalog_matches.push_back(m);
-	if (samples.count(m[0]->sample_id) == 0) {
-	    samples[m[0]->sample_id] = files[i].second;
-	    sample_ids.push_back(m[0]->sample_id);
-	} else {
-	    cerr << "Fatal error: sample ID " << m[0]->sample_id << " occurs twice in this data set, likely the pipeline was run incorrectly.\n";
-	    exit(0);
-	}
+	cerr << "Wrote " << edges.size() << " pairs of clustered loci to '" << edge_path << "'\n";
+	return 0;
     }
 
     //
-    // Create the population map
-    // 
-    cerr << "Populating observed haplotypes for " << sample_ids.size() << " samples, " << catalog.size() << " loci.\n";
-    PopMap<CSLocus> *pmap = new PopMap<CSLocus>(sample_ids.size(), catalog.size());
-    pmap->populate(sample_ids, catalog, catalog_matches);
-
-
-    apply_locus_constraints(catalog, pmap, pop_indexes);
-
-   
-    log_fh << "# Distribution of population loci after applying locus constraints.\n";
-    //log_haplotype_cnts(catalog, log_fh);
-
-    cerr << "Loading model outputs for " << sample_ids.size() << " samples, " << catalog.size() << " loci.\n";
-    //map<int, CSLocus *>::iterator it;
-    map<int, ModRes *>::iterator mit;
-    Datum   *d;
-    //CSLocus *loc;
-
-    //
-    // Load the output from the SNP calling model for each individual at each locus. This
-    // model output string looks like this:
-    //   OOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOOEOOOOOOEOOOOOOOOOOOOOOOOOOOOOOOOOOOOOUOOOOUOOOOOO
-    // and records model calls for each nucleotide: O (hOmozygous), E (hEterozygous), U (Unknown)
+    // A filtering shard processes its range of catalog loci.
     //
-    for (uint i = 0; i < sample_ids.size(); i++) {
-    	map<int, ModRes *> modres;
-    	load_model_results(in_path + samples[sample_ids[i]], modres);
-
-    	if (modres.size() == 0) {
-    	    cerr << "Warning: unable to find any model results in file '" << samples[sample_ids[i]] << "', excluding this sample from population analysis.\n";
-    	    continue;
-    	}
-
-    	for (it = catalog.begin(); it != catalog.end(); it++) {
-    	    loc = it->second;
-    	    d = pmap->datum(loc->id, sample_ids[i]);
-
-    	    if (d != NULL) {
-		if (modres.count(d->id) == 0) {
-		    cerr << "Fatal error: Unable to find model data for catalog locus " << loc->id 
-			 << ", sample ID " << sample_ids[i] << ", sample locus " << d->id 
-			 << "; likely IDs were mismatched when running pipeline.\n";
-		    exit(0);
-		}
-		d->len   = strlen(modres[d->id]->model);
-    		d->model = new char[d->len + 1];
-    		strcpy(d->model, modres[d->id]->model);
-    	    }
-    	}
-
-    	for (mit = modres.begin(); mit != modres.end(); mit++)
-    	    delete mit->second;
-    	modres.clear();
-    }
-
-    uint pop_id, start_index, end_index;
-    map<int, pair<int, int> >::iterator pit;
-
-    PopSum<CSLocus> *psum = new PopSum<CSLocus>(pmap->loci_cnt(), pop_indexes.size());
-    psum->initialize(pmap);
-    
-    for (pit = pop_indexes.begin(); pit != pop_indexes.end(); pit++) {
-    	start_index = pit->second.first;
-    	end_index   = pit->second.second;
-    	pop_id      = pit->first;
-    	cerr << "Generating nucleotide-level summary statistics for population '" << pop_key[pop_id] << "'\n";
-    	psum->add_population(catalog, pmap, pop_id, start_index, end_index, verbose, log_fh);
+    if (shard_cnt > 0) {
+	map<int, PLocus *>::iterator it = catalog.begin();
+	uint start = (uint64_t) catalog.size() * (shard_num - 1) / shard_cnt;
+	uint end   = (uint64_t) catalog.size() * shard_num / shard_cnt;
+	map<int, PLocus *> range;
+
+	advance(it, start);
+	for (uint i = start; i < end; i++, it++)
+	    range.insert(*it);
+	catalog.swap(range);
+
+	cerr << "Filtering shard " << shard_num << " of " << shard_cnt << ", " << catalog.size() << " loci.\n";
     }
 
-    cerr << "Tallying loci across populations...";
-    psum->tally(catalog);
-    cerr << "done.\n";
-
     //
-    // We have removed loci that were below the -r and -p thresholds. Now we need to
-    // identify individual SNPs that are below the -r threshold or the minor allele
-    // frequency threshold (-a). In these cases we will remove the SNP, but keep the locus.
+    // Open the whitelist file.
     //
-    blacklist.clear();
-
-   int pruned_snps = prune_polymorphic_sites(catalog, pmap, psum, pop_indexes, whitelist, blacklist, log_fh,wl_path);
-   cerr << "Pruned " << pruned_snps << " variant sites due to filter constraints.\n";
-
-   cerr << "Removing " << blacklist.size() << " additional loci for which all variant sites were filtered...";
-   set<int> empty_list;
-   reduce_catalog(catalog, empty_list, blacklist);
-   reduce_catalog_snps(catalog, whitelist, pmap);
-   int retained = pmap->prune(blacklist);
-   cerr << " retained " << retained << " loci.\n";
-   
-   
-   
-   blacklist.clear();    
-   if ( cluster_similarity > 0.0)
-   {
-   int cluster_filtering = cluster_filter (catalog,blacklist,log_fh,wl_path); 
-   cerr << "Removing " << blacklist.size() << " additional loci which are clustered within the specified threshold...";
-   }
-      
-        
-}
-
+    ofstream wl_fh(wl_path.c_str(), ofstream::out);
+    if (wl_fh.fail()) {
+        cerr << "Error opening WL file '" << wl_path << "'\n";
+	exit(1);
+    }
 
+    map<int, string> samples;
+    vector<int>      sample_ids;
+    vector<string>   sample_names;
+    int              sample_id;
+    FilterStage      filter(config, pop_layout, pop_key, whitelist);
 
-int
-apply_locus_constraints(map<int, CSLocus *> &catalog, 
-			PopMap<CSLocus> *pmap, 
-			map<int, pair<int, int> > &pop_indexes)
-{
-    uint pop_id, start_index, end_index;
-    CSLocus *loc;
-    Datum  **d;
+    if (resumed) {
+	if (fckpt.restore(catalog) < 0) {
+	    cerr << "Unable to resume: the checkpoint of the filtering stage does not match the catalog, rerun without --resume.\n";
+	    exit(1);
+	}
+	cerr << "Resuming from the checkpoint of the filtering stage, " << catalog.size() << " loci retained.\n";
 
-    if (sample_limit == 0 && population_limit == 0 && min_stack_depth == 0) return 0;
+	if (fckpt.applied)
+	    cout << fckpt.below_stack_dep << "\n"
+		 << fckpt.below_lnl_thresh << "\n"
+		 << fckpt.constraint_removed << "\n";
+	res = 0;
 
-    map<int, CSLocus *>::iterator it;
-    map<int, pair<int, int> >::iterator pit;
+    } else if (chunk_size == 0 && chunk_by_chr == false) {
+	//
+	// Load matches to the catalog
+	//
+	vector<vector<CatMatch *> > catalog_matches;
+	FilterLog flog(pop_indexes, shard_dir);
+	int       excluded = 0;
+
+	for (int i = 0; i < (int) files.size(); i++) {
+	    vector<CatMatch *> m;
+	    load_catalog_matches(in_path + files[i].second, m);
+
+	    if (m.size() == 0) {
+		cerr << "Warning: unable to find any matches in file '" << files[i].second << "', excluding this sample from population analysis.\n";
+		exclude_sample(i - excluded, pop_indexes, pop_layout);
+		excluded++;
+		continue;
+	    }
 
-    uint pop_cnt   = pop_indexes.size();
-    int *pop_order = new int [pop_cnt];
+	    catalog_matches.push_back(m);
+	    if (samples.count(m[0]->sample_id) == 0) {
+		samples[m[0]->sample_id] = files[i].second;
+		sample_ids.push_back(m[0]->sample_id);
+		sample_names.push_back(files[i].second);
+	    } else {
+		cerr << "Fatal error: sample ID " << m[0]->sample_id << " occurs twice in this data set, likely the pipeline was run incorrectly.\n";
+		exit(0);
+	    }
+	}
 
-    // Which population each sample belongs to.
-    int *samples   = new int [pmap->sample_cnt()];
+	SampleModels models(in_path, sample_names);
+	filter.run(catalog, sample_ids, catalog_matches, models, flog, wl_fh);
 
-    // For the current locus, how many samples in each population.
-    int *pop_cnts  = new int [pop_cnt];
+	res = report_filters(flog, log_fh);
+	fckpt.record(flog.applied, flog.below_stack_dep, flog.below_lnl_thresh, flog.constraint_removed);
 
-    // The total number of samples in each population.
-    int *pop_tot   = new int [pop_cnt];
+    } else {
+	//
+	// Process the catalog out-of-core: stream the matches and model calls of each
+	// sample once into per-chunk spill files, then filter one chunk at a time.
+	//
+	vector<vector<int> > chunks;
+	build_chunks(catalog, chunks);
+
+	stringstream dir;
+	if (shard_cnt > 0)
+	    dir << shard_dir << "/chunks";
+	else
+	    dir << (tmp_path.length() > 0 ? tmp_path : in_path) << "batch_" << batch_id << ".pmerge_chunks";
+	ChunkSpill spill(dir.str(), chunks.size());
+	FilterLog  flog(pop_indexes, shard_cnt > 0 ? shard_dir : dir.str());
+
+	for (uint c = 0; c < chunks.size(); c++)
+	    for (uint j = 0; j < chunks[c].size(); j++)
+		spill.assign(chunks[c][j], c);
+
+	cerr << "Spilling matches and model outputs to " << chunks.size() << " chunks in '" << dir.str() << "'\n";
+	uint model_cnt;
+	int  excluded = 0;
+	for (int i = 0; i < (int) files.size(); i++) {
+	    if (spill_sample(in_path + files[i].second, spill, sample_ids.size(), sample_id, model_cnt) == 0) {
+		cerr << "Warning: unable to find any matches in file '" << files[i].second << "', excluding this sample from population analysis.\n";
+		exclude_sample(i - excluded, pop_indexes, pop_layout);
+		excluded++;
+		continue;
+	    }
 
-    pop_id = 0;
-    for (pit = pop_indexes.begin(); pit != pop_indexes.end(); pit++) {
-	start_index = pit->second.first;
-	end_index   = pit->second.second;
-	pop_tot[pop_id]  = 0;
+	    if (samples.count(sample_id) == 0) {
+		samples[sample_id] = files[i].second;
+		spill.set_model_cnt(sample_ids.size(), model_cnt);
+		sample_ids.push_back(sample_id);
+	    } else {
+		cerr << "Fatal error: sample ID " << sample_id << " occurs twice in this data set, likely the pipeline was run incorrectly.\n";
+		exit(0);
+	    }
 
-	for (uint i = start_index; i <= end_index; i++) {
-	    samples[i] = pop_id;
-	    pop_tot[pop_id]++;
+	    if (model_cnt == 0)
+		cerr << "Warning: unable to find any model results in file '" << files[i].second << "', excluding this sample from population analysis.\n";
 	}
-	pop_order[pop_id] = pit->first;
-	pop_id++;
-    }
-
-    for (uint i = 0; i < pop_cnt; i++)
-	pop_cnts[i] = 0;
+	spill.flush();
 
-    double pct       = 0.0;
-    bool   pop_limit = false;
-    int    pops      = 0;
-    int    below_stack_dep  = 0;
-    uint   below_lnl_thresh = 0;
-    set<int> blacklist;
+	map<int, PLocus *> kept;
+	for (uint c = 0; c < chunks.size(); c++) {
+	    map<int, PLocus *> chunk;
+	    for (uint j = 0; j < chunks[c].size(); j++)
+		chunk[chunks[c][j]] = catalog[chunks[c][j]];
 
-    for (it = catalog.begin(); it != catalog.end(); it++) {
-	loc = it->second;
-	d   = pmap->locus(loc->id);
+	    cerr << "Processing chunk " << c + 1 << " of " << chunks.size() << ", " << chunk.size() << " loci.\n";
 
-	for (int i = 0; i < pmap->sample_cnt(); i++) {
-	    //
-	    // Check that each sample is over the minimum stack depth for this locus.
-	    //
-	    if (d[i] != NULL && 
-		min_stack_depth > 0 && 
-		d[i]->tot_depth < min_stack_depth) {
-		below_stack_dep++;
-		delete d[i];
-		d[i] = NULL;
-		loc->hcnt--;
-	    }
+	    vector<vector<CatMatch *> > catalog_matches;
+	    spill.load_matches(c, sample_ids.size(), catalog_matches);
+	    ModelSource *models = spill.models(c);
 
-	    //
-	    // Check that each sample is over the log likelihood threshold.
-	    //
-	    if (d[i] != NULL && 
-		filter_lnl   && 
-		d[i]->lnl < lnl_limit) {
-		below_lnl_thresh++;
-		delete d[i];
-		d[i] = NULL;
-		loc->hcnt--;
-	    }
-	}
+	    filter.run(chunk, sample_ids, catalog_matches, *models, flog, wl_fh);
+	    kept.insert(chunk.begin(), chunk.end());
 
-	//
-	// Tally up the count of samples in this population.
-	//
-	for (int i = 0; i < pmap->sample_cnt(); i++) {
-	    if (d[i] != NULL)
-		pop_cnts[samples[i]]++;
+	    delete models;
 	}
+	catalog.swap(kept);
 
-	//
-	// Check that the counts for each population are over sample_limit. If not, zero out 
-	// the members of that population.
-	//
-	for (uint i = 0; i < pop_cnt; i++) {
-	    pct = (double) pop_cnts[i] / (double) pop_tot[i];
-
-	    if (pop_cnts[i] > 0 && pct < sample_limit) {
-		//cerr << "Removing population " << pop_order[i] << " at locus: " << loc->id << "; below sample limit: " << pct << "\n";
-		start_index = pop_indexes[pop_order[i]].first;
-		end_index   = pop_indexes[pop_order[i]].second;
-
-		for (uint j  = start_index; j <= end_index; j++) {
-		    if (d[j] != NULL) {
-			delete d[j];
-			d[j] = NULL;
-			loc->hcnt--;
-		    }
-		}
-		pop_cnts[i] = 0;
-	    }
-	}
+	cerr << "Processed " << chunks.size() << " chunks: pruned " << flog.pruned_snps << " variant sites, removed " 
+	     << flog.constraint_removed + flog.pruned_loci << " loci, retained " << flog.retained << " loci.\n";
 
-	//
-	// Check that this locus is present in enough populations.
-	//
-	for (uint i = 0; i < pop_cnt; i++)
-	    if (pop_cnts[i] > 0) pops++;
-	if (pops < population_limit) {
-	    //cerr << "Removing locus: " << loc->id << "; below population limit: " << pops << "\n";
-	    pop_limit = true;
-	}
+	res = report_filters(flog, log_fh);
+	fckpt.record(flog.applied, flog.below_stack_dep, flog.below_lnl_thresh, flog.constraint_removed);
+    }
+    wl_fh.close();
 
-	if (pop_limit)
-	    blacklist.insert(loc->id);
+    //
+    // No loci passed the sample/population constraints, or this is a shard whose
+    // loci will be clustered once all shards have been merged.
+    //
+    if (res < 0)
+	exit(0);
+    if (shard_cnt > 0)
+	return write_loci(catalog, shard_dir + "/retained");
+
+    if (checkpoints && config.cluster_similarity > 0.0 && resumed == false && catalog.size() > 0) {
+	log_fh.flush();
+	fckpt.log_len = log_fh.tellp();
+	if (fckpt.save(checkpoint_path("filter.ckpt"), filter_key(files), catalog))
+	    cerr << "Wrote the checkpoint of the filtering stage.\n";
+    }
 
-	for (uint i = 0; i < pop_cnt; i++)
-	    pop_cnts[i] = 0;
-	pop_limit = false;
-	pops      = 0;
+    blacklist.clear();    
+    if ( config.cluster_similarity > 0.0)
+    {
+	int cluster_filtering = cluster_filter (catalog,blacklist,log_fh,wl_path); 
+	cerr << "Removing " << blacklist.size() << " additional loci which are clustered within the specified threshold...";
     }
 
+    if (checkpoints)
+	remove_checkpoints();
+}
+
+//
+// Record the filtering tallies and write the log sections collected while processing loci.
+// Returns -1 if no loci passed the sample/population constraints.
+//
+int
+report_filters(FilterLog &flog, ofstream &log_fh)
+{
     //
-    // Remove loci
+    // A shard saves its tallies to be reported by the merge.
     //
-    if (min_stack_depth > 0) 
-        {
-	cerr << "Removed " << below_stack_dep << " samples from loci that are below the minimum stack depth of " << min_stack_depth << "x\n";
-        
-        }
-    cout <<below_stack_dep << "\n";
-    if (filter_lnl)
-        {
-	cerr << "Removed " << below_lnl_thresh << " samples from loci that are below the log likelihood threshold of " << lnl_limit << "\n";
-        
-        }
-    cout <<below_lnl_thresh << "\n";
-    cerr << "Removing " << blacklist.size() << " loci that did not pass sample/population constraints...";
-    cout << blacklist.size() << "\n";
-    set<int> whitelist;
-    reduce_catalog(catalog, whitelist, blacklist);
-    int retained = pmap->prune(blacklist);
-    cerr << " retained " << retained << " loci.\n";
+    if (shard_cnt > 0)
+	return flog.save();
 
-    delete [] pop_cnts;
-    delete [] pop_tot;
-    delete [] pop_order;
-    delete [] samples;
+    if (flog.applied) {
+	cout << flog.below_stack_dep << "\n"
+	     << flog.below_lnl_thresh << "\n"
+	     << flog.constraint_removed << "\n";
 
-    if (retained == 0)
-	exit(0);
+	if (flog.constraint_retained == 0)
+	    return -1;
+    }
+
+    flog.write(log_fh, config);
 
     return 0;
 }
 
 
-
-bool 
-order_unordered_loci(map<int, CSLocus *> &catalog) 
+//
+// Divide the catalog into chunks of at most chunk_size loci in catalog ID order or,
+// for a reference aligned catalog, into chunks made of whole chromosomes.
+//
+int
+build_chunks(map<int, PLocus *> &catalog, vector<vector<int> > &chunks)
 {
-    map<int, CSLocus *>::iterator it;
-    CSLocus *loc;
-    set<string> chrs;
+    map<int, PLocus *>::iterator it;
 
-    for (it = catalog.begin(); it != catalog.end(); it++) {
-	loc = it->second;
-	if (strlen(loc->loc.chr) > 0) 
-	    chrs.insert(loc->loc.chr);
+    if (chunk_by_chr == false) {
+	for (it = catalog.begin(); it != catalog.end(); it++) {
+	    if (chunks.size() == 0 || chunks.back().size() >= (uint) chunk_size)
+		chunks.push_back(vector<int>());
+	    chunks.back().push_back(it->first);
+	}
+	return chunks.size();
     }
 
-    //
-    // This data is already reference aligned.
-    //
-    if (chrs.size() > 0)
-	return true;
+    map<string, vector<int> > chrs;
+    map<string, vector<int> >::iterator cit;
 
-    cerr << "Catalog is not reference aligned, arbitrarily ordering catalog loci.\n";
+    for (it = catalog.begin(); it != catalog.end(); it++)
+	chrs[it->second->loc.chr].push_back(it->first);
 
-    uint bp = 1;
-    for (it = catalog.begin(); it != catalog.end(); it++) {
-	loc = it->second;
-	loc->loc.chr = new char[3];
-	strcpy(loc->loc.chr, "un");
-	loc->loc.bp  = bp;
-
-	bp += strlen(loc->con);
+    for (cit = chrs.begin(); cit != chrs.end(); cit++) {
+	if (chunks.size() == 0 || chunk_size == 0 ||
+	    chunks.back().size() + cit->second.size() > (uint) chunk_size)
+	    chunks.push_back(vector<int>());
+	chunks.back().insert(chunks.back().end(), cit->second.begin(), cit->second.end());
     }
 
-    return false;
+    return chunks.size();
 }
 
 
@@ -627,7 +563,8 @@ int load_marker_column_list(string path, map<int, set<int> > &list) {
 int 
 build_file_list(vector<pair<int, string> > &files, 
 		map<int, pair<int, int> > &pop_indexes, 
-		map<int, vector<int> > &grp_members) 
+		map<int, vector<int> > &grp_members,
+		PopLayout &layout) 
 {
     char             line[max_len];
     vector<string>   parts;
@@ -778,42 +715,29 @@ build_file_list(vector<pair<int, string> > &files,
 	return 0;
     }
 
-    //
-    // Sort the files according to population ID.
-    //
-    sort(files.begin(), files.end(), compare_pop_map);
-
     cerr << "Found " << files.size() << " input file(s).\n";
 
     //
-    // Determine the start/end index for each population in the files array.
+    // Sort the files according to population ID, and determine the start/end index for
+    // each population in the files array.
     //
-    int start  = 0;
-    int end    = 0;
-    int pop_id = files[0].first;
-
-    do {
-	end++;
-	if (pop_id != files[end].first) {
-	    pop_indexes[pop_id] = make_pair(start, end - 1);
-	    start  = end;
-	    pop_id = files[end].first;
-	}
-    } while (end < (int) files.size());
+    index_populations(files, pop_indexes);
+    layout.build(pop_indexes);
 
     pop_indexes.size() == 1 ?
 	cerr << "  " << pop_indexes.size() << " population found\n" :
 	cerr << "  " << pop_indexes.size() << " populations found\n";
 
-    if (population_limit > (int) pop_indexes.size()) {
+    if (config.population_limit > (int) pop_indexes.size()) {
 	cerr << "Population limit (" 
-	     << population_limit 
+	     << config.population_limit 
 	     << ") larger than number of popualtions present, adjusting parameter to " 
 	     << pop_indexes.size() << "\n";
-	population_limit = pop_indexes.size();
+	config.population_limit = pop_indexes.size();
     }
 
     map<int, pair<int, int> >::iterator it;
+    int start, end;
     for (it = pop_indexes.begin(); it != pop_indexes.end(); it++) {
 	start = it->second.first;
 	end   = it->second.second;
@@ -851,336 +775,937 @@ build_file_list(vector<pair<int, string> > &files,
     return 1;
 }
 
-bool compare_pop_map(pair<int, string> a, pair<int, string> b) {
-    if (a.first == b.first)
-	return (a.second < b.second);
-    return (a.first < b.first);
-}
 
 
 
-int cluster_filter(map<int, CSLocus *> &catalog, 
+
+int cluster_filter(map<int, PLocus *> &catalog, 
 			set<int> &blacklist,ofstream &log_fh,
 			string wl_path)
-
 {
-   Tag *tag, *tag_1, *tag_2; 
-   vector<int> keys;   
-   int i =0, het_count = 0, loci_count = 0, non_clustered_count = 0, clustered_count = 0;
-   map<int, Tag *> tags;
-   map<int, std::vector<int> > merged;
-   map<int, std::vector<int> >::iterator merged_it;
-   vector<int>::iterator vec_it;
-   vector<pair<int, int> >::iterator dist_it;
-   map<int, Tag *>::iterator tags_it;
-   map<int, int>::iterator psv_it;
-   vector<int> het_counter;
-   vector<int>::iterator hc_it;
-   map<int, CSLocus *>::iterator it;
-   CSLocus *loc; 
-   loci_count =  catalog.size();
-   int mismatches = 0, seq_len =0;
-
-   loc = catalog.begin() ->second;
-   seq_len = string(loc -> con).length();
-   mismatches = seq_len - (cluster_similarity*seq_len);
-   ofstream wl_fh(wl_path.c_str(), ofstream::out);
-    if (wl_fh.fail()) {
-        cerr << "Error opening WL file '" << wl_path << "'\n";
-	exit(1);
+    SeedIndexFile idx_file;
+    PackedSeqs    seqs;
+    SeedIndex     idx;
+    ClusterState  state;
+    vector<uint>  members;
+    vector<Edge>  edges;
+    int mismatches = cluster_distance(catalog, config.cluster_similarity);
+
+    //
+    // When a hierarchy is requested, search out to the lowest similarity it covers,
+    // and cluster at the requested similarity from the same pairs.
+    //
+    int search = hierarchy_similarity > 0.0 ? cluster_distance(catalog, hierarchy_similarity) : mismatches;
+
+    cerr << "Clustering loci for paralog filtering" << "\n";
+    prepare_clustering(catalog, search, seqs, idx, state, idx_file, members);
+
+    //
+    // Clustering may be limited to the loci scored as likely paralogs by their excess of
+    // heterozygotes: only pairs involving such a locus are searched for.
+    //
+    vector<bool> priority;
+    if (config.het_priority) {
+	uint cnt = ClusterStage(config).priority(catalog, seqs, members, priority);
+	cerr << "  Searching pairs of " << cnt << " of " << members.size() 
+	     << " loci with an excess of heterozygotes of at least " << config.het_cluster_limit << ".\n";
     }
-   cerr << "Clustering loci for paralog filtering" << "\n";
-    for (it = catalog.begin(); it != catalog.end(); it++) {
-        loc = it->second;
-        if (loc->snps.size() != 0) {
-         het_counter.push_back(loc -> id);
-        }
-        tag = new Tag;
-        tag -> id = loc -> id;
-        tag -> seq= loc -> con;
-        tag -> len= tag -> seq.length();
-        tags[i] = tag;
-        keys.push_back(i);
-        i++;
-
-      }
-
-    #pragma omp parallel private(tag_1, tag_2)
-    { 
-      #pragma omp for  schedule(dynamic) 
-        
-	for (int i = 0; i < keys.size(); i++) {
-             if (i % 100 == 0) cerr << "Calculationg distances for loci# " << i << "       \r";
-            tag_1 = tags[keys[i]];
-            int d;
-            for (int j = i; j < keys.size(); j++) {
-            tag_2 = tags[keys[j]];
-            if ( tag_1 == tag_2) d = 0;
-            else d = dist(tag_1, tag_2, mismatches); 
-            if ( d != -1) tag_1->add_dist(j, d);
-            }               
-           
-           }  
-      
-
-  }
-
-
-for (tags_it = tags.begin(); tags_it != tags.end(); tags_it++)
-{
-  
- for (dist_it = tags_it->second->dist.begin(); dist_it != tags_it->second->dist.end(); dist_it++)
-{
-  if ( dist_it->second <= mismatches)
- {
-  merged[tags_it->first].push_back(dist_it->first);
-  if (tags_it->first != dist_it->first)
-  merged[dist_it->first].push_back(tags_it->first);
-  
- }
-}
 
-}
-int size =0, li =0, j=0;
-for (int k=0; k < merged.size(); k++)
-{   
-size =  merged[k].size();
-	for ( int i =0; i < size; i++)
-	   {
-		li = merged[k].at(i);
-		if ( k == li) continue;
-		if (merged[li].size() > 1)
-		{
-		merged[k].insert( merged[k].end(), merged[li].begin(), merged[li].end());
-		merged[li].clear();
-		std::sort( merged[k].begin(), merged[k].end() );
-		merged[k].erase( std::unique( merged[k].begin(), merged[k].end() ), merged[k].end() );
-		size =  merged[k].size();
-		i = 0;
-		}
-	   }  
-}
+    cluster_edges(seqs, idx, state, members, search, 0, 1, edges, config.het_priority ? &priority : NULL);
 
-for (merged_it = merged.begin(); merged_it != merged.end(); merged_it++)
-{   
+    if (hierarchy_similarity > 0.0) {
+	vector<int> dists(edges.size());
 
-j++;
+	#pragma omp parallel for schedule(static)
+	for (uint e = 0; e < edges.size(); e++)
+	    dists[e] = seqs.dist(edges[e].first, edges[e].second, search);
 
- if (merged_it ->second.size() == 1) 
-{
-wl_fh << tags [merged_it->first]->id << "\n";
-non_clustered_count++;
-}
- else if (merged_it ->second.size() > 1)
-  {
-     
-    hc_it = find(het_counter.begin(),het_counter.end(),tags [merged_it->first]->id );
-    if ( hc_it != het_counter.end()) het_count++;
-    blacklist.insert(tags [merged_it->first]->id);  
-    for (vec_it = merged_it->second.begin(); vec_it != merged_it->second.end(); vec_it++)
-     {   
-     	if(merged_it ->first != *vec_it)
-    	 { 
-              hc_it = find(het_counter.begin(),het_counter.end(),tags [*vec_it]->id);
-              if ( hc_it != het_counter.end()) het_count++;
-               blacklist.insert(tags [*vec_it]->id); 
-         	 
-     	 }
+	stringstream path;
+	path << in_path << "batch_" << batch_id << ".pmerge.hierarchy.tsv";
+	write_hierarchy(catalog, seqs, edges, dists, search, path.str());
+
+	uint k = 0;
+	for (uint e = 0; e < edges.size(); e++)
+	    if (dists[e] <= mismatches)
+		edges[k++] = edges[e];
+	edges.resize(k);
     }
-   
-  }
- 
- 
-}
-clustered_count = loci_count - non_clustered_count;
-log_fh << "\n#\n# Cluster filtering stats \n#\n";
-log_fh << "Number of Non-clustered loci" <<"\t"<< non_clustered_count << "\n";  
-log_fh << "Number of clustered loci" <<"\t"<< clustered_count<< "\n";  
-log_fh << "Number of polymorphic loci in the clustered loci" <<"\t"<< het_count << "\n";
-log_fh << "Number of fixed loci in the clustered loci" <<"\t"<< clustered_count - het_count << "\n";    
-return 0;
-}	
 
+    return write_clusters(catalog, seqs, members, edges, blacklist, log_fh, wl_path);
+}
 
-		
+//
+// Write the single-linkage hierarchy of the catalog loci. Pairs of loci are taken in
+// order of increasing distance and joined with union-find; each pair joining two
+// clusters is a merge event. A locus has a neighbour within a distance d exactly when
+// it takes part in a merge event at distance d or less, so the whitelist for any
+// similarity down to the one searched can be extracted from the events alone:
+//   # seq_len<tab><length>
+//   # max_dist<tab><distance searched>
+//   locus<tab><catalog ID><tab><SNP count>
+//   merge<tab><distance><tab><catalog ID><tab><catalog ID>
+//
 int
-prune_polymorphic_sites(map<int, CSLocus *> &catalog, 
-			PopMap<CSLocus> *pmap,
-			PopSum<CSLocus> *psum,
-			map<int, pair<int, int> > &pop_indexes, 
-			map<int, set<int> > &whitelist,set<int> &blacklist,
-			ofstream &log_fh, string wl_path)
+write_hierarchy(map<int, PLocus *> &catalog, PackedSeqs &seqs,
+		vector<Edge> &edges, vector<int> &dists, int max_dist, string path)
 {
-    map<int, set<int> > new_wl;
-    vector<int> pop_prune_list;
-    CSLocus  *loc;
-    LocTally *t;
-    LocSum  **s;
-    Datum   **d;
-    bool      sample_prune, maf_prune, inc_prune, het_prune;
-    int       size, pruned = 0;
-    uint      pop_id, start_index, end_index;
-    ofstream wl_fh(wl_path.c_str(), ofstream::out);
-    if (wl_fh.fail()) {
-        cerr << "Error opening WL file '" << wl_path << "'\n";
+    map<int, PLocus *>::iterator it;
+    vector<pair<int, uint> > order(edges.size());
+    UnionFind sets(seqs.size());
+    uint events = 0;
+
+    for (uint e = 0; e < edges.size(); e++)
+	order[e] = make_pair(dists[e], e);
+    sort(order.begin(), order.end());
+
+    ofstream fh(path.c_str(), ofstream::out);
+    if (fh.fail()) {
+        cerr << "Error opening hierarchy file '" << path << "'\n";
 	exit(1);
     }
-	log_fh << "\n#\n# List of pruned nucleotide sites\n#\n"
-	       << "# Action\tLocus ID\tChr\tBP\tColumn\tReason\n";
-      
-	//
-	// iterate over the catalog.
-	//
-	map<int, CSLocus *>::iterator it;
-	for (it = catalog.begin(); it != catalog.end(); it++) {
-	    loc = it->second;
 
-	    //
-	    // If this locus is fixed, don't try to filter it out.
-	    //
-	    if (loc->snps.size() == 0) {
-		new_wl.insert(make_pair(loc->id, std::set<int>()));
-		continue;
-	    }
+    fh << "# seq_len\t" << strlen(catalog.begin()->second->con) << "\n"
+       << "# max_dist\t" << max_dist << "\n";
 
-	    t = psum->locus_tally(loc->id);
-	    s = psum->locus(loc->id);
+    for (it = catalog.begin(); it != catalog.end(); it++)
+	fh << "locus\t" << it->first << "\t" << it->second->snp_cnt << "\n";
 
-	    for (uint i = 0; i < loc->snps.size(); i++) {
+    for (uint k = 0; k < order.size(); k++) {
+	Edge &e = edges[order[k].second];
+	if (sets.unite(e.first, e.second)) {
+	    fh << "merge\t" << order[k].first << "\t" << seqs.ids[e.first] << "\t" << seqs.ids[e.second] << "\n";
+	    events++;
+	}
+    }
 
-		//
-		// If the site is fixed, ignore it.
-		//
-		if (t->nucs[loc->snps[i]->col].fixed == true)
-		    {
-                   new_wl.insert(make_pair(loc->id, std::set<int>()));
-		   continue;
-                    }
-
-		sample_prune = false;
-		maf_prune    = false;
-		inc_prune    = false;
-                het_prune    = false;
-		pop_prune_list.clear();
-		
-		for (int j = 0; j < psum->pop_cnt(); j++) {
-		    pop_id = psum->rev_pop_index(j);
-
-		    if (s[j]->nucs[loc->snps[i]->col].incompatible_site)
-			inc_prune = true;
-		    else if (s[j]->nucs[loc->snps[i]->col].num_indv == 0 ||
-			     (double) s[j]->nucs[loc->snps[i]->col].num_indv / (double) psum->pop_size(pop_id) < sample_limit)
-			pop_prune_list.push_back(pop_id);
-		}
+    fh.close();
 
-		//
-		// Check how many populations have to be pruned out due to sample limit. If less than
-		// population limit, prune them; if more than population limit, mark locus for deletion.
-		//
-		if ((psum->pop_cnt() - pop_prune_list.size()) < (uint) population_limit) {
-		    sample_prune = true;
-		} else {
-		    for (uint j = 0; j < pop_prune_list.size(); j++) {
-			if (s[psum->pop_index(pop_prune_list[j])]->nucs[loc->snps[i]->col].num_indv == 0) continue;
-			
-		    	start_index = pop_indexes[pop_prune_list[j]].first;
-		    	end_index   = pop_indexes[pop_prune_list[j]].second;
-		    	d           = pmap->locus(loc->id);
-
-			for (uint k = start_index; k <= end_index; k++) {
-			    if (d[k] == NULL || loc->snps[i]->col >= (uint) d[k]->len) 
-				continue;
-			    if (d[k]->model != NULL) {
-				d[k]->model[loc->snps[i]->col] = 'U';
-			    }
-			}
-		    }
-		}
-		
-		if (t->nucs[loc->snps[i]->col].allele_cnt > 1) {
-		    //
-		    // Test for minor allele frequency.
-		    //
-		    if ((1 - t->nucs[loc->snps[i]->col].p_freq) < minor_allele_freq)
-                       {
-			maf_prune = true;
-                       
-                        }
-		    //
-		    // Test for observed heterozygosity.
-		    //
-		    if (t->nucs[loc->snps[i]->col].obs_het > max_obs_het)
-                        {
-		    	het_prune = true;
-                       
-                        }
-		}
+    cerr << "  Wrote " << events << " merge events of " << catalog.size() << " loci, down to " 
+	 << max_dist << " mismatches, to '" << path << "'\n";
 
-		if (maf_prune == false && het_prune == false && sample_prune == false && inc_prune == false) {
-		    new_wl[loc->id].insert(loc->snps[i]->col);
-		} else {
-		    pruned++;
-		    if (verbose) {
-			log_fh << "pruned_polymorphic_site\t"
-			       << loc->id << "\t"
-			       << loc->loc.chr << "\t"
-			       << loc->sort_bp(loc->snps[i]->col) << "\t"
-			       << loc->snps[i]->col << "\t"; 
-			if (inc_prune)
-			    log_fh << "incompatible_site\n";
-			else if (sample_prune)
-			    log_fh << "sample_limit\n";
-			else if (maf_prune)
-			    log_fh << "maf_limit\n";
-			else if (het_prune)
-			    log_fh << "obshet_limit\n";
-			else
-			    log_fh << "unknown_reason\n";
-		    }
-		}
-	    }
+    return events;
+}
 
-	    //
-	    // If no SNPs were retained for this locus, then mark it to be removed entirely.
-	    //
-	    if (new_wl.count(loc->id) == 0) {
-		    log_fh << "removed_locus\t"
-			   << loc->id << "\t"
-			   << loc->loc.chr << "\t"
-			   << loc->sort_bp() << "\t"
-			   << 0 << "\tno_snps_remaining\n";
-		blacklist.insert(loc->id);
-                
+//
+// Whitelist the loci of a stored hierarchy that have no neighbour within the
+// distance given by the cluster similarity, without reloading or comparing any
+// loci. The cluster statistics are written to their own log.
+//
+int
+query_hierarchy(int argc, char **argv)
+{
+    stringstream path, wl, log;
+    path << in_path << "batch_" << batch_id << ".pmerge.hierarchy.tsv";
+    wl   << in_path << "batch_" << batch_id << ".WL";
+    log  << in_path << "batch_" << batch_id << ".pmerge.hierarchy.log";
+
+    ifstream fh(path.str().c_str(), ifstream::in);
+    if (fh.fail()) {
+        cerr << "Error opening hierarchy file '" << path.str() << "'\n";
+	exit(1);
+    }
+
+    vector<pair<int, int> > loci;  // Catalog ID, SNP count.
+    set<int> clustered;
+    vector<string> parts;
+    string line;
+    int seq_len = 0, max_dist = -1, mismatches = -1;
+
+    while (getline(fh, line)) {
+	parse_tsv(line.c_str(), parts);
+
+	if (parts[0] == "# seq_len") {
+	    seq_len    = atoi(parts[1].c_str());
+	    mismatches = similarity_distance(seq_len, config.cluster_similarity);
+	} else if (parts[0] == "# max_dist") {
+	    max_dist = atoi(parts[1].c_str());
+	    if (mismatches > max_dist) {
+		cerr << "The hierarchy in '" << path.str() << "' only extends to " << max_dist 
+		     << " mismatches, " << mismatches << " are needed for a cluster similarity of " << config.cluster_similarity << ".\n";
+		exit(1);
 	    }
-           else
-              {
-                  wl_fh << loc->id << "\n";
-              }
+	} else if (parts[0] == "locus") {
+	    loci.push_back(make_pair(atoi(parts[1].c_str()), atoi(parts[2].c_str())));
+	} else if (parts[0] == "merge") {
+	    if (atoi(parts[1].c_str()) > mismatches)
+		break;
+	    clustered.insert(atoi(parts[2].c_str()));
+	    clustered.insert(atoi(parts[3].c_str()));
 	}
-     
-    return pruned;
+    }
+    fh.close();
+
+    if (max_dist < 0) {
+	cerr << "Unable to parse hierarchy file '" << path.str() << "'\n";
+	exit(1);
+    }
+
+    ofstream log_fh(log.str().c_str(), ofstream::out);
+    ofstream wl_fh(wl.str().c_str(), ofstream::out);
+    if (log_fh.fail() || wl_fh.fail()) {
+        cerr << "Error opening output files in '" << in_path << "'\n";
+	exit(1);
+    }
+    init_log(log_fh, argc, argv);
+
+    int het_count = 0, non_clustered_count = 0;
+    for (uint i = 0; i < loci.size(); i++) {
+	if (clustered.count(loci[i].first) == 0) {
+	    wl_fh << loci[i].first << "\n";
+	    non_clustered_count++;
+	} else if (loci[i].second != 0) {
+	    het_count++;
+	}
+    }
+
+    cerr << "Extracted " << non_clustered_count << " loci not clustered within " << mismatches 
+	 << " mismatches from '" << path.str() << "'\n";
+
+    return write_cluster_stats(log_fh, non_clustered_count, loci.size() - non_clustered_count, het_count);
 }
 
+//
+// Pack the consensus sequences of the catalog and build their seed index. If a seed
+// index file was requested it is mapped instead, along with the clustering state of
+// the indexed catalog. An index built from an earlier version of the catalog is
+// brought up to date by comparing only the loci that are new or have changed, and
+// written back for later runs. The positions of the catalog loci among the packed
+// sequences are returned in members.
+//
+int
+prepare_clustering(map<int, PLocus *> &catalog, int mismatches, PackedSeqs &seqs, SeedIndex &idx, 
+		   ClusterState &state, SeedIndexFile &idx_file, vector<uint> &members)
+{
+    map<int, PLocus *>::iterator it;
+    int k;
 
+    members.clear();
 
+    if (index_path.length() == 0) {
+	seqs.build(catalog);
+	idx.build(seqs, mismatches);
+	for (uint i = 0; i < seqs.size(); i++)
+	    members.push_back(i);
+	return members.size();
+    }
 
-int parse_command_line(int argc, char* argv[]) {
-    int c;
-     
-    while (1) {
-	static struct option long_options[] = {
-	    {"num_threads",    required_argument, NULL, 't'},
-	    {"batch_id",       required_argument, NULL, 'b'},
-	    {"progeny",        required_argument, NULL, 'r'},
-	    {"min_populations",   required_argument, NULL, 'p'},
-            {"in_path",        required_argument, NULL, 'P'},
-             {"out_path",        required_argument, NULL, 'o'},
+    uint64_t stamp  = catalog_stamp();
+    bool     usable = idx_file.open(index_path, seqs, idx, state) && idx.max_dist == mismatches;
+    bool     valid  = usable && idx_file.stamp == stamp && seqs.size() == index_catalog.size();
+
+    for (it = index_catalog.begin(); valid && it != index_catalog.end(); it++)
+	if ((k = seqs.index(it->first)) < 0)
+	    valid = false;
+	else
+	    seqs.cons[k] = it->second->con;
+
+    if (valid) {
+	cerr << "  Opened seed index '" << index_path << "' of " << seqs.size() << " loci in " 
+	     << state.clusters() << " clusters.\n";
+    } else {
+	//
+	// The mapped index, if any, is kept as the previous state while every locus of
+	// the catalog is indexed, not only those retained by the filters, so that the
+	// index can be reused by runs with other filtering parameters.
+	//
+	PackedSeqs   prev_seqs;
+	ClusterState prev_state;
+	vector<Edge> edges;
+
+	prev_seqs.swap(seqs);
+	prev_state.swap(state);
+	seqs.build(index_catalog);
+	idx.build(seqs, mismatches);
+
+	if (usable) {
+	    int changed = update_edges(prev_seqs, prev_state, seqs, idx, mismatches, config.use_vptree, edges);
+	    cerr << "  Updated seed index '" << index_path << "' with " << changed << " new or changed loci.\n";
+	} else {
+	    for (uint i = 0; i < seqs.size(); i++)
+		members.push_back(i);
+	    cluster_edges(seqs, idx, state, members, mismatches, 0, 1, edges);
+	    members.clear();
+	}
+
+	idx_file.close();
+	state.build(seqs.size(), edges);
+
+	if (SeedIndexFile::write(index_path, stamp, seqs, idx, state))
+	    cerr << "  Wrote seed index '" << index_path << "' of " << seqs.size() << " loci in " 
+		 << state.clusters() << " clusters.\n";
+    }
+
+    for (it = catalog.begin(); it != catalog.end(); it++)
+	members.push_back(seqs.index(it->first));
+
+    return members.size();
+}
+
+//
+// Estimate the fraction of clustered loci, and the time a full clustering run would
+// take, from the neighbours of a random sample of the catalog loci found with the seed
+// index. Each pair of the full run is compared once, so comparing the sample with the
+// whole catalog costs sample / (loci / 2) of the comparisons of a full run. All loci
+// of the catalog are considered, as the filtering stages are not run.
+//
+int
+estimate_clusters(int argc, char **argv)
+{
+    stringstream log;
+    log << in_path << "batch_" << batch_id << ".pmerge.estimate.log";
+    ofstream log_fh(log.str().c_str(), ofstream::out);
+    if (log_fh.fail()) {
+        cerr << "Error opening log file '" << log.str() << "'\n";
+	exit(1);
+    }
+    init_log(log_fh, argc, argv);
+
+    map<int, PLocus *> catalog;
+    LocusArena arena;
+    if (load_batch_catalog(catalog, arena) == 0)
+	return 0;
+
+    PackedSeqs   seqs;
+    SeedIndex    idx;
+    vector<uint> members, sample;
+    int    mismatches = cluster_distance(catalog, config.cluster_similarity);
+    int    search     = hierarchy_similarity > 0.0 ? cluster_distance(catalog, hierarchy_similarity) : mismatches;
+    uint   threads    = 1;
+    double start, index_secs, sort_secs, bucket_secs, search_secs;
+
+    #ifdef _OPENMP
+    threads = omp_get_max_threads();
+    #endif
+
+    start = wall_time();
+    seqs.build(catalog);
+    idx.build(seqs, search);
+    for (uint i = 0; i < seqs.size(); i++)
+	members.push_back(i);
+    index_secs = wall_time() - start;
+
+    //
+    // A full seeded search sorts every locus by each seed segment in turn.
+    //
+    start = wall_time();
+    if (idx.segs > 0) {
+	vector<pair<uint64_t, uint> > bucket;
+	for (uint i = 0; i < members.size(); i++)
+	    bucket.push_back(make_pair(idx.hash(members[i], 0), members[i]));
+	sort(bucket.begin(), bucket.end());
+    }
+    sort_secs = wall_time() - start;
+
+    sample_members(members, estimate_cnt, sample);
+    SampleSearch ss(seqs, idx, members, sample);
+
+    start = wall_time();
+    ss.bucket();
+    bucket_secs = wall_time() - start;
+
+    start = wall_time();
+    ss.search(search);
+    search_secs = wall_time() - start;
+
+    double n     = members.size();
+    double s     = sample.size();
+    double scale = n / (2.0 * s);
+    uint   para  = idx.segs < threads ? idx.segs : threads;
+    double full  = index_secs + (para > 0 ? idx.segs * sort_secs / para : 0.0) + search_secs * scale;
+
+    vector<uint> within(search + 1, 0);
+    for (uint k = 0; k < sample.size(); k++)
+	if (ss.nearest[k] >= 0)
+	    within[ss.nearest[k]]++;
+    for (int d = 1; d <= search; d++)
+	within[d] += within[d - 1];
+
+    double p  = within[mismatches] / s;
+    double ci = n > 1 ? 1.96 * sqrt(p * (1.0 - p) / s * (n - s) / (n - 1)) : 0.0;
+
+    stringstream out;
+    out << "\n#\n# Cluster estimate \n#\n"
+	<< "Number of loci" << "\t" << members.size() << "\n"
+	<< "Number of sampled loci" << "\t" << sample.size() << "\n"
+	<< "Maximum number of mismatches" << "\t" << mismatches << "\n"
+	<< "Number of seed segments" << "\t" << idx.segs << "\n"
+	<< "Estimated fraction of clustered loci" << "\t" << p << " +/- " << ci << "\n"
+	<< "Estimated number of clustered loci" << "\t" << (uint) (p * n + 0.5) << "\n"
+	<< "Estimated candidate pairs compared" << "\t" << (uint64_t) (ss.candidates * scale) << "\n"
+	<< "Estimated time with " << threads << " threads" << "\t" << full << "s\n"
+	<< "Time of the estimate" << "\t" << index_secs + sort_secs + bucket_secs + search_secs << "s\n"
+	<< "\n# Mismatches\tSampled pairs\tFraction of loci clustered within\n";
+    for (int d = 0; d <= search; d++)
+	out << d << "\t" << ss.pairs[d] << "\t" << within[d] / s << "\n";
+
+    cerr << out.str();
+    log_fh << out.str();
+
+    if (idx.segs == 0)
+	cerr << "The loci are too short for seed segments at " << search << " mismatches; the estimate assumes all pairs are compared.\n";
+
+    return 0;
+}
+
+//
+// Identify a file by its size and modification time, 0 if it doesn't exist.
+//
+uint64_t
+file_stamp(string path)
+{
+    struct stat sb;
+
+    if (stat(path.c_str(), &sb) != 0)
+	return 0;
+
+    return ((uint64_t) sb.st_size << 32) ^ (uint64_t) sb.st_mtime ^ ((uint64_t) sb.st_mtim.tv_nsec << 16);
+}
+
+//
+// Identify the catalog the seed index was built from by the size and modification
+// time of its tags file.
+//
+uint64_t
+catalog_stamp()
+{
+    stringstream path;
+
+    path << in_path << "batch_" << batch_id << ".catalog.tags.tsv";
+
+    return file_stamp(path.str());
+}
+
+//
+// Path of a checkpoint file, in the checkpoint directory of the batch.
+//
+string
+checkpoint_path(string name)
+{
+    stringstream path;
+    path << in_path << "batch_" << batch_id << ".pmerge_checkpoint";
+
+    if (mkdir(path.str().c_str(), 0755) != 0 && errno != EEXIST) {
+	cerr << "Unable to create checkpoint directory '" << path.str() << "'\n";
+	exit(1);
+    }
+    path << "/" << name;
+
+    return path.str();
+}
+
+//
+// Name of the all-pairs checkpoint of this run; each clustering shard keeps its own.
+//
+string
+pairs_checkpoint()
+{
+    stringstream name;
+    name << "pairs";
+    if (shard_cnt > 0)
+	name << "_" << shard_num;
+    name << ".ckpt";
+
+    return name.str();
+}
+
+//
+// Key of the filtering stage: the catalog, the population map, the match and model
+// files of each sample and every parameter that changes which loci or SNPs are
+// retained. Input files are identified by size and modification time, as the catalog is.
+//
+uint64_t
+filter_key(vector<pair<int, string> > &files)
+{
+    stringstream params;
+    params << catalog_stamp() << "\t" << pmap_path << "\t" << file_stamp(pmap_path) << "\t";
+    for (uint i = 0; i < files.size(); i++) {
+	string f = in_path + files[i].second;
+	params << files[i].first << "\t" << files[i].second << "\t" 
+	       << (file_stamp(f + ".matches.tsv") ^ file_stamp(f + ".matches.tsv.gz")) << "\t" 
+	       << (file_stamp(f + ".tags.tsv") ^ file_stamp(f + ".tags.tsv.gz")) << "\t";
+    }
+    params << setprecision(17)
+	   << config.sample_limit << "\t" << config.population_limit << "\t" << config.min_stack_depth << "\t" 
+	   << config.filter_lnl << "\t" << config.lnl_limit << "\t" << config.minor_allele_freq << "\t" << config.max_obs_het << "\t" 
+	   << config.fst_screen_p << "\t" << config.het_excess_limit;
+    string p = params.str();
+
+    return ckpt_hash(p.c_str(), p.length());
+}
+
+//
+// Key of an all-pairs comparison: the catalog, the loci compared, in order, the
+// distance and the shard of the tile pairs.
+//
+uint64_t
+pairs_key(PackedSeqs &seqs, vector<uint> &members, int mismatches, uint shard, uint num_shards)
+{
+    uint64_t stamp = catalog_stamp();
+    uint32_t params[4] = {(uint32_t) mismatches, shard, num_shards, (uint32_t) members.size()};
+    uint64_t key   = ckpt_hash(&stamp, sizeof(stamp));
+
+    key = ckpt_hash(params, sizeof(params), key);
+    for (uint i = 0; i < members.size(); i++)
+	key = ckpt_hash(&seqs.ids[members[i]], sizeof(int), key);
+
+    return key;
+}
+
+//
+// Remove the checkpoints of a run that has completed.
+//
+int
+remove_checkpoints()
+{
+    stringstream dir;
+    dir << in_path << "batch_" << batch_id << ".pmerge_checkpoint";
+
+    remove((dir.str() + "/filter.ckpt").c_str());
+    remove((dir.str() + "/" + pairs_checkpoint()).c_str());
+    rmdir(dir.str().c_str());
+
+    return 0;
+}
+
+//
+// Find the pairs of member loci within the cluster distance of one another, restricted
+// to the given shard of the candidate pairs. The pairs are taken from the clustering
+// state of the seed index if one has been built, otherwise they are searched for,
+// over the loci in order of similarity if requested. If fresh is given, only pairs
+// involving a fresh sequence are returned.
+//
+int
+cluster_edges(PackedSeqs &seqs, SeedIndex &idx, ClusterState &state, vector<uint> &members, 
+	      int mismatches, uint shard, uint num_shards, vector<Edge> &edges, vector<bool> *fresh)
+{
+    if (state.built) {
+	vector<bool> member(seqs.size(), false);
+	for (uint i = 0; i < members.size(); i++)
+	    member[members[i]] = true;
+
+	for (uint e = shard; e < state.n_edges; e += num_shards) {
+	    uint a = state.edges[2 * e];
+	    uint b = state.edges[2 * e + 1];
+	    if (member[a] && member[b] && (fresh == NULL || (*fresh)[a] || (*fresh)[b]))
+		edges.push_back(make_pair(a, b));
+	}
+    } else if (order_loci) {
+	//
+	// Run the search over a copy of the packed sequences reordered so that similar
+	// loci sit together, then map the pairs found back to the original sequences.
+	//
+	PackedSeqs   sorted;
+	SeedIndex    sorted_idx;
+	vector<uint> order, all;
+	vector<Edge> found;
+	vector<bool> sorted_fresh;
+
+	int buckets = similarity_order(seqs, members, order);
+	cerr << "  Ordered " << members.size() << " loci into " << buckets << " minimizer buckets.\n";
+
+	sorted.permute(seqs, order);
+	sorted_idx.build(sorted, mismatches);
+	for (uint i = 0; i < order.size(); i++)
+	    all.push_back(i);
+	if (fresh != NULL)
+	    for (uint i = 0; i < order.size(); i++)
+		sorted_fresh.push_back((*fresh)[order[i]]);
+
+	search_edges(sorted, sorted_idx, all, mismatches, shard, num_shards, found, fresh != NULL ? &sorted_fresh : NULL);
+
+	for (uint e = 0; e < found.size(); e++) {
+	    uint a = order[found[e].first];
+	    uint b = order[found[e].second];
+	    edges.push_back(a < b ? make_pair(a, b) : make_pair(b, a));
+	}
+	sort(edges.begin(), edges.end());
+    } else {
+	search_edges(seqs, idx, members, mismatches, shard, num_shards, edges, fresh);
+    }
+
+    return edges.size();
+}
+
+//
+// Dispatch to the search for pairs of member loci selected on the command line. If
+// fresh is given, only pairs involving a fresh sequence are searched for; MinHash
+// candidates can't be restricted, so its pairs are filtered once found.
+//
+int
+search_edges(PackedSeqs &seqs, SeedIndex &idx, vector<uint> &members, 
+	     int mismatches, uint shard, uint num_shards, vector<Edge> &edges, vector<bool> *fresh)
+{
+    if (lsh_recall > 0.0) {
+	LshParams lsh;
+	lsh.choose(seqs.min_len, mismatches, members.size(), lsh_recall, lsh_kmer);
+	cerr << "  MinHashing " << members.size() << " loci on " << lsh.bands << " bands of " << lsh.rows 
+	     << " " << lsh.k << "-mer hashes, expected recall " << lsh.recall << ".\n";
+	find_edges_lsh(seqs, members, mismatches, lsh, shard, num_shards, edges);
+
+	if (fresh != NULL) {
+	    uint k = 0;
+	    for (uint e = 0; e < edges.size(); e++)
+		if ((*fresh)[edges[e].first] || (*fresh)[edges[e].second])
+		    edges[k++] = edges[e];
+	    edges.resize(k);
+	}
+
+	if (num_shards == 1) {
+	    double recall = sample_recall(seqs, members, mismatches, edges, 128);
+	    if (recall >= 0.0)
+		cerr << "  Estimated recall on a sample of loci: " << recall << "\n";
+	}
+    } else {
+	//
+	// A long comparison of all pairs saves its progress periodically, and a resumed
+	// run picks it up; other runs start over.
+	//
+	PairsCheckpoint *ckpt = NULL;
+	if (checkpoints && fresh == NULL && config.use_vptree == false && idx.segs == 0) {
+	    string path = checkpoint_path(pairs_checkpoint());
+	    if (resume == false)
+		remove(path.c_str());
+	    ckpt = new PairsCheckpoint(path, pairs_key(seqs, members, mismatches, shard, num_shards), ckpt_interval);
+	}
+	ClusterStage(config).search(seqs, idx, members, mismatches, shard, num_shards, edges, fresh, ckpt);
+	delete ckpt;
+    }
+
+    if (cluster_bench && num_shards == 1)
+	benchmark_search(seqs, idx, members, mismatches);
+
+    return edges.size();
+}
+
+double
+wall_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//
+// Time the exact candidate searches on the loci being clustered, against the
+// brute-force comparison of all pairs. The vantage-point tree is also timed
+// building over nine tenths of the loci and inserting the rest.
+//
+int
+benchmark_search(PackedSeqs &seqs, SeedIndex &idx, vector<uint> &members, int mismatches)
+{
+    vector<Edge> brute, edges;
+    double start;
+
+    cerr << "Benchmarking candidate searches on " << members.size() << " loci, " << mismatches << " mismatches:\n";
+
+    start = wall_time();
+    find_edges_allpairs(seqs, members, mismatches, 0, 1, brute);
+    cerr << "  All pairs:          " << brute.size() << " pairs in " << wall_time() - start << "s\n";
+
+    if (idx.segs > 0) {
+	edges.clear();
+	start = wall_time();
+	find_edges(seqs, idx, members, mismatches, 0, 1, edges);
+	cerr << "  Seed index:         " << edges.size() << " pairs in " << wall_time() - start << "s"
+	     << (edges == brute ? "" : ", DIFFERS from all pairs") << "\n";
+    }
+
+    edges.clear();
+    start = wall_time();
+    find_edges_vptree(seqs, members, mismatches, 0, 1, edges);
+    cerr << "  Vantage-point tree: " << edges.size() << " pairs in " << wall_time() - start << "s"
+	 << (edges == brute ? "" : ", DIFFERS from all pairs") << "\n";
+
+    vector<bool> fresh(seqs.size(), false);
+    for (uint i = members.size() - members.size() / 10; i < members.size(); i++)
+	fresh[members[i]] = true;
+
+    vector<Edge> expected;
+    for (uint e = 0; e < brute.size(); e++)
+	if (fresh[brute[e].first] || fresh[brute[e].second])
+	    expected.push_back(brute[e]);
+
+    edges.clear();
+    start = wall_time();
+    find_edges_vptree(seqs, members, mismatches, 0, 1, edges, &fresh);
+    cerr << "  Tree insertion:     " << edges.size() << " pairs involving the last " << members.size() / 10 
+	 << " loci in " << wall_time() - start << "s" << (edges == expected ? "" : ", DIFFERS from all pairs") << "\n";
+
+    return 0;
+}
+
+//
+// Loci that are not within the cluster distance of any other locus are whitelisted,
+// every locus belonging to a cluster is blacklisted.
+//
+int
+write_clusters(map<int, PLocus *> &catalog, PackedSeqs &seqs, vector<uint> &members, 
+	       vector<Edge> &edges, set<int> &blacklist, ofstream &log_fh, string wl_path)
+{
+    vector<int>  wl;
+    ClusterTally tally;
+
+    ClusterStage(config).classify(catalog, seqs, members, edges, blacklist, wl, tally);
+
+    ofstream wl_fh(wl_path.c_str(), ofstream::out);
+    if (wl_fh.fail()) {
+        cerr << "Error opening WL file '" << wl_path << "'\n";
+	exit(1);
+    }
+    for (uint i = 0; i < wl.size(); i++)
+	wl_fh << wl[i] << "\n";
+
+    return write_cluster_stats(log_fh, tally.non_clustered, tally.clustered, tally.polymorphic);
+}
+
+
+string
+shard_path(int shard)
+{
+    stringstream path;
+    path << in_path << "batch_" << batch_id << ".pmerge_shard_" << shard;
+    return path.str();
+}
+
+//
+// Combine the outputs of merge_cnt shards. Filtering shards are combined into the
+// whitelist and the log, and the retained loci are clustered if requested; clustering
+// shards are combined into the final whitelist and cluster statistics.
+//
+int
+merge_shards(int argc, char **argv)
+{
+    stringstream log, wl, ret;
+    log << in_path << "batch_" << batch_id << ".pmerge.log";
+    wl  << in_path << "batch_" << batch_id << ".WL";
+    ret << in_path << "batch_" << batch_id << ".pmerge_retained.tsv";
+
+    ofstream log_fh(log.str().c_str(), cluster_stage ? ofstream::out | ofstream::app : ofstream::out);
+    if (log_fh.fail()) {
+        cerr << "Error opening log file '" << log.str() << "'\n";
+	exit(1);
+    }
+
+    map<int, PLocus *> catalog;
+    LocusArena arena;
+    set<int>   blacklist;
+    string     dir;
+
+    if (cluster_stage == false) {
+	init_log(log_fh, argc, argv);
+
+	FilterLog flog(pop_indexes, "");
+	ofstream  wl_fh(wl.str().c_str(), ofstream::out);
+	ofstream  ret_fh(ret.str().c_str(), ofstream::out);
+	if (wl_fh.fail() || ret_fh.fail()) {
+	    cerr << "Error opening WL file '" << wl.str() << "'\n";
+	    exit(1);
+	}
+
+	cerr << "Merging " << merge_cnt << " filtering shards.\n";
+	for (int i = 1; i <= merge_cnt; i++) {
+	    dir = shard_path(i);
+	    flog.absorb(dir);
+	    append_file(dir + "/WL", wl_fh);
+	    append_file(dir + "/retained", ret_fh);
+	}
+	wl_fh.close();
+	ret_fh.close();
+
+	if (report_filters(flog, log_fh) < 0)
+	    exit(0);
+
+	for (int i = 1; i <= merge_cnt; i++)
+	    flog.remove_shard(shard_path(i));
+
+	if (config.cluster_similarity > 0.0) {
+	    if (load_batch_catalog(catalog, arena) == 0)
+		return 0;
+	    select_loci(catalog, ret.str());
+	    cluster_filter(catalog, blacklist, log_fh, wl.str());
+	    cerr << "Removing " << blacklist.size() << " additional loci which are clustered within the specified threshold...";
+	}
+	return 0;
+    }
+
+    if (load_batch_catalog(catalog, arena) == 0)
+	return 0;
+    select_loci(catalog, ret.str());
+
+    PackedSeqs   seqs;
+    vector<uint> members;
+    vector<Edge> edges;
+    int a, b;
+
+    seqs.build(catalog);
+    for (uint i = 0; i < seqs.size(); i++)
+	members.push_back(i);
+
+    cerr << "Merging " << merge_cnt << " clustering shards.\n";
+    for (int i = 1; i <= merge_cnt; i++) {
+	dir = shard_path(i);
+
+	ifstream fh((dir + "/edges.tsv").c_str(), ifstream::in);
+	if (fh.fail()) {
+	    cerr << "Error opening shard edges '" << dir << "/edges.tsv'\n";
+	    exit(1);
+	}
+	while (fh >> a >> b) {
+	    if (seqs.index(a) < 0 || seqs.index(b) < 0) {
+		cerr << "Error: shard " << i << " clustered loci " << a << " and " << b << ", which were not retained by the filtering stage.\n";
+		exit(1);
+	    }
+	    edges.push_back(make_pair((uint) seqs.index(a), (uint) seqs.index(b)));
+	}
+	fh.close();
+    }
+    sort(edges.begin(), edges.end());
+    edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+    write_clusters(catalog, seqs, members, edges, blacklist, log_fh, wl.str());
+    cerr << "Removing " << blacklist.size() << " additional loci which are clustered within the specified threshold...";
+
+    for (int i = 1; i <= merge_cnt; i++) {
+	dir = shard_path(i);
+	remove((dir + "/edges.tsv").c_str());
+	remove((dir + "/pmerge.log").c_str());
+	rmdir(dir.c_str());
+    }
+
+    return 0;
+}
+
+//
+// Load the batch catalog and apply the user's white and black lists.
+//
+int
+load_batch_catalog(map<int, PLocus *> &catalog, LocusArena &arena)
+{
+    stringstream catalog_file;
+    catalog_file << in_path << "batch_" << batch_id << ".catalog";
+    if (load_catalog(catalog_file.str(), catalog, arena) == 0) {
+    	cerr << "Unable to load the catalog '" << catalog_file.str() << "'\n";
+     	return 0;
+    }
+
+    //
+    // Check the whitelist.
+    //
+    check_whitelist_integrity(catalog, whitelist);
+
+    //
+    // Implement the black/white list
+    //
+    reduce_catalog(catalog, whitelist, blacklist);
+
+    //
+    // If the catalog is not reference aligned, assign an arbitrary ordering to catalog loci.
+    //
+    loci_ordered = order_unordered_loci(catalog);
+
+    //
+    // Keep track of every catalog locus for the seed index.
+    //
+    if (index_path.length() > 0)
+	index_catalog = catalog;
+
+    return catalog.size();
+}
+
+//
+// Write the IDs of the catalog loci, one per line.
+//
+int
+write_loci(map<int, PLocus *> &catalog, string path)
+{
+    map<int, PLocus *>::iterator it;
+
+    ofstream fh(path.c_str(), ofstream::out);
+    if (fh.fail()) {
+	cerr << "Error opening '" << path << "'\n";
+	exit(1);
+    }
+    for (it = catalog.begin(); it != catalog.end(); it++)
+	fh << it->first << "\n";
+    fh.close();
+
+    return 0;
+}
+
+int
+append_file(string path, ofstream &out_fh)
+{
+    ifstream fh(path.c_str(), ifstream::in);
+    if (fh.fail()) {
+	cerr << "Error opening '" << path << "'\n";
+	exit(1);
+    }
+    if (fh.peek() != EOF)
+	out_fh << fh.rdbuf();
+    fh.close();
+
+    return 0;
+}
+
+//
+// Reduce the catalog to the loci listed in a file written by an earlier stage.
+//
+int
+select_loci(map<int, PLocus *> &catalog, string path)
+{
+    set<int> list, empty;
+
+    load_marker_list(path, list);
+    reduce_catalog(catalog, list, empty);
+
+    return catalog.size();
+}
+
+
+		
+
+
+
+
+
+
+int parse_command_line(int argc, char* argv[]) {
+    int c;
+     
+    while (1) {
+	static struct option long_options[] = {
+	    {"num_threads",    required_argument, NULL, 't'},
+	    {"batch_id",       required_argument, NULL, 'b'},
+	    {"progeny",        required_argument, NULL, 'r'},
+	    {"min_populations",   required_argument, NULL, 'p'},
+            {"in_path",        required_argument, NULL, 'P'},
+             {"out_path",        required_argument, NULL, 'o'},
             {"pop_map",        required_argument, NULL, 'M'}, 
 	    {"minor_allele_freq", required_argument, NULL, 'a'},
             {"max_obs_het",       required_argument, NULL, 'q'},
             {"lnl_lim",           required_argument, NULL, 'c'},
             {"min_depth",      required_argument, NULL, 'm'},
             {"ct", required_argument, NULL, 'C'},
+            {"chunk_size",     required_argument, NULL, opt_chunk_size},
+            {"chunk_by_chr",   no_argument,       NULL, opt_chunk_by_chr},
+            {"tmp_path",       required_argument, NULL, opt_tmp_path},
+            {"shard",          required_argument, NULL, opt_shard},
+            {"merge",          required_argument, NULL, opt_merge},
+            {"stage",          required_argument, NULL, opt_stage},
+            {"index",          no_argument,       NULL, opt_index},
+            {"lsh",            required_argument, NULL, opt_lsh},
+            {"lsh_kmer",       required_argument, NULL, opt_lsh_kmer},
+            {"vptree",         no_argument,       NULL, opt_vptree},
+            {"cluster_bench",  no_argument,       NULL, opt_cluster_bench},
+            {"order_loci",     no_argument,       NULL, opt_order_loci},
+            {"hierarchy",      required_argument, NULL, opt_hierarchy},
+            {"from_hierarchy", no_argument,       NULL, opt_from_hierarchy},
+            {"estimate",       required_argument, NULL, opt_estimate},
+            {"fst_screen",     required_argument, NULL, opt_fst_screen},
+            {"het_excess",     required_argument, NULL, opt_het_excess},
+            {"het_cluster",    required_argument, NULL, opt_het_cluster},
+            {"checkpoint",     required_argument, NULL, opt_checkpoint},
+            {"resume",         no_argument,       NULL, opt_resume},
 	    {0, 0, 0, 0}
 	};	
 	// getopt_long stores the option index here.
@@ -1211,25 +1736,115 @@ int parse_command_line(int argc, char* argv[]) {
 	    pmap_path = optarg;
 	    break;
 	case 'r':
-	    sample_limit = atof(optarg);
+	    config.sample_limit = atof(optarg);
 	    break;
 	case 'p':
-	    population_limit = atoi(optarg);
+	    config.population_limit = atoi(optarg);
 	    break;
 	case 'a':
-	    minor_allele_freq = atof(optarg);
+	    config.minor_allele_freq = atof(optarg);
 	    break;
        case 'C':
-	    cluster_similarity = atof(optarg);
+	    config.cluster_similarity = atof(optarg);
 	    break;
       case 'c':
-	    lnl_limit  = is_double(optarg);
+	    config.lnl_limit  = is_double(optarg);
 	    break;
       case 'm':
-	    min_stack_depth = atoi(optarg);
+	    config.min_stack_depth = atoi(optarg);
 	    break;
       case 'q':
-	    max_obs_het = is_double(optarg);
+	    config.max_obs_het = is_double(optarg);
+	    break;
+      case opt_chunk_size:
+	    chunk_size = is_integer(optarg);
+	    if (chunk_size < 0) {
+		cerr << "Chunk size (--chunk_size) must be a positive integer.\n";
+		help();
+	    }
+	    break;
+      case opt_chunk_by_chr:
+	    chunk_by_chr = true;
+	    break;
+      case opt_tmp_path:
+	    tmp_path = optarg;
+	    break;
+      case opt_shard:
+	    if (sscanf(optarg, "%d/%d", &shard_num, &shard_cnt) != 2 ||
+		shard_cnt < 1 || shard_num < 1 || shard_num > shard_cnt) {
+		cerr << "Shard (--shard) must be given as i/n, with 1 <= i <= n.\n";
+		help();
+	    }
+	    break;
+      case opt_merge:
+	    merge_cnt = is_integer(optarg);
+	    if (merge_cnt < 1) {
+		cerr << "Number of shards to merge (--merge) must be a positive integer.\n";
+		help();
+	    }
+	    break;
+      case opt_index:
+	    index_path = "-";
+	    break;
+      case opt_lsh:
+	    lsh_recall = atof(optarg);
+	    if (lsh_recall <= 0.0 || lsh_recall >= 1.0) {
+		cerr << "Target recall (--lsh) must be between 0 and 1.\n";
+		help();
+	    }
+	    break;
+      case opt_lsh_kmer:
+	    lsh_kmer = is_integer(optarg);
+	    if (lsh_kmer < 4 || lsh_kmer > 32) {
+		cerr << "K-mer length (--lsh_kmer) must be between 4 and 32.\n";
+		help();
+	    }
+	    break;
+      case opt_vptree:
+	    config.use_vptree = true;
+	    break;
+      case opt_cluster_bench:
+	    cluster_bench = true;
+	    break;
+      case opt_order_loci:
+	    order_loci = true;
+	    break;
+      case opt_hierarchy:
+	    hierarchy_similarity = atof(optarg);
+	    break;
+      case opt_from_hierarchy:
+	    from_hierarchy = true;
+	    break;
+      case opt_estimate:
+	    estimate_cnt = is_integer(optarg);
+	    break;
+      case opt_fst_screen:
+	    config.fst_screen_p = atof(optarg);
+	    break;
+      case opt_het_excess:
+	    config.het_excess_limit = is_double(optarg);
+	    break;
+      case opt_het_cluster:
+	    config.het_priority      = true;
+	    config.het_cluster_limit = is_double(optarg);
+	    break;
+      case opt_checkpoint:
+	    checkpoints   = true;
+	    ckpt_interval = is_double(optarg) * 60;
+	    break;
+      case opt_resume:
+	    checkpoints = true;
+	    resume      = true;
+	    break;
+      case opt_stage:
+	    if (strcmp(optarg, "filter") == 0)
+		cluster_stage = false;
+	    else if (strcmp(optarg, "cluster") == 0)
+		cluster_stage = true;
+	    else {
+		cerr << "Unknown stage (--stage) '" << optarg << "', expecting 'filter' or 'cluster'.\n";
+		help();
+	    }
 	    break;
 	default:
 	    help();
@@ -1243,6 +1858,87 @@ int parse_command_line(int argc, char* argv[]) {
 
     if (in_path.at(in_path.length() - 1) != '/') 
 	in_path += "/";
+
+    if (tmp_path.length() > 0 && tmp_path.at(tmp_path.length() - 1) != '/') 
+	tmp_path += "/";
+
+    if (index_path.length() > 0) {
+	stringstream path;
+	path << in_path << "batch_" << batch_id << ".pmerge.index";
+	index_path = path.str();
+    }
+
+    if (hierarchy_similarity > 0.0 && (hierarchy_similarity > config.cluster_similarity || config.cluster_similarity <= 0.0)) {
+	cerr << "The hierarchy similarity (--hierarchy) must be given with, and be no higher than, the cluster similarity (-C).\n";
+	help();
+    }
+
+    if (hierarchy_similarity > 0.0 && (shard_cnt > 0 || merge_cnt > 0)) {
+	cerr << "A hierarchy (--hierarchy) cannot be written by sharded runs.\n";
+	help();
+    }
+
+    if (estimate_cnt < 0 || (estimate_cnt > 0 && config.cluster_similarity <= 0.0)) {
+	cerr << "Estimating the clustering (--estimate) requires a positive number of loci and a cluster similarity (-C).\n";
+	help();
+    }
+
+    if (estimate_cnt > 0 && (shard_cnt > 0 || merge_cnt > 0 || from_hierarchy)) {
+	cerr << "An estimate (--estimate) cannot be combined with sharded runs or --from_hierarchy.\n";
+	help();
+    }
+
+    if (config.fst_screen_p < 0.0 || config.fst_screen_p > 1.0) {
+	cerr << "The Fst screen significance level (--fst_screen) must be between 0 and 1.\n";
+	help();
+    }
+
+    if (config.het_excess_limit < 0.0) {
+	cerr << "The heterozygote excess limit (--het_excess) must be positive.\n";
+	help();
+    }
+
+    if (config.het_priority && (config.cluster_similarity <= 0.0 || shard_cnt > 0 || merge_cnt > 0 || 
+			 hierarchy_similarity > 0.0 || from_hierarchy || estimate_cnt > 0)) {
+	cerr << "Limiting clustering by heterozygote excess (--het_cluster) requires a cluster similarity (-C), and cannot\n"
+	     << "be combined with sharded runs, --hierarchy, --from_hierarchy or --estimate.\n";
+	help();
+    }
+
+    if (checkpoints && ckpt_interval <= 0.0) {
+	cerr << "The checkpoint interval (--checkpoint) must be a positive number of minutes.\n";
+	help();
+    }
+
+    if (from_hierarchy && config.cluster_similarity <= 0.0) {
+	cerr << "Extracting clusters from a hierarchy (--from_hierarchy) requires a cluster similarity (-C).\n";
+	help();
+    }
+
+    if (lsh_recall > 0.0 && config.use_vptree) {
+	cerr << "Only one of the approximate search (--lsh) and the vantage-point tree (--vptree) can be used.\n";
+	help();
+    }
+
+    if (lsh_recall > 0.0 && index_path.length() > 0) {
+	cerr << "The approximate search (--lsh) cannot be combined with a seed index (--index).\n";
+	help();
+    }
+
+    if (shard_cnt > 0 && merge_cnt > 0) {
+	cerr << "A run can either process a shard (--shard) or merge shards (--merge), not both.\n";
+	help();
+    }
+
+    if (cluster_stage && shard_cnt == 0 && merge_cnt == 0) {
+	cerr << "The clustering stage (--stage cluster) is run as shards (--shard) or to merge shards (--merge).\n";
+	help();
+    }
+
+    if (cluster_stage && config.cluster_similarity <= 0.0) {
+	cerr << "The clustering stage (--stage cluster) requires a cluster similarity (-C).\n";
+	help();
+    }
     
 	 
     if (pmap_path.length() == 0) {
@@ -1257,32 +1953,32 @@ int parse_command_line(int argc, char* argv[]) {
     }
 
   
-    if (minor_allele_freq > 0) {
-	if (minor_allele_freq > 1)
-	    minor_allele_freq = minor_allele_freq / 100;
+    if (config.minor_allele_freq > 0) {
+	if (config.minor_allele_freq > 1)
+	    config.minor_allele_freq = config.minor_allele_freq / 100;
 
-	if (minor_allele_freq > 0.5) {
+	if (config.minor_allele_freq > 0.5) {
 	    cerr << "Unable to parse the minor allele frequency\n";
 	    help();
 	}
     }
 
-  if (max_obs_het != 1.0) {
-	if (max_obs_het > 1)
-	    max_obs_het = max_obs_het / 100;
+  if (config.max_obs_het != 1.0) {
+	if (config.max_obs_het > 1)
+	    config.max_obs_het = config.max_obs_het / 100;
 
-	if (max_obs_het < 0 || max_obs_het > 1.0) {
+	if (config.max_obs_het < 0 || config.max_obs_het > 1.0) {
 	    cerr << "Unable to parse the maximum observed heterozygosity.\n";
 	    help();
 	}
     }
 
 
-    if (sample_limit > 0) {
-	if (sample_limit > 1)
-	    sample_limit = sample_limit / 100;
+    if (config.sample_limit > 0) {
+	if (config.sample_limit > 1)
+	    config.sample_limit = config.sample_limit / 100;
 
-	if (sample_limit > 1.0) {
+	if (config.sample_limit > 1.0) {
 	    cerr << "Unable to parse the sample limit frequency\n";
 	    help();
 	}
@@ -1313,7 +2009,42 @@ void help() {
 	      << "    m: specify a minimum stack depth required for individuals at a locus.\n"
 	      << "    a: specify a minimum minor allele frequency required to process a nucleotide site at a locus (0 < a < 0.5).\n"  
 	      << "    c: filter loci with log likelihood values below this threshold.\n"
-              << "    C: minimum percentage of similarity between loci to cluster. \n";
+              << "    C: minimum percentage of similarity between loci to cluster. \n"
+	      << "    --fst_screen <p>: remove loci whose allele frequencies differ significantly between any two\n"
+	      << "      populations (Fisher's exact test at each SNP, Bonferroni corrected for the population pairs\n"
+	      << "      and the SNPs of the locus), as likely paralogs.\n"
+	      << "    --het_excess <x>: remove loci whose observed heterozygosity, pooled over sites and populations,\n"
+	      << "      exceeds Hardy-Weinberg expectations by more than the fraction x, as likely paralogs.\n"
+	      << "  Out-of-core processing:\n"
+	      << "    --chunk_size <n>: filter the catalog in chunks of n loci, spilling sample data to disk.\n"
+	      << "    --chunk_by_chr: build chunks from whole chromosomes of a reference aligned catalog.\n"
+	      << "    --tmp_path <path>: directory for spill files (default: the Stacks output directory).\n"
+	      << "  Sharded processing:\n"
+	      << "    --shard <i/n>: run shard i of n; filtering shards process a range of catalog loci,\n"
+	      << "      clustering shards generate a partition of the candidate pairs of loci.\n"
+	      << "    --merge <n>: combine the outputs of n shards into the whitelist and log.\n"
+	      << "    --stage <filter|cluster>: the stage run by --shard and --merge (default: filter).\n"
+	      << "  Checkpoints:\n"
+	      << "    --checkpoint <minutes>: write a checkpoint once the loci are filtered, and save the progress of a\n"
+	      << "      comparison of all pairs of loci at this interval, to batch_<id>.pmerge_checkpoint.\n"
+	      << "    --resume: resume from the latest valid checkpoint, if any (implies --checkpoint, every 10 minutes).\n"
+	      << "  Paralog clustering:\n"
+	      << "    --index: keep a seed index and the clusters of the catalog in batch_<id>.pmerge.index; later runs\n"
+	      << "      reuse it, comparing only the loci added to or changed in the catalog since.\n"
+	      << "    --lsh <recall>: find clustered loci approximately with MinHash, for a target recall (0 to 1) of\n"
+	      << "      pairs at the cluster distance; suited to low similarity thresholds.\n"
+	      << "    --lsh_kmer <k>: k-mer length for --lsh (default: chosen from the cluster distance).\n"
+	      << "    --vptree: find clustered loci with range queries on a vantage-point tree.\n"
+	      << "    --cluster_bench: time the exact searches for clustered loci against comparing all pairs.\n"
+	      << "    --order_loci: reorder the loci by sequence similarity (minimizers) before searching for clustered loci.\n"
+	      << "    --hierarchy <similarity>: also write the single-linkage hierarchy of the loci down to this similarity\n"
+	      << "      to batch_<id>.pmerge.hierarchy.tsv.\n"
+	      << "    --from_hierarchy: write the whitelist at the cluster similarity (-C) from a stored hierarchy, without\n"
+	      << "      loading any data.\n"
+	      << "    --estimate <n>: estimate the fraction of clustered loci and the time to cluster the whole catalog from\n"
+	      << "      a random sample of n loci, without filtering or clustering.\n"
+	      << "    --het_cluster <x>: only search for clustered pairs involving a locus whose heterozygote excess\n"
+	      << "      (as for --het_excess) is at least x; other pairs of loci are not compared.\n";
 	     
     
 
@@ -26,6 +26,10 @@
 #endif
 #include <getopt.h> // Process command-line options
 #include <dirent.h> // Open/Read contents of a directory
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +43,7 @@ using std::string;
 #include <fstream>
 using std::ifstream;
 using std::ofstream;
+using std::ostream;
 using std::cin;
 using std::cout;
 using std::cerr;
@@ -64,20 +69,71 @@ using std::set;
 #include "catalog_utils.h"
 #include "sql_utilities.h"
 #include "utils.h"
-#include "tags.h"
+#include "chunks.h"
+#include "cluster.h"
+#include "checkpoint.h"
+#include "libpmerge.h"
 
+//
+// Read model calls directly from each sample's tags file.
+//
+class SampleModels : public ModelSource {
+    string          path;
+    vector<string> &names;
+
+public:
+    SampleModels(string path, vector<string> &names) : path(path), names(names) {}
+
+    int load(uint i, map<int, ModRes *> &modres) {
+	load_model_results(this->path + this->names[i], modres);
+	return modres.size();
+    }
+    void report_missing(uint i) {
+	cerr << "Warning: unable to find any model results in file '" << this->names[i] << "', excluding this sample from population analysis.\n";
+    }
+};
+
+//
+// Codes for command-line options that only have a long form.
+//
+enum {opt_chunk_size = 256, opt_chunk_by_chr, opt_tmp_path, 
+      opt_shard, opt_merge, opt_stage, opt_index,
+      opt_lsh, opt_lsh_kmer, opt_vptree, opt_cluster_bench,
+      opt_order_loci, opt_hierarchy, opt_from_hierarchy,
+      opt_estimate, opt_fst_screen, opt_het_excess, opt_het_cluster,
+      opt_checkpoint, opt_resume};
 
 void    help( void );
 void    version( void );
 int     parse_command_line(int, char**);
-int     build_file_list(vector<pair<int, string> > &, map<int, pair<int, int> > &, map<int, vector<int> > &);
+int     build_file_list(vector<pair<int, string> > &, map<int, pair<int, int> > &, map<int, vector<int> > &, PopLayout &);
 int     load_marker_list(string, set<int> &);
 int     load_marker_column_list(string, map<int, set<int> > &);
-int     apply_locus_constraints(map<int, CSLocus *> &, PopMap<CSLocus> *, map<int, pair<int, int> > &);
-int     prune_polymorphic_sites(map<int, CSLocus *> &, PopMap<CSLocus> *, PopSum<CSLocus> *, map<int, pair<int, int> > &, map<int, set<int> > &, set<int> &, ofstream &, string);
-int     cluster_filter(map<int, CSLocus *> &,set<int> &,ofstream &, string);
-bool    order_unordered_loci(map<int, CSLocus *> &);
-bool    compare_pop_map(pair<int, string>, pair<int, string>);
+int     report_filters(FilterLog &, ofstream &);
+int     build_chunks(map<int, PLocus *> &, vector<vector<int> > &);
+int     cluster_filter(map<int, PLocus *> &,set<int> &,ofstream &, string);
+int     write_hierarchy(map<int, PLocus *> &, PackedSeqs &, vector<Edge> &, vector<int> &, int, string);
+int     query_hierarchy(int, char **);
+int     estimate_clusters(int, char **);
+int     prepare_clustering(map<int, PLocus *> &, int, PackedSeqs &, SeedIndex &, ClusterState &, SeedIndexFile &, vector<uint> &);
+uint64_t file_stamp(string);
+uint64_t catalog_stamp();
+string  checkpoint_path(string);
+string  pairs_checkpoint();
+uint64_t filter_key(vector<pair<int, string> > &);
+uint64_t pairs_key(PackedSeqs &, vector<uint> &, int, uint, uint);
+int     remove_checkpoints();
+int     cluster_edges(PackedSeqs &, SeedIndex &, ClusterState &, vector<uint> &, int, uint, uint, vector<Edge> &, vector<bool> * = NULL);
+int     search_edges(PackedSeqs &, SeedIndex &, vector<uint> &, int, uint, uint, vector<Edge> &, vector<bool> * = NULL);
+int     benchmark_search(PackedSeqs &, SeedIndex &, vector<uint> &, int);
+double  wall_time();
+int     write_clusters(map<int, PLocus *> &, PackedSeqs &, vector<uint> &, vector<Edge> &, set<int> &, ofstream &, string);
+string  shard_path(int);
+int     merge_shards(int, char **);
+int     load_batch_catalog(map<int, PLocus *> &, LocusArena &);
+int     select_loci(map<int, PLocus *> &, string);
+int     write_loci(map<int, PLocus *> &, string);
+int     append_file(string, ofstream &);
 
 
 
@@ -30,6 +30,7 @@
 
 #include "input.h"
 #include "utils.h"
+#include "chunks.h"
 
 //
 // The expected number of tab-separated fields in our SQL input files.
@@ -385,6 +386,127 @@ load_loci(string sample,  map<int, LocusT *> &loci, bool store_reads, bool load_
     return 1;
 }
 
+//
+// Load a catalog directly into compact PLocus objects allocated from a LocusArena.
+// Only the consensus sequence, genomic location and heterozygous SNP columns are
+// kept; model calls, reads, components and alleles are skipped while parsing.
+//
+int
+load_catalog(string sample, map<int, PLocus *> &loci, LocusArena &arena)
+{
+    PLocus        *c;
+    string         f;
+    vector<string> parts;
+    set<int>       blacklisted;
+    long int       line_num;
+    ifstream       fh;
+    map<int, vector<uint16_t> > snps;
+    map<int, vector<uint16_t> >::iterator sit;
+
+    char *line      = (char *) malloc(sizeof(char) * max_len);
+    int   size      = max_len;
+    int   fh_status = 1;
+    int   id;
+
+    f = sample + ".tags.tsv";
+    fh.open(f.c_str(), ifstream::in);
+    cerr << "  Parsing " << f.c_str() << "\n";
+
+    line_num = 1;
+    while (fh_status) {
+        fh_status = read_line(fh, &line, &size);
+
+        if (!fh_status && strlen(line) == 0)
+	    continue;
+
+	if (is_comment(line)) continue;
+
+	parse_tsv(line, parts);
+
+        if (parts.size() != num_tags_fields) {
+            cerr << "Error parsing " << f.c_str() << " at line: " << line_num << ". (" << parts.size() << " fields).\n";
+            return 0;
+        }
+
+	//
+	// Model calls and reads of catalog loci are not needed.
+	//
+	if (parts[6] != "consensus") {
+	    line_num++;
+	    continue;
+	}
+
+        id = atoi(parts[2].c_str());
+
+	if (parts[11] == "1") {
+	    blacklisted.insert(id);
+	    continue;
+	}
+
+	c = arena.new_locus();
+	c->id = id;
+	arena.add_consensus(c, parts[9].c_str());
+	c->loc.chr    = arena.intern_chr(parts[3].c_str());
+	c->loc.bp     = atoi(parts[4].c_str());
+	c->loc.strand = parts[5] == "+" ? plus : minus;
+
+	loci[c->id] = c;
+
+        line_num++;
+    }
+    fh.close();
+
+    fh_status = 1;
+    line_num  = 1;
+
+    f = sample + ".snps.tsv";
+    fh.open(f.c_str(), ifstream::in);
+    cerr << "  Parsing " << f.c_str() << "\n";
+
+    while (fh_status) {
+        fh_status = read_line(fh, &line, &size);
+
+        if (!fh_status && strlen(line) == 0)
+	    continue;
+
+	if (is_comment(line)) continue;
+
+	parse_tsv(line, parts);
+
+        if (parts.size() != num_snps_fields && parts.size() != num_snps_fields - 2) {
+            cerr << "Error parsing " << f.c_str() << " at line: " << line_num << ". (" << parts.size() << " fields).\n";
+            return 0;
+        }
+
+        id = atoi(parts[2].c_str());
+
+	//
+	// Only load heterozygous model calls.
+	//
+	if (blacklisted.count(id) || parts[4] != "E")
+	    continue;
+
+        if (loci.count(id) == 0) {
+            cerr << "Error parsing " << f.c_str() << " at line: " << line_num << ". SNP asks for nonexistent locus with ID: " << id << "\n";
+            return 0;
+        }
+	snps[id].push_back(atoi(parts[3].c_str()));
+
+        line_num++;
+    }
+    fh.close();
+
+    //
+    // Place each locus' SNP columns contiguously in the arena.
+    //
+    for (sit = snps.begin(); sit != snps.end(); sit++)
+	arena.add_snps(loci[sit->first], sit->second);
+
+    free(line);
+
+    return 1;
+}
+
 template <class LocusT>
 int dump_loci(map<int, LocusT *> &u) {
     typename map<int, LocusT *>::iterator i;
@@ -557,6 +679,118 @@ int load_model_results(string sample,  map<int, ModRes *> &modres) {
     return 1;
 }
 
+//
+// Stream the matches and model calls of one sample into the spill files of the locus
+// chunks they belong to. Returns the number of matches found in the sample, and sets
+// the sample ID and the number of model records found in the sample.
+//
+int spill_sample(string sample, ChunkSpill &spill, uint index, int &sample_id, uint &model_cnt) {
+    string         f;
+    vector<string> parts;
+    long int       line_num;
+    ifstream       fh;
+    int            chunk, tag_id;
+    uint           match_cnt = 0;
+
+    vector<pair<int, uint> > tag_chunks;
+    vector<pair<int, uint> >::iterator tit;
+
+    char *line      = (char *) malloc(sizeof(char) * max_len);
+    int   size      = max_len;
+    int   fh_status = 1;
+
+    model_cnt = 0;
+
+    f = sample + ".matches.tsv";
+    fh.open(f.c_str(), ifstream::in);
+    cerr << "  Parsing " << f.c_str() << "\n";
+
+    //
+    // A sample rejected part way through its files must leave nothing in the spill
+    // files, as the next sample is spilled under the same index.
+    //
+    spill.mark();
+
+    line_num = 1;
+    while (fh_status) {
+	fh_status = read_line(fh, &line, &size);
+	line_num++;
+
+	if (!fh_status && strlen(line) == 0)
+	    continue;
+	if (is_comment(line)) continue;
+
+	parse_tsv(line, parts);
+
+	if ( (parts.size() != num_matches_fields) && (parts.size() != num_matches_fields-1)) {
+	    cerr << "Error parsing " << f.c_str() << " at line: " << line_num << ". (" << parts.size() << " fields).\n";
+	    spill.drop_matches();
+	    free(line);
+	    return 0;
+	}
+
+	if (match_cnt == 0)
+	    sample_id = atoi(parts[3].c_str());
+	match_cnt++;
+
+	if ((chunk = spill.chunk(atoi(parts[2].c_str()))) < 0)
+	    continue;
+
+	spill.add_match(chunk, index, parts);
+	tag_chunks.push_back(make_pair(atoi(parts[4].c_str()), (uint) chunk));
+    }
+    fh.close();
+
+    if (match_cnt == 0) {
+	free(line);
+	return 0;
+    }
+
+    //
+    // A sample locus may match several catalog loci, possibly in different chunks.
+    //
+    sort(tag_chunks.begin(), tag_chunks.end());
+    tag_chunks.erase(unique(tag_chunks.begin(), tag_chunks.end()), tag_chunks.end());
+
+    f = sample + ".tags.tsv";
+    fh.clear();
+    fh.open(f.c_str(), ifstream::in);
+    cerr << "  Parsing " << f.c_str() << "\n";
+
+    fh_status = 1;
+    line_num  = 1;
+    while (fh_status) {
+	fh_status = read_line(fh, &line, &size);
+	line_num++;
+
+	if (!fh_status && strlen(line) == 0)
+	    continue;
+	if (is_comment(line)) continue;
+
+	parse_tsv(line, parts);
+
+	if (parts.size() != num_tags_fields) {
+	    cerr << "Error parsing " << f.c_str() << " at line: " << line_num << ". (" << parts.size() << " fields).\n";
+	    spill.drop_models();
+	    model_cnt = 0;
+	    break;
+	}
+
+	if (parts[6] != "model") continue;
+
+	model_cnt++;
+	tag_id = atoi(parts[2].c_str());
+	tit    = lower_bound(tag_chunks.begin(), tag_chunks.end(), make_pair(tag_id, (uint) 0));
+	for (; tit != tag_chunks.end() && tit->first == tag_id; tit++)
+	    spill.add_model(tit->second, index, tag_id, parts[9].c_str());
+    }
+    fh.close();
+
+    free(line);
+
+    return match_cnt;
+}
+
 int load_snp_calls(string sample,  map<int, SNPRes *> &snpres) {
     string         f;
     int id, samp_id;
@@ -202,9 +202,53 @@ reduced_factorial(double n, double d)
     return f;
 }
 
+LogFactorials log_factorials;
+
+LogFactorials::LogFactorials()
+{
+    this->ready = 0;
+    for (uint b = 0; b < max_blocks; b++)
+	this->blocks[b] = NULL;
+}
+
+LogFactorials::~LogFactorials()
+{
+    for (uint b = 0; b < max_blocks; b++)
+	delete [] this->blocks[b];
+}
+
+void
+LogFactorials::grow(uint n)
+{
+    #pragma omp critical(log_factorials)
+    {
+	uint r = this->ready;
+
+	while (r <= n) {
+	    uint    b     = r >> block_bits;
+	    double *block = new double[block_size];
+	    double  f     = r > 0 ? this->blocks[b - 1][block_size - 1] : 0.0;
+
+	    for (uint i = 0; i < block_size; i++) {
+		uint v = r + i;
+		if (v > 1) f += log((double) v);
+		block[i] = f;
+	    }
+	    this->blocks[b] = block;
+	    r += block_size;
+	}
+
+	#pragma omp atomic write seq_cst
+	this->ready = r;
+    }
+}
+
 double 
 log_factorial(double n) 
 {
+    if (n >= 0 && n == floor(n))
+	return log_factorials((uint) n);
+
     double fact = 0;
 
     for (double i = n; i > 1; i--)
@@ -225,6 +269,9 @@ reduced_log_factorial(double n, double d)
     else if (f == 1)
         return log(n);
 
+    if (d >= 0 && n == floor(n) && d == floor(d))
+	return log_factorials((uint) n) - log_factorials((uint) d);
+
     f = log(n);
     n--;
     while (n > d) {
@@ -45,6 +45,47 @@ double reduced_factorial(double, double);
 
 double log_factorial(double);
 double reduced_log_factorial(double, double);
+
+//
+// Table of log(n!), shared by all threads and grown in blocks as larger values are
+// requested. Blocks never move once published, so lookups of values already in the
+// table take no lock; only growing the table is serialized.
+//
+class LogFactorials {
+    static const uint block_bits = 12;
+    static const uint block_size = 1 << block_bits;
+    static const uint max_blocks = 1024;
+
+    double *blocks[max_blocks];
+    uint    ready;   // Number of values in the table.
+
+    void grow(uint);
+
+public:
+    LogFactorials();
+    ~LogFactorials();
+
+    double operator()(uint n) {
+	uint r;
+	#pragma omp atomic read seq_cst
+	r = this->ready;
+	if (n >= r) {
+	    if (n >= max_blocks * block_size)
+		return lgamma(n + 1.0);
+	    this->grow(n);
+	}
+	return this->blocks[n >> block_bits][n & (block_size - 1)];
+    }
+    //
+    // Log of the binomial coefficient n choose k.
+    //
+    double choose(uint n, uint k) {
+	if (k > n) return -INFINITY;
+	return (*this)(n) - (*this)(k) - (*this)(n - k);
+    }
+};
+
+extern LogFactorials log_factorials;
 //
 // Comparison functions for the STL sort routine
 //